@@ -11,8 +11,10 @@
 #include "bootstrap.h"
 #include "net.h"
 #include "socket.h"
+#include "shm.h"
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 // [RCCL]
 #include "clique/CliqueManager.h"
 #include "clique/CliqueShmNames.h"
@@ -88,10 +90,218 @@ static ncclResult_t bootstrapNetRecv(int fd, union socketAddress *addr, void* da
 struct extInfo {
   int rank;
   int nranks;
+  int treeFanout; // [RCCL] 0 : root replies to every rank, >0 : root replies through a tree
   union socketAddress extAddressListenRoot;
   union socketAddress extAddressListen;
 };
 
+// [RCCL] Hierarchical bootstrap
+// Instead of the root connecting back to every rank in turn, the root pushes the
+// whole address table to the first treeFanout ranks, and every rank forwards it
+// to its own children (ranks (r+1)*fanout .. (r+1)*fanout+fanout-1).
+// Only the redistribution goes through the tree : ranks know nothing but the root
+// address before they get the table, so they cannot reach a parent to gather their
+// subtree through it. The root still accepts one connection and one extInfo per rank,
+// which rootGatherNext reads concurrently rather than one rank after the other.
+RCCL_PARAM(BootstrapTree, "BOOTSTRAP_TREE", 0);
+RCCL_PARAM(BootstrapTreeFanout, "BOOTSTRAP_TREE_FANOUT", 8);
+
+static int bootstrapTreeFanout() {
+  if (rcclParamBootstrapTree() == 0) return 0;
+  return std::max(2, (int)rcclParamBootstrapTreeFanout());
+}
+
+// Address table sent down the tree : root pid, then the listen addresses used to
+// reach each rank from its tree parent, then the ring/p2p listen addresses.
+static size_t bootstrapTreeTableSize(int nranks) {
+  return sizeof(int) + 2*nranks*sizeof(union socketAddress);
+}
+
+// Send the same message to several peers at once, progressing all of them as
+// their sockets become writable.
+static ncclResult_t bootstrapNetSendMany(int nfds, int* fds, union socketAddress* addrs, void* data, int size) {
+  if (nfds == 0) return ncclSuccess;
+  ncclResult_t res = ncclSuccess;
+  int msgSize = sizeof(int)+size;
+  char* msg = NULL;
+  int* offsets = NULL;
+  int epollFd = -1, remaining = nfds;
+  struct epoll_event events[16];
+  NCCLCHECKGOTO(ncclCalloc(&msg, msgSize), res, end);
+  NCCLCHECKGOTO(ncclCalloc(&offsets, nfds), res, end);
+  memcpy(msg, &size, sizeof(int));
+  memcpy(msg+sizeof(int), data, size);
+
+  epollFd = epoll_create1(0);
+  if (epollFd == -1) {
+    WARN("Bootstrap : epoll_create1 failed : %s", strerror(errno));
+    res = ncclSystemError;
+    goto end;
+  }
+  for (int i=0; i<nfds; i++) {
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLET;
+    ev.data.u32 = i;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fds[i], &ev) == -1) {
+      WARN("Bootstrap : epoll_ctl failed : %s", strerror(errno));
+      res = ncclSystemError;
+      goto end;
+    }
+  }
+  while (remaining) {
+    int n = epoll_wait(epollFd, events, 16, -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      WARN("Bootstrap : epoll_wait failed : %s", strerror(errno));
+      res = ncclSystemError;
+      goto end;
+    }
+    for (int e=0; e<n; e++) {
+      int i = events[e].data.u32;
+      if (offsets[i] == msgSize) continue;
+      NCCLCHECKGOTO(socketProgress(NCCL_SOCKET_SEND, fds[i], addrs+i, msg, msgSize, offsets+i), res, end);
+      if (offsets[i] == msgSize) remaining--;
+    }
+  }
+end:
+  if (epollFd != -1) close(epollFd);
+  free(offsets);
+  free(msg);
+  return res;
+}
+
+// Connect to the tree children of a rank (rank -1 being the root) and push them the table.
+static ncclResult_t bootstrapTreeForward(int rank, int nranks, int fanout, char* table) {
+  union socketAddress* rankAddressesRoot = (union socketAddress*)(table+sizeof(int));
+  int first = (rank+1)*fanout;
+  int nchildren = std::max(0, std::min(fanout, nranks-first));
+  if (nchildren == 0) return ncclSuccess;
+
+  ncclResult_t res = ncclSuccess;
+  int fds[nchildren];
+  int c = 0;
+  for (; c<nchildren; c++) {
+    NCCLCHECKGOTO(connectAddress(fds+c, rankAddressesRoot+first+c), res, end);
+  }
+  NCCLCHECKGOTO(bootstrapNetSendMany(nchildren, fds, rankAddressesRoot+first, table, bootstrapTreeTableSize(nranks)), res, end);
+end:
+  for (int i=0; i<c; i++) close(fds[i]);
+  return res;
+}
+
+// Root side collection of the extInfo sent by all ranks. Connections are accepted
+// and read as they become ready so a slow rank does not hold up the others.
+struct rootGatherConn {
+  int fd;
+  int offset;
+  union socketAddress addr;
+  char buf[sizeof(int)+sizeof(struct extInfo)];
+};
+
+#define MAX_ROOT_GATHER_CONNS 1024
+struct rootGatherState {
+  int listenFd;
+  int epollFd;
+  int listening; // Whether listenFd is in the epoll set, only while there are free slots
+  int nconns;
+  struct rootGatherConn* conns[MAX_ROOT_GATHER_CONNS];
+};
+
+static ncclResult_t rootGatherInit(struct rootGatherState* gather, int listenFd) {
+  memset(gather, 0, sizeof(struct rootGatherState));
+  gather->listenFd = listenFd;
+  gather->epollFd = epoll_create1(0);
+  if (gather->epollFd == -1) {
+    WARN("Bootstrap Root : epoll_create1 failed : %s", strerror(errno));
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+}
+
+// Level-triggered events on the listen socket keep coming while connections wait in the backlog,
+// so only watch it while new connections can be accepted.
+static ncclResult_t rootGatherListen(struct rootGatherState* gather) {
+  int listen = gather->nconns < MAX_ROOT_GATHER_CONNS;
+  if (listen == gather->listening) return ncclSuccess;
+  if (listen) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    SYSCHECK(epoll_ctl(gather->epollFd, EPOLL_CTL_ADD, gather->listenFd, &ev), "epoll_ctl");
+  } else {
+    SYSCHECK(epoll_ctl(gather->epollFd, EPOLL_CTL_DEL, gather->listenFd, NULL), "epoll_ctl");
+  }
+  gather->listening = listen;
+  return ncclSuccess;
+}
+
+static void rootGatherRemove(struct rootGatherState* gather, struct rootGatherConn* conn) {
+  epoll_ctl(gather->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  for (int i=0; i<gather->nconns; i++) {
+    if (gather->conns[i] == conn) {
+      gather->conns[i] = gather->conns[--gather->nconns];
+      break;
+    }
+  }
+  free(conn);
+}
+
+static void rootGatherFree(struct rootGatherState* gather) {
+  while (gather->nconns) rootGatherRemove(gather, gather->conns[0]);
+  if (gather->epollFd != -1) close(gather->epollFd);
+}
+
+// Block until the next complete extInfo has been received
+static ncclResult_t rootGatherNext(struct rootGatherState* gather, struct extInfo* info) {
+  struct epoll_event events[64];
+  while (1) {
+    NCCLCHECK(rootGatherListen(gather));
+    int n = epoll_wait(gather->epollFd, events, 64, -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      WARN("Bootstrap Root : epoll_wait failed : %s", strerror(errno));
+      return ncclSystemError;
+    }
+    for (int e=0; e<n; e++) {
+      struct rootGatherConn* conn = (struct rootGatherConn*)events[e].data.ptr;
+      if (conn == NULL) {
+        // New connection. Only accept what we can track, the listen backlog holds the rest until
+        // rootGatherListen watches the listen socket again.
+        if (gather->nconns == MAX_ROOT_GATHER_CONNS) continue;
+        NCCLCHECK(ncclCalloc(&conn, 1));
+        if (bootstrapNetAccept(gather->listenFd, &conn->fd, &conn->addr) != ncclSuccess) {
+          free(conn);
+          return ncclSystemError;
+        }
+        gather->conns[gather->nconns++] = conn;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        SYSCHECK(epoll_ctl(gather->epollFd, EPOLL_CTL_ADD, conn->fd, &ev), "epoll_ctl");
+        NCCLCHECK(rootGatherListen(gather));
+      }
+      ncclResult_t res = socketProgress(NCCL_SOCKET_RECV, conn->fd, &conn->addr, conn->buf, sizeof(conn->buf), &conn->offset);
+      if (res != ncclSuccess) {
+        rootGatherRemove(gather, conn);
+        return res;
+      }
+      if (conn->offset == sizeof(conn->buf)) {
+        int size;
+        memcpy(&size, conn->buf, sizeof(int));
+        memcpy(info, conn->buf+sizeof(int), sizeof(struct extInfo));
+        rootGatherRemove(gather, conn);
+        if (size != sizeof(struct extInfo)) {
+          WARN("Bootstrap Root : received %d bytes instead of %ld", size, sizeof(struct extInfo));
+          return ncclInternalError;
+        }
+        return ncclSuccess;
+      }
+    }
+  }
+}
+// [/RCCL]
+
 #include <sys/resource.h>
 
 static ncclResult_t setFilesLimit() {
@@ -113,27 +323,28 @@ static void *bootstrapRoot(void* bootstrapRootStruct) { // [RCCL] Modified to in
   // [/RCCL]
 
   ncclResult_t res = ncclSuccess;
-  int nranks = 0, c = 0;
+  int nranks = 0, c = 0, treeFanout = 0;
   struct extInfo info;
+  struct rootGatherState gather; // [RCCL]
+  char* table = NULL; // [RCCL] pid + rankAddressesRoot + rankAddresses, sent as a whole in tree mode
   union socketAddress *rankAddresses = NULL;
   union socketAddress *rankAddressesRoot = NULL; // for initial rank <-> root information exchange
   union socketAddress *zero = NULL;
+  NCCLCHECKGOTO(rootGatherInit(&gather, listenFd), res, out);
   NCCLCHECKGOTO(ncclCalloc(&zero, 1), res, out);
   setFilesLimit();
 
   TRACE(NCCL_INIT, "BEGIN");
   /* Receive addresses from all ranks */
   do {
-    int tmpFd;
-    union socketAddress addr;
-    NCCLCHECKGOTO(bootstrapNetAccept(listenFd, &tmpFd, &addr), res, out);
-    NCCLCHECKGOTO(bootstrapNetRecv(tmpFd, &addr, &info, sizeof(info)), res, out);
-    close(tmpFd);
+    NCCLCHECKGOTO(rootGatherNext(&gather, &info), res, out);
 
     if (c == 0) {
       nranks = info.nranks;
-      NCCLCHECKGOTO(ncclCalloc(&rankAddresses, nranks), res, out);
-      NCCLCHECKGOTO(ncclCalloc(&rankAddressesRoot, nranks), res, out);
+      treeFanout = info.treeFanout;
+      NCCLCHECKGOTO(ncclCalloc(&table, bootstrapTreeTableSize(nranks)), res, out);
+      rankAddressesRoot = (union socketAddress*)(table+sizeof(int));
+      rankAddresses = rankAddressesRoot+nranks;
     }
 
     if (nranks != info.nranks) {
@@ -141,6 +352,11 @@ static void *bootstrapRoot(void* bootstrapRootStruct) { // [RCCL] Modified to in
       goto out;
     }
 
+    if (treeFanout != info.treeFanout) {
+      WARN("Bootstrap Root : mismatch in RCCL_BOOTSTRAP_TREE settings from procs %d : %d", treeFanout, info.treeFanout);
+      goto out;
+    }
+
     if (memcmp(zero, &rankAddressesRoot[info.rank], sizeof(union socketAddress)) != 0) {
       WARN("Bootstrap Root : rank %d of %d ranks has already checked in", info.rank, nranks);
       goto out;
@@ -159,6 +375,13 @@ static void *bootstrapRoot(void* bootstrapRootStruct) { // [RCCL] Modified to in
     NCCLCHECKGOTO(CliqueManager::BootstrapRootInit(pid, hash), res, out);
   } // [/RCCL]
 
+  if (treeFanout) { // [RCCL] Only talk to the top of the tree, ranks forward to each other
+    memcpy(table, &pid, sizeof(int));
+    NCCLCHECKGOTO(bootstrapTreeForward(-1, nranks, treeFanout, table), res, out);
+    TRACE(NCCL_INIT, "SENT OUT ALL %d HANDLES THROUGH TREE", nranks);
+    goto out;
+  } // [/RCCL]
+
   // Send the connect handle for the next rank in the AllGather ring
   for (int r=0; r<nranks; ++r) {
     int next = (r+1) % nranks;
@@ -174,9 +397,9 @@ static void *bootstrapRoot(void* bootstrapRootStruct) { // [RCCL] Modified to in
   TRACE(NCCL_INIT, "SENT OUT ALL %d HANDLES", nranks);
 
 out:
+  rootGatherFree(&gather);
   close(listenFd);
-  if (rankAddresses) free(rankAddresses);
-  if (rankAddressesRoot) free(rankAddressesRoot);
+  if (table) free(table);
   if (zero) free(zero);
 
   TRACE(NCCL_INIT, "DONE");
@@ -228,6 +451,62 @@ struct unexConn {
   struct unexConn* next;
 };
 
+// [RCCL] Point-to-point messages are framed on a persistent connection per peer
+struct bootstrapMsgHeader {
+  int peer;
+  int tag;
+  int size;
+};
+
+// Message read while looking for another tag from the same peer
+struct unexMsg {
+  int peer;
+  int tag;
+  int size;
+  char* data;
+  struct unexMsg* next;
+};
+
+// Unexpected connections and messages are hashed by (peer, tag)
+#define BOOTSTRAP_UNEX_BUCKETS 256
+static inline int unexpectedBucket(int peer, int tag) {
+  return (((uint32_t)peer * 0x9E3779B1u) ^ (uint32_t)tag) % BOOTSTRAP_UNEX_BUCKETS;
+}
+
+// Shared memory segment of the ranks of a node. AllGather slots are double buffered,
+// so a single barrier per AllGather is enough : a rank cannot write into a bank again
+// before everyone went through the barrier of the next AllGather, i.e. is done reading it.
+#define BOOTSTRAP_SHM_SLOT_SIZE 4096
+struct bootstrapShm {
+  union {
+    struct {
+      uint64_t barrierCount;
+      uint64_t barrierGen;
+    };
+    char pad[64];
+  };
+  char slots[0]; // [2][nranks][BOOTSTRAP_SHM_SLOT_SIZE]
+};
+
+// Segment of a set of ranks, set up the first time these ranks run a barrier or an AllGather together
+struct bootstrapShmSeg {
+  int* ranks;
+  int nranks;
+  struct bootstrapShm* shm;
+  int size;
+  uint64_t allGathers;
+  struct bootstrapShmSeg* next;
+};
+
+// Tags identifying the persistent connections among other incoming bootstrap connections
+#define BOOTSTRAP_RING_TAG INT_MIN
+#define BOOTSTRAP_P2P_TAG (INT_MIN+1)
+#define BOOTSTRAP_BRUCK_TAG(step) (INT_MIN+2+(step)) // Up to 31 steps
+
+// Message tag used while setting up the shared memory segment, after all the tags above
+#define BOOTSTRAP_SHM_SETUP_TAG (INT_MIN+64)
+// [/RCCL]
+
 // Remote allocator state
 struct remAllocState {
   int cudaDev;
@@ -242,11 +521,28 @@ struct extState {
   union socketAddress extRingRecvAddr, extRingSendAddr;
   union socketAddress* peerCommAddresses;
   union socketAddress* peerAllocAddresses;
-  struct unexConn* unexpectedConnections;
+  struct unexConn* unexpectedConnections[BOOTSTRAP_UNEX_BUCKETS];
+  struct unexMsg* unexpectedMessages[BOOTSTRAP_UNEX_BUCKETS]; // [RCCL]
   int cudaDev;
   int rank;
   int nranks;
 
+  // [RCCL] Persistent connections for the Bruck AllGather. Step k sends to
+  // rank+2^k and receives from rank-2^k; step 0 reuses the ring sockets.
+  int nBruckSteps;
+  int* bruckSendFds;
+  int* bruckRecvFds;
+  union socketAddress* bruckSendAddrs;
+  union socketAddress* bruckRecvAddrs;
+
+  // [RCCL] Persistent point-to-point connections, opened on first use
+  int* peerSendFds;
+  int* peerRecvFds;
+  union socketAddress* peerRecvAddrs;
+
+  // [RCCL] Shared memory for intra-node barriers and AllGathers, one segment per set of ranks
+  struct bootstrapShmSeg* shmSegs;
+
   // Intermediate memory allocation service
   struct remAllocState* allocState;
   pthread_t allocThread;
@@ -355,18 +651,132 @@ ncclResult_t bootstrapRemFree(int id, int rank, void* commState) {
   return ncclSuccess;
 }
 
+static ncclResult_t bootstrapRingAllGather(struct extState* state, char* data, int size) {
+  int rank = state->rank;
+  int nranks = state->nranks;
+
+  /* Simple ring based AllGather
+   * At each step i receive data from (rank-i-1) from left
+   * and send previous step's data from (rank-i) to right
+   */
+  for (int i=0; i<nranks-1; i++) {
+    size_t rslice = (rank - i - 1 + nranks) % nranks;
+    size_t sslice = (rank - i + nranks) % nranks;
+
+    // Send slice to the right
+    NCCLCHECK(bootstrapNetSend(state->extRingSendFd, &state->extRingSendAddr, data+sslice*size, size));
+    // Recv slice from the left
+    NCCLCHECK(bootstrapNetRecv(state->extRingRecvFd, &state->extRingRecvAddr, data+rslice*size, size));
+  }
+  return ncclSuccess;
+}
+
+// [RCCL] Bruck AllGather
+// Use log2(nranks) steps instead of nranks-1 once the communicator is large enough.
+RCCL_PARAM(BootstrapBruckThreshold, "BOOTSTRAP_BRUCK_THRESHOLD", 32); // 0 to always use the ring
+
+static ncclResult_t bootstrapAccept(struct extState* state, int peer, int tag, int* fd, union socketAddress* addr);
+
+static ncclResult_t bootstrapBruckConnect(struct extState* state) {
+  int rank = state->rank;
+  int nranks = state->nranks;
+  int nsteps = log2i(nranks-1)+1;
+  NCCLCHECK(ncclCalloc(&state->bruckSendFds, nsteps));
+  NCCLCHECK(ncclCalloc(&state->bruckRecvFds, nsteps));
+  NCCLCHECK(ncclCalloc(&state->bruckSendAddrs, nsteps));
+  NCCLCHECK(ncclCalloc(&state->bruckRecvAddrs, nsteps));
+  state->nBruckSteps = nsteps;
+
+  state->bruckSendFds[0] = state->extRingSendFd;
+  state->bruckRecvFds[0] = state->extRingRecvFd;
+  state->bruckSendAddrs[0] = state->extRingSendAddr;
+  state->bruckRecvAddrs[0] = state->extRingRecvAddr;
+  // Connect first, the listen backlog lets all connections complete before they are accepted
+  for (int k=1; k<nsteps; k++) {
+    int peer = (rank + (1<<k)) % nranks;
+    int tag = BOOTSTRAP_BRUCK_TAG(k);
+    state->bruckSendAddrs[k] = state->peerCommAddresses[peer];
+    NCCLCHECK(connectAddress(state->bruckSendFds+k, state->bruckSendAddrs+k));
+    NCCLCHECK(bootstrapNetSend(state->bruckSendFds[k], state->bruckSendAddrs+k, &rank, sizeof(int)));
+    NCCLCHECK(bootstrapNetSend(state->bruckSendFds[k], state->bruckSendAddrs+k, &tag, sizeof(int)));
+  }
+  for (int k=1; k<nsteps; k++) {
+    int peer = (rank - (1<<k) + nranks) % nranks;
+    NCCLCHECK(bootstrapAccept(state, peer, BOOTSTRAP_BRUCK_TAG(k), state->bruckRecvFds+k, state->bruckRecvAddrs+k));
+  }
+  return ncclSuccess;
+}
+
+// Send and receive at the same time so that large steps cannot deadlock on full socket buffers
+static ncclResult_t bootstrapNetSendRecv(int sendFd, union socketAddress* sendAddr, void* sendData, int sendSize,
+    int recvFd, union socketAddress* recvAddr, void* recvData, int recvSize) {
+  int recvMsgSize;
+  NCCLCHECK(socketSend(sendFd, sendAddr, &sendSize, sizeof(int)));
+  NCCLCHECK(socketRecv(recvFd, recvAddr, &recvMsgSize, sizeof(int)));
+  if (recvMsgSize != recvSize) {
+    WARN("Bootstrap : received %d bytes instead of %d", recvMsgSize, recvSize);
+    return ncclInternalError;
+  }
+  int sendOffset = 0, recvOffset = 0;
+  while (sendOffset < sendSize || recvOffset < recvSize) {
+    struct pollfd pfds[2];
+    int npfds = 0;
+    if (sendOffset < sendSize) { pfds[npfds].fd = sendFd; pfds[npfds].events = POLLOUT; npfds++; }
+    if (recvOffset < recvSize) { pfds[npfds].fd = recvFd; pfds[npfds].events = POLLIN; npfds++; }
+    if (poll(pfds, npfds, -1) == -1 && errno != EINTR) {
+      WARN("Bootstrap : poll failed : %s", strerror(errno));
+      return ncclSystemError;
+    }
+    if (sendOffset < sendSize) NCCLCHECK(socketProgress(NCCL_SOCKET_SEND, sendFd, sendAddr, sendData, sendSize, &sendOffset));
+    if (recvOffset < recvSize) NCCLCHECK(socketProgress(NCCL_SOCKET_RECV, recvFd, recvAddr, recvData, recvSize, &recvOffset));
+  }
+  return ncclSuccess;
+}
+
+/* Bruck AllGather
+ * tmp holds the slices of ranks rank, rank-1, rank-2, ... At step k, the first
+ * min(2^k, nranks-2^k) slices are sent to rank+2^k, while the slices of ranks
+ * rank-2^k, rank-2^k-1, ... are received from rank-2^k.
+ */
+static ncclResult_t bootstrapBruckAllGather(struct extState* state, char* data, int size) {
+  int rank = state->rank;
+  int nranks = state->nranks;
+  if (state->bruckSendFds == NULL) NCCLCHECK(bootstrapBruckConnect(state));
+
+  ncclResult_t res = ncclSuccess;
+  char* tmp;
+  NCCLCHECK(ncclCalloc(&tmp, (size_t)nranks*size));
+  memcpy(tmp, data+(size_t)rank*size, size);
+  for (int k=0; k<state->nBruckSteps; k++) {
+    int dist = 1<<k;
+    int count = std::min(dist, nranks-dist);
+    NCCLCHECKGOTO(bootstrapNetSendRecv(state->bruckSendFds[k], state->bruckSendAddrs+k, tmp, count*size,
+          state->bruckRecvFds[k], state->bruckRecvAddrs+k, tmp+(size_t)dist*size, count*size), res, end);
+  }
+  for (int i=1; i<nranks; i++) {
+    int slice = (rank - i + nranks) % nranks;
+    memcpy(data+(size_t)slice*size, tmp+(size_t)i*size, size);
+  }
+end:
+  free(tmp);
+  return res;
+}
+// [/RCCL]
+
 ncclResult_t bootstrapInit(ncclUniqueId * id, int rank, int nranks, void** commState, int* rootPid) { // [RCCL] Adding rootPid
   struct extState* state;
   NCCLCHECK(ncclCalloc(&state, 1));
   state->rank = rank;
   state->nranks = nranks;
   *commState = state;
+  setFilesLimit(); // [RCCL] Point-to-point connections are kept open
 
   TRACE(NCCL_INIT, "rank %d nranks %d", rank, nranks);
 
   struct extInfo info = { 0 };
   info.rank = rank;
   info.nranks = nranks;
+  info.treeFanout = bootstrapTreeFanout(); // [RCCL]
   int tmpSendFd, tmpRecvFd;
 
   int extListenFdRoot;
@@ -376,7 +786,8 @@ ncclResult_t bootstrapInit(ncclUniqueId * id, int rank, int nranks, void** commS
   NCCLCHECK(createListenSocket(&extListenFdRoot, &info.extAddressListenRoot));
 
   // stagger connection times to avoid an overload of the root
-  if (nranks > 128) {
+  // [RCCL] The tree root reads all ranks concurrently and does not need it.
+  if (nranks > 128 && info.treeFanout == 0) {
     long msec = rank;
     struct timespec tv;
     tv.tv_sec = msec / 1000;
@@ -393,22 +804,48 @@ ncclResult_t bootstrapInit(ncclUniqueId * id, int rank, int nranks, void** commS
 
   // get info on my "next" rank in the bootstrap ring from root
   union socketAddress addr;
+  NCCLCHECK(ncclCalloc(&state->peerCommAddresses, nranks));
+  NCCLCHECK(ncclCalloc(&state->peerSendFds, nranks)); // [RCCL]
+  NCCLCHECK(ncclCalloc(&state->peerRecvFds, nranks)); // [RCCL]
+  NCCLCHECK(ncclCalloc(&state->peerRecvAddrs, nranks)); // [RCCL]
   NCCLCHECK(bootstrapNetAccept(extListenFdRoot, &tmpRecvFd, &addr));
-  NCCLCHECK(bootstrapNetRecv(tmpRecvFd, &addr, &state->extRingSendAddr, sizeof(state->extRingSendAddr)));
-  { // [RCCL] Receive PID from root
-    NCCLCHECK(bootstrapNetRecv(tmpRecvFd, &addr, rootPid, sizeof(int)));
-  } // [/RCCL]
+  if (info.treeFanout) { // [RCCL] Receive the full table from our tree parent and pass it on
+    ncclResult_t res = ncclSuccess;
+    char* table;
+    NCCLCHECK(ncclCalloc(&table, bootstrapTreeTableSize(nranks)));
+    NCCLCHECKGOTO(bootstrapNetRecv(tmpRecvFd, &addr, table, bootstrapTreeTableSize(nranks)), res, tree_end);
+    NCCLCHECKGOTO(bootstrapTreeForward(rank, nranks, info.treeFanout, table), res, tree_end);
+    memcpy(rootPid, table, sizeof(int));
+    // Everyone already knows every listen address, no need to AllGather them later.
+    memcpy(state->peerCommAddresses, table+sizeof(int)+nranks*sizeof(union socketAddress), nranks*sizeof(union socketAddress));
+    memcpy(&state->extRingSendAddr, state->peerCommAddresses+(rank+1)%nranks, sizeof(union socketAddress));
+tree_end:
+    free(table);
+    if (res != ncclSuccess) return res;
+  } else { // [/RCCL]
+    NCCLCHECK(bootstrapNetRecv(tmpRecvFd, &addr, &state->extRingSendAddr, sizeof(state->extRingSendAddr)));
+    { // [RCCL] Receive PID from root
+      NCCLCHECK(bootstrapNetRecv(tmpRecvFd, &addr, rootPid, sizeof(int)));
+    } // [/RCCL]
+  }
   close(tmpRecvFd);
   close(extListenFdRoot);
 
   NCCLCHECK(connectAddress(&state->extRingSendFd, &state->extRingSendAddr));
+  { // [RCCL] Identify the ring connection, Bruck connections from other ranks may arrive first
+    int tag = BOOTSTRAP_RING_TAG;
+    NCCLCHECK(bootstrapNetSend(state->extRingSendFd, &state->extRingSendAddr, &rank, sizeof(int)));
+    NCCLCHECK(bootstrapNetSend(state->extRingSendFd, &state->extRingSendAddr, &tag, sizeof(int)));
+  } // [/RCCL]
   // Accept the connect request from the previous rank in the AllGather ring
-  NCCLCHECK(bootstrapNetAccept(state->extListenFd, &state->extRingRecvFd, &state->extRingRecvAddr));
+  NCCLCHECK(bootstrapAccept(state, (rank-1+nranks)%nranks, BOOTSTRAP_RING_TAG, &state->extRingRecvFd, &state->extRingRecvAddr));
 
   // AllGather all listen handlers
-  NCCLCHECK(ncclCalloc(&state->peerCommAddresses, nranks));
-  memcpy(state->peerCommAddresses+rank, &info.extAddressListen, sizeof(union socketAddress));
-  NCCLCHECK(bootstrapAllGather(state, state->peerCommAddresses, sizeof(union socketAddress)));
+  if (info.treeFanout == 0) {
+    memcpy(state->peerCommAddresses+rank, &info.extAddressListen, sizeof(union socketAddress));
+    // [RCCL] Bruck needs these addresses to connect, so gather them on the ring
+    NCCLCHECK(bootstrapRingAllGather(state, (char*)state->peerCommAddresses, sizeof(union socketAddress)));
+  }
 
   // Create the memory allocation service
   NCCLCHECK(ncclCalloc(&state->peerAllocAddresses, nranks));
@@ -427,45 +864,37 @@ ncclResult_t bootstrapInit(ncclUniqueId * id, int rank, int nranks, void** commS
 ncclResult_t bootstrapAllGather(void* commState, void* allData, int size) {
   struct extState* state = (struct extState*)commState;
   char* data = (char*)allData;
-  int rank = state->rank;
   int nranks = state->nranks;
 
-  TRACE(NCCL_INIT, "rank %d nranks %d size %d", rank, nranks, size);
+  TRACE(NCCL_INIT, "rank %d nranks %d size %d", state->rank, nranks, size);
 
-  /* Simple ring based AllGather
-   * At each step i receive data from (rank-i-1) from left
-   * and send previous step's data from (rank-i) to right
-   */
-  for (int i=0; i<nranks-1; i++) {
-    size_t rslice = (rank - i - 1 + nranks) % nranks;
-    size_t sslice = (rank - i + nranks) % nranks;
-
-    // Send slice to the right
-    NCCLCHECK(bootstrapNetSend(state->extRingSendFd, &state->extRingSendAddr, data+sslice*size, size));
-    // Recv slice from the left
-    NCCLCHECK(bootstrapNetRecv(state->extRingRecvFd, &state->extRingRecvAddr, data+rslice*size, size));
+  int bruckThreshold = rcclParamBootstrapBruckThreshold();
+  if (bruckThreshold > 0 && nranks >= bruckThreshold && nranks > 1) { // [RCCL]
+    NCCLCHECK(bootstrapBruckAllGather(state, data, size));
+  } else { // [/RCCL]
+    NCCLCHECK(bootstrapRingAllGather(state, data, size));
   }
 
-  TRACE(NCCL_INIT, "rank %d nranks %d size %d - DONE", rank, nranks, size);
+  TRACE(NCCL_INIT, "rank %d nranks %d size %d - DONE", state->rank, nranks, size);
   return ncclSuccess;
 }
 
 ncclResult_t bootstrapSend(void* commState, int peer, int tag, void* data, int size) {
   struct extState* state = (struct extState*)commState;
-  int tmpSendFd;
   union socketAddress *addr = state->peerCommAddresses+peer;
-  NCCLCHECK(connectAddress(&tmpSendFd, addr));
-  NCCLCHECK(bootstrapNetSend(tmpSendFd, addr, &state->rank, sizeof(int)));
-  NCCLCHECK(bootstrapNetSend(tmpSendFd, addr, &tag, sizeof(int)));
-  NCCLCHECK(bootstrapNetSend(tmpSendFd, addr, data, size));
-  close(tmpSendFd);
+  if (state->peerSendFds[peer] == 0) { // [RCCL] First message to that peer, open the connection
+    int p2pTag = BOOTSTRAP_P2P_TAG;
+    NCCLCHECK(connectAddress(state->peerSendFds+peer, addr));
+    NCCLCHECK(bootstrapNetSend(state->peerSendFds[peer], addr, &state->rank, sizeof(int)));
+    NCCLCHECK(bootstrapNetSend(state->peerSendFds[peer], addr, &p2pTag, sizeof(int)));
+  }
+  struct bootstrapMsgHeader header = { state->rank, tag, size };
+  NCCLCHECK(socketSend(state->peerSendFds[peer], addr, &header, sizeof(header)));
+  NCCLCHECK(socketSend(state->peerSendFds[peer], addr, data, size));
   return ncclSuccess;
 }
 
-ncclResult_t bootstrapBarrier(void* commState, int *ranks, int rank, int nranks, int tag) {
-  if (nranks == 1) return ncclSuccess;
-  TRACE(NCCL_INIT, "rank %d nranks %d tag %x - ENTER", rank, nranks, tag);
-
+static ncclResult_t bootstrapSocketBarrier(void* commState, int *ranks, int rank, int nranks, int tag) {
   /* Simple intra process barrier
    *
    * Based on the dissemination algorithm by Debra Hensgen, Raphael Finkel, and Udi Manbet,
@@ -478,27 +907,190 @@ ncclResult_t bootstrapBarrier(void* commState, int *ranks, int rank, int nranks,
     NCCLCHECK(bootstrapSend(commState, ranks[dst], tag, data, sizeof(data)));
     NCCLCHECK(bootstrapRecv(commState, ranks[src], tag, data, sizeof(data)));
   }
+  return ncclSuccess;
+}
+
+// [RCCL] Shared memory path for intra-node barriers and AllGathers
+RCCL_PARAM(BootstrapShm, "BOOTSTRAP_SHM", 0);
+
+static bool bootstrapSameHost(struct extState* state, int *ranks, int nranks) {
+  union socketAddress* ref = state->peerCommAddresses+ranks[0];
+  for (int i=1; i<nranks; i++) {
+    union socketAddress* addr = state->peerCommAddresses+ranks[i];
+    if (addr->sa.sa_family != ref->sa.sa_family) return false;
+    if (ref->sa.sa_family == AF_INET && addr->sin.sin_addr.s_addr != ref->sin.sin_addr.s_addr) return false;
+    if (ref->sa.sa_family == AF_INET6 && memcmp(&addr->sin6.sin6_addr, &ref->sin6.sin6_addr, sizeof(struct in6_addr)) != 0) return false;
+  }
+  return true;
+}
+
+// Returns the shared memory segment of this set of ranks, or NULL if they cannot use one.
+// Ranks of the same set call this collectively, so the first call sets the segment up.
+static ncclResult_t bootstrapShmGet(struct extState* state, int *ranks, int rank, int nranks, struct bootstrapShmSeg** seg) {
+  *seg = NULL;
+  if (rcclParamBootstrapShm() == 0 || nranks == 1) return ncclSuccess;
+  for (struct bootstrapShmSeg* s = state->shmSegs; s; s = s->next) {
+    if (s->nranks == nranks && memcmp(s->ranks, ranks, nranks*sizeof(int)) == 0) {
+      *seg = s;
+      return ncclSuccess;
+    }
+  }
+  if (!bootstrapSameHost(state, ranks, nranks)) return ncclSuccess;
+
+  // The listen address of the first rank is unique to this communicator on this host,
+  // the hash of the ranks tells apart the sets sharing their first rank
+  char shmName[64];
+  uint64_t hash = getHash((const char*)(state->peerCommAddresses+ranks[0]), sizeof(union socketAddress));
+  uint64_t ranksHash = getHash((const char*)ranks, nranks*sizeof(int));
+  sprintf(shmName, "rccl-bootstrap-%lx-%lx-%d", hash, ranksHash, ranks[0]);
+  int shmSize = sizeof(struct bootstrapShm) + 2*nranks*BOOTSTRAP_SHM_SLOT_SIZE;
+  int fd;
+  void* ptr;
+  TRACE(NCCL_INIT, "rank %d nranks %d opening %s size %d", rank, nranks, shmName, shmSize);
+  // The first rank creates the segment, the others attach once it is ready, then it can be unlinked
+  if (rank == 0) NCCLCHECK(shmSetup(shmName, shmSize, &fd, &ptr, 1));
+  NCCLCHECK(bootstrapSocketBarrier(state, ranks, rank, nranks, BOOTSTRAP_SHM_SETUP_TAG));
+  if (rank != 0) NCCLCHECK(shmSetup(shmName, shmSize, &fd, &ptr, 0));
+  NCCLCHECK(bootstrapSocketBarrier(state, ranks, rank, nranks, BOOTSTRAP_SHM_SETUP_TAG));
+  if (rank == 0) NCCLCHECK(shmUnlink(shmName));
+
+  struct bootstrapShmSeg* s;
+  NCCLCHECK(ncclCalloc(&s, 1));
+  NCCLCHECK(ncclCalloc(&s->ranks, nranks));
+  memcpy(s->ranks, ranks, nranks*sizeof(int));
+  s->nranks = nranks;
+  s->shm = (struct bootstrapShm*)ptr;
+  s->size = shmSize;
+  s->next = state->shmSegs;
+  state->shmSegs = s;
+  *seg = s;
+  return ncclSuccess;
+}
+
+// Time a rank waits for the others in a shared memory barrier before giving up, in seconds
+RCCL_PARAM(BootstrapShmTimeout, "BOOTSTRAP_SHM_TIMEOUT", 300);
+
+// Sense reversing barrier on a counter in shared memory
+static ncclResult_t bootstrapShmBarrier(struct bootstrapShm* shm, int nranks) {
+  uint64_t gen = __atomic_load_n(&shm->barrierGen, __ATOMIC_ACQUIRE);
+  if (__atomic_add_fetch(&shm->barrierCount, 1, __ATOMIC_ACQ_REL) == (uint64_t)nranks) {
+    __atomic_store_n(&shm->barrierCount, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->barrierGen, gen+1, __ATOMIC_RELEASE);
+    return ncclSuccess;
+  }
+  // A peer which died never shows up, unlike with sockets which get closed
+  int64_t timeout = rcclParamBootstrapShmTimeout();
+  uint64_t deadline = ncclTimeNs() + timeout*1000000000ULL;
+  while (__atomic_load_n(&shm->barrierGen, __ATOMIC_ACQUIRE) == gen) {
+    if (timeout > 0 && ncclTimeNs() > deadline) {
+      WARN("Bootstrap : timed out after %lds waiting for local ranks in shared memory barrier (RCCL_BOOTSTRAP_SHM_TIMEOUT)", timeout);
+      return ncclSystemError;
+    }
+    sched_yield();
+  }
+  return ncclSuccess;
+}
+
+static void bootstrapShmClose(struct extState* state) {
+  while (state->shmSegs) {
+    struct bootstrapShmSeg* s = state->shmSegs;
+    state->shmSegs = s->next;
+    munmap(s->shm, s->size);
+    free(s->ranks);
+    free(s);
+  }
+}
+// [/RCCL]
+
+ncclResult_t bootstrapBarrier(void* commState, int *ranks, int rank, int nranks, int tag) {
+  if (nranks == 1) return ncclSuccess;
+  TRACE(NCCL_INIT, "rank %d nranks %d tag %x - ENTER", rank, nranks, tag);
+
+  struct bootstrapShmSeg* seg;
+  NCCLCHECK(bootstrapShmGet((struct extState*)commState, ranks, rank, nranks, &seg));
+  if (seg) { // [RCCL]
+    NCCLCHECK(bootstrapShmBarrier(seg->shm, nranks));
+  } else { // [/RCCL]
+    NCCLCHECK(bootstrapSocketBarrier(commState, ranks, rank, nranks, tag));
+  }
 
   TRACE(NCCL_INIT, "rank %d nranks %d tag %x - DONE", rank, nranks, tag);
   return ncclSuccess;
 }
 
+// [RCCL] 0 to go back to the linear intra-node AllGather, e.g. to compare them with bootstrap-bench
+RCCL_PARAM(BootstrapIntraBruck, "BOOTSTRAP_INTRA_BRUCK", 1);
+
 ncclResult_t bootstrapIntraNodeAllGather(void* commState, int *ranks, int rank, int nranks, void* allData, int size) {
   if (nranks == 1) return ncclSuccess;
+  struct extState* state = (struct extState*)commState;
   char* data = (char*)allData;
   TRACE(NCCL_INIT, "rank %d nranks %d size %d - ENTER", rank, nranks, size);
 
-  for (int i=1; i<nranks; i++) {
-    int src = (rank - i + nranks) % nranks;
-    int dst = (rank + i) % nranks;
-    NCCLCHECK(bootstrapSend(commState, ranks[dst], /*tag=*/i, data+rank*size, size));
-    NCCLCHECK(bootstrapRecv(commState, ranks[src], /*tag=*/i, data+src*size, size));
+  struct bootstrapShmSeg* seg;
+  NCCLCHECK(bootstrapShmGet(state, ranks, rank, nranks, &seg));
+  if (seg && size <= BOOTSTRAP_SHM_SLOT_SIZE) { // [RCCL] Everyone writes its slot, then reads all of them
+    char* bank = seg->shm->slots + (seg->allGathers++ % 2)*nranks*BOOTSTRAP_SHM_SLOT_SIZE;
+    memcpy(bank+rank*BOOTSTRAP_SHM_SLOT_SIZE, data+rank*size, size);
+    NCCLCHECK(bootstrapShmBarrier(seg->shm, nranks));
+    for (int i=0; i<nranks; i++) {
+      if (i != rank) memcpy(data+i*size, bank+i*BOOTSTRAP_SHM_SLOT_SIZE, size);
+    }
+  } else if (rcclParamBootstrapIntraBruck() == 0) { // [RCCL] Linear exchange, kept as a baseline
+    if (seg) seg->allGathers++; // Keep the bank parity consistent across ranks
+    for (int i=1; i<nranks; i++) {
+      int src = (rank - i + nranks) % nranks;
+      int dst = (rank + i) % nranks;
+      NCCLCHECK(bootstrapSend(commState, ranks[dst], /*tag=*/i, data+rank*size, size));
+      NCCLCHECK(bootstrapRecv(commState, ranks[src], /*tag=*/i, data+src*size, size));
+    }
+  } else { // [/RCCL]
+    if (seg) seg->allGathers++; // Keep the bank parity consistent across ranks
+    /* Bruck AllGather over point-to-point messages, see bootstrapBruckAllGather.
+     * tmp holds the slices of ranks rank, rank-1, rank-2, ...
+     */
+    ncclResult_t res = ncclSuccess;
+    char* tmp;
+    NCCLCHECK(ncclCalloc(&tmp, (size_t)nranks*size));
+    memcpy(tmp, data+(size_t)rank*size, size);
+    for (int dist=1, step=1; dist<nranks; dist<<=1, step++) {
+      int src = (rank - dist + nranks) % nranks;
+      int dst = (rank + dist) % nranks;
+      int count = std::min(dist, nranks-dist);
+      NCCLCHECKGOTO(bootstrapSend(commState, ranks[dst], /*tag=*/step, tmp, count*size), res, end);
+      NCCLCHECKGOTO(bootstrapRecv(commState, ranks[src], /*tag=*/step, tmp+(size_t)dist*size, count*size), res, end);
+    }
+    for (int i=1; i<nranks; i++) {
+      int slice = (rank - i + nranks) % nranks;
+      memcpy(data+(size_t)slice*size, tmp+(size_t)i*size, size);
+    }
+end:
+    free(tmp);
+    if (res != ncclSuccess) return res;
   }
 
   TRACE(NCCL_INIT, "rank %d nranks %d size %d - DONE", rank, nranks, size);
   return ncclSuccess;
 }
 
+// [RCCL] Binomial tree broadcast from ranks[root] over point-to-point messages
+ncclResult_t bootstrapBroadcast(void* commState, int *ranks, int rank, int nranks, int root, int tag, void* data, int size) {
+  if (nranks == 1) return ncclSuccess;
+  TRACE(NCCL_INIT, "rank %d nranks %d root %d size %d - ENTER", rank, nranks, root, size);
+
+  int vrank = (rank - root + nranks) % nranks;
+  int mask = 1;
+  while (mask < nranks && (vrank & mask) == 0) mask <<= 1;
+  if (vrank != 0) NCCLCHECK(bootstrapRecv(commState, ranks[(rank - mask + nranks) % nranks], tag, data, size));
+  for (mask >>= 1; mask > 0; mask >>= 1) {
+    if (vrank + mask < nranks) NCCLCHECK(bootstrapSend(commState, ranks[(rank + mask) % nranks], tag, data, size));
+  }
+
+  TRACE(NCCL_INIT, "rank %d nranks %d root %d size %d - DONE", rank, nranks, root, size);
+  return ncclSuccess;
+}
+// [/RCCL]
+
 ncclResult_t unexpectedEnqueue(struct extState* state, int peer, int tag, int fd, union socketAddress *addr) {
   // New unex
   struct unexConn* unex;
@@ -509,23 +1101,20 @@ ncclResult_t unexpectedEnqueue(struct extState* state, int peer, int tag, int fd
   unex->addr = *addr;
 
   // Enqueue
-  struct unexConn* list = state->unexpectedConnections;
-  if (list == NULL) {
-    state->unexpectedConnections = unex;
-    return ncclSuccess;
-  }
-  while (list->next) list = list->next;
-  list->next = unex;
+  struct unexConn** list = state->unexpectedConnections+unexpectedBucket(peer, tag);
+  while (*list) list = &(*list)->next;
+  *list = unex;
   return ncclSuccess;
 }
 
 int unexpectedDequeue(struct extState* state, int peer, int tag, union socketAddress *addr) {
-  struct unexConn* elem = state->unexpectedConnections;
+  struct unexConn** bucket = state->unexpectedConnections+unexpectedBucket(peer, tag);
+  struct unexConn* elem = *bucket;
   struct unexConn* prev = NULL;
   while (elem) {
     if (elem->peer == peer && elem->tag == tag) {
       if (prev == NULL) {
-        state->unexpectedConnections = elem->next;
+        *bucket = elem->next;
       } else {
         prev->next = elem->next;
       }
@@ -540,46 +1129,137 @@ int unexpectedDequeue(struct extState* state, int peer, int tag, union socketAdd
   return -1;
 }
 
-// We can't know who we'll receive from, so we need to receive everything at once
-ncclResult_t bootstrapRecv(void* commState, int peer, int tag, void* data, int size) {
-  struct extState* state = (struct extState*)commState;
+// [RCCL] Read a message we are not waiting for yet and keep it for a later bootstrapRecv
+static ncclResult_t unexpectedMsgEnqueue(struct extState* state, struct bootstrapMsgHeader* header, int fd, union socketAddress* addr) {
+  struct unexMsg* unex;
+  NCCLCHECK(ncclCalloc(&unex, 1));
+  unex->peer = header->peer;
+  unex->tag = header->tag;
+  unex->size = header->size;
+  if (ncclCalloc(&unex->data, std::max(header->size, 1)) != ncclSuccess || socketRecv(fd, addr, unex->data, header->size) != ncclSuccess) {
+    free(unex->data);
+    free(unex);
+    return ncclSystemError;
+  }
 
-  int tmpRecvFd;
-  union socketAddress addr;
+  // Messages with the same peer and tag are kept in order
+  struct unexMsg** list = state->unexpectedMessages+unexpectedBucket(header->peer, header->tag);
+  while (*list) list = &(*list)->next;
+  *list = unex;
+  return ncclSuccess;
+}
 
-  // Search unexpected connections first
-  if ((tmpRecvFd = unexpectedDequeue(state, peer, tag, &addr)) != -1) {
-    NCCLCHECK(bootstrapNetRecv(tmpRecvFd, &addr, ((char*)data), size));
-    close(tmpRecvFd);
-    return ncclSuccess;
+static struct unexMsg* unexpectedMsgDequeue(struct extState* state, int peer, int tag) {
+  struct unexMsg** elem = state->unexpectedMessages+unexpectedBucket(peer, tag);
+  while (*elem) {
+    if ((*elem)->peer == peer && (*elem)->tag == tag) {
+      struct unexMsg* msg = *elem;
+      *elem = msg->next;
+      return msg;
+    }
+    elem = &(*elem)->next;
   }
+  return NULL;
+}
+// [/RCCL]
+
+// Get the connection opened by peer with tag, whose payload has not been read yet
+static ncclResult_t bootstrapAccept(struct extState* state, int peer, int tag, int* fd, union socketAddress* addr) {
+  // Search unexpected connections first
+  if ((*fd = unexpectedDequeue(state, peer, tag, addr)) != -1) return ncclSuccess;
 
   // Then look for new connections
   while (1) {
-    union socketAddress addr;
-    NCCLCHECK(bootstrapNetAccept(state->extListenFd, &tmpRecvFd, &addr));
+    NCCLCHECK(bootstrapNetAccept(state->extListenFd, fd, addr));
     int newPeer, newTag;
-    NCCLCHECK(bootstrapNetRecv(tmpRecvFd, &addr, &newPeer, sizeof(int)));
-    NCCLCHECK(bootstrapNetRecv(tmpRecvFd, &addr, &newTag, sizeof(int)));
-    if (newPeer == peer && newTag == tag) {
-      NCCLCHECK(bootstrapNetRecv(tmpRecvFd, &addr, ((char*)data), size));
-      close(tmpRecvFd);
+    NCCLCHECK(bootstrapNetRecv(*fd, addr, &newPeer, sizeof(int)));
+    NCCLCHECK(bootstrapNetRecv(*fd, addr, &newTag, sizeof(int)));
+    if (newPeer == peer && newTag == tag) return ncclSuccess;
+    // Unexpected connection. Save for later.
+    NCCLCHECK(unexpectedEnqueue(state, newPeer, newTag, *fd, addr));
+  }
+}
+
+// Messages from a peer arrive in order on its connection, so we only need to look at
+// the messages of that peer we have already read, then read more.
+ncclResult_t bootstrapRecv(void* commState, int peer, int tag, void* data, int size) {
+  struct extState* state = (struct extState*)commState;
+
+  // Search unexpected messages first
+  struct unexMsg* msg = unexpectedMsgDequeue(state, peer, tag);
+  if (msg) {
+    int msgSize = msg->size;
+    if (msgSize <= size) memcpy(data, msg->data, msgSize);
+    free(msg->data);
+    free(msg);
+    if (msgSize > size) {
+      WARN("Message truncated : received %d bytes instead of %d", msgSize, size);
+      return ncclInternalError;
+    }
+    return ncclSuccess;
+  }
+
+  // Then read from the connection of that peer
+  int* fd = state->peerRecvFds+peer;
+  union socketAddress* addr = state->peerRecvAddrs+peer;
+  if (*fd == 0) NCCLCHECK(bootstrapAccept(state, peer, BOOTSTRAP_P2P_TAG, fd, addr));
+  while (1) {
+    struct bootstrapMsgHeader header;
+    NCCLCHECK(socketRecv(*fd, addr, &header, sizeof(header)));
+    if (header.peer != peer) {
+      WARN("Bootstrap : received message from rank %d on the connection of rank %d", header.peer, peer);
+      return ncclInternalError;
+    }
+    if (header.tag == tag) {
+      if (header.size > size) {
+        WARN("Message truncated : received %d bytes instead of %d", header.size, size);
+        return ncclInternalError;
+      }
+      NCCLCHECK(socketRecv(*fd, addr, data, header.size));
       return ncclSuccess;
     }
-    // Unexpected connection. Save for later.
-    NCCLCHECK(unexpectedEnqueue(state, newPeer, newTag, tmpRecvFd, &addr));
+    // Unexpected message. Save for later.
+    NCCLCHECK(unexpectedMsgEnqueue(state, &header, *fd, addr));
   }
 }
 
+// [RCCL] Close the persistent Bruck and point-to-point connections
+static void bootstrapPersistentClose(struct extState* state) {
+  for (int k=1; k<state->nBruckSteps; k++) {
+    if (state->bruckSendFds[k]) close(state->bruckSendFds[k]);
+    if (state->bruckRecvFds[k]) close(state->bruckRecvFds[k]);
+  }
+  free(state->bruckSendFds);
+  free(state->bruckRecvFds);
+  free(state->bruckSendAddrs);
+  free(state->bruckRecvAddrs);
+  for (int r=0; r<state->nranks; r++) {
+    if (state->peerSendFds && state->peerSendFds[r]) close(state->peerSendFds[r]);
+    if (state->peerRecvFds && state->peerRecvFds[r]) close(state->peerRecvFds[r]);
+  }
+  free(state->peerSendFds);
+  free(state->peerRecvFds);
+  free(state->peerRecvAddrs);
+}
+// [/RCCL]
+
 ncclResult_t bootstrapClose(void* commState) {
   struct extState* state = (struct extState*)commState;
-  if (state->unexpectedConnections != NULL) {
-    WARN("Unexpected connections are not empty");
-    return ncclInternalError;
+  for (int b=0; b<BOOTSTRAP_UNEX_BUCKETS; b++) {
+    if (state->unexpectedConnections[b] != NULL) {
+      WARN("Unexpected connections are not empty");
+      return ncclInternalError;
+    }
+    if (state->unexpectedMessages[b] != NULL) { // [RCCL]
+      WARN("Unexpected messages are not empty");
+      return ncclInternalError;
+    }
   }
   close(state->extListenFd);
   close(state->extRingSendFd);
   close(state->extRingRecvFd);
+  bootstrapPersistentClose(state); // [RCCL]
+  bootstrapShmClose(state); // [RCCL]
 
   state->allocState->stop = 1;
 
@@ -601,6 +1281,8 @@ ncclResult_t bootstrapAbort(void* commState) {
   if (state->extListenFd) close(state->extListenFd);
   if (state->extRingSendFd) close(state->extRingSendFd);
   if (state->extRingRecvFd) close(state->extRingRecvFd);
+  bootstrapPersistentClose(state); // [RCCL]
+  bootstrapShmClose(state); // [RCCL]
   if (state->allocState) state->allocState->stop = 2;
   free(state->peerCommAddresses);
   free(state->peerAllocAddresses);
@@ -44,6 +44,7 @@ class Primitives<
   };
   uint64_t volatile *connStepPtr;
   uint64_t connStepCache; // Cache last seen value of (*connStepPtr)
+  int connStepMask;       // [RCCL] Slots of the connection minus one, see ncclConnInfo::simpleSteps
   uint64_t* barriers;
   uint64_t* barrier_next;
   const uint64_t opCount;
@@ -94,30 +95,30 @@ class Primitives<
     if (((flags & (Recv*RoleWaitRecv)) && !noRecvWait) ||
         ((flags & (Send*RoleWaitSend)) && !noSendWait)) {
       int spins = 0;
-      while (connStepCache + (isSendNotRecv ? NCCL_STEPS : 0) < step + StepPerSlice) {
+      while (connStepCache + (isSendNotRecv ? connStepMask+1 : 0) < step + StepPerSlice) {
         __builtin_amdgcn_s_sleep(8);
         connStepCache = LOAD(connStepPtr);
         if (checkAbort(spins)) break;
-        //if (spins == 0) printf("r=%d b=%d t=%d SPUN OUT got=%d want=%d\n", ncclShmem->comm.rank, blockIdx.x, threadIdx.x, int(connStepCache + (isSendNotRecv ? NCCL_STEPS : 0)), int(step+StepPerSlice));
+        //if (spins == 0) printf("r=%d b=%d t=%d SPUN OUT got=%d want=%d\n", ncclShmem->comm.rank, blockIdx.x, threadIdx.x, int(connStepCache + (isSendNotRecv ? connStepMask+1 : 0)), int(step+StepPerSlice));
       }
       __asm__ __volatile__("s_wakeup");
     }
 
     if (flags & (Recv*RoleWaitRecv | Send*RoleWaitSend)) {
       if (isSendNotRecv && (flags & SizesFifoEnabled))
-        STORE(connSizesFifoPtr+step%NCCL_STEPS, nelts*sizeof(T));
+        STORE(connSizesFifoPtr+(step&connStepMask), nelts*sizeof(T));
 
       void **ptrs = isSendNotRecv ? (ncclShmem->groups[group].dsts + Dst)
                                   : (ncclShmem->groups[group].srcs + Src);
       if (flags & PtrsFifoEnabled)
-        loadPtr(connPtrsFifoPtr + step%NCCL_STEPS, ptrs[index]);
+        loadPtr(connPtrsFifoPtr + (step&connStepMask), ptrs[index]);
       else if (isSendNotRecv && DirectSend) {
         if (flags & DirectWrite) {
           ptrs[index] = directBuff + remoteIx + offset;
         } else if (flags & DirectRead) {  // empty send
           ptrs[index] = nullptr;
         } else {
-          ptrs[index] = connEltsFifo + (step%NCCL_STEPS)*stepSize;
+          ptrs[index] = connEltsFifo + (step&connStepMask)*stepSize;
         }
       } else if (!isSendNotRecv && DirectRecv) {
         if (flags & DirectRead) {
@@ -125,11 +126,11 @@ class Primitives<
         } else if (flags & DirectWrite) {
           ptrs[index] = directBuff + dstIx + offset;  // send to next from my output buffer
         } else {
-          ptrs[index] = connEltsFifo + (step%NCCL_STEPS)*stepSize;
+          ptrs[index] = connEltsFifo + (step&connStepMask)*stepSize;
         }
       }
       else {
-        ptrs[index] = connEltsFifo + (step%NCCL_STEPS)*stepSize;
+        ptrs[index] = connEltsFifo + (step&connStepMask)*stepSize;
       }
       step += StepPerSlice;
 #if defined(ENABLE_PROFILING) && !defined(ENABLE_TIMING_PROFILE)
@@ -340,6 +341,7 @@ class Primitives<
         ncclShmem->groups[group].recvConns[index] = conn; // WaitRecv role saves since that's who needs it in setDataPtrs()
         connStepPtr = conn->tail;
         connStepCache = LOAD(connStepPtr);
+        connStepMask = conn->simpleSteps-1; // [RCCL]
         flags |= (conn->ptrsFifo != nullptr) ? PtrsFifoEnabled : 0;
         if (Direct) {
           // User buffers have been registered
@@ -380,6 +382,7 @@ class Primitives<
         ncclShmem->groups[group].sendConns[index] = conn; // WaitSend role saves since that's who needs it in setDataPtrs()
         connStepPtr = conn->head;
         connStepCache = LOAD(connStepPtr);
+        connStepMask = conn->simpleSteps-1; // [RCCL]
         flags |= (conn->ptrsFifo != nullptr) ? PtrsFifoEnabled : 0;
         if (flags & PtrsFifoEnabled)
           connPtrsFifoPtr = conn->ptrsFifo;
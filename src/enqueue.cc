@@ -591,6 +591,7 @@ comp_next:
                      info->op;
   proxyArgs->pattern = info->pattern;
   proxyArgs->root = info->root;
+  proxyArgs->priority = ncclProxyPriority(info); // [RCCL]
   // This is used by P2P to reduce the receive buffer size. We don't use it in collectives
   // because some protocols need to transmit more than the total size, plus they sometimes
   // round up
@@ -0,0 +1,361 @@
+/*
+Copyright (c) 2021 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "core.h"
+#include "graph.h"
+#include "topo.h"
+#include "xml.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <algorithm>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Persistent cache of the graphs computed by ncclTopoCompute, enabled by RCCL_GRAPH_CACHE_DIR.
+//
+// Graphs are stored in the format of NCCL_GRAPH_FILE, one file per graph, named after a hash of
+// everything the search depends on : the trimmed topology XML, the system after trimming with
+// its paths, the search parameters of the graph and the environment variables changing paths.
+// GPUs are stored by device, so that nodes with the same topology share files. Files are
+// written under a temporary name then renamed, so that ranks sharing the directory only ever
+// see complete files. Ranks missing the same graph at the same time all compute it, and all
+// write the same file.
+//
+// The same system hash validates the graphs one rank computes for the others, see
+// ncclTopoSerializeGraphs.
+
+#define NCCL_GRAPH_CACHE_VERSION 1
+
+static void cacheHash(uint64_t* hash, const void* data, size_t size) {
+  // DJB2a, see getHash
+  const char* bytes = (const char*)data;
+  for (size_t i=0; i<size; i++) *hash = ((*hash << 5) + *hash) ^ bytes[i];
+}
+
+static void cacheHashStr(uint64_t* hash, const char* str) {
+  cacheHash(hash, str ? str : "(null)", strlen(str ? str : "(null)")+1);
+}
+
+template<typename T>
+static void cacheHashValue(uint64_t* hash, T value) {
+  cacheHash(hash, &value, sizeof(T));
+}
+
+static void ncclTopoHashXmlRec(uint64_t* hash, struct ncclXmlNode* node) {
+  cacheHashStr(hash, node->name);
+  for (int a=0; a<node->nAttrs; a++) {
+    // Ranks and NIC GUIDs differ between nodes with the same topology. Which NICs share an
+    // ASIC, the only use of GUIDs, is part of the system hash.
+    if (strcmp(node->attrs[a].key, "rank") == 0 || strcmp(node->attrs[a].key, "guid") == 0) continue;
+    cacheHashStr(hash, node->attrs[a].key);
+    cacheHashStr(hash, node->attrs[a].value);
+  }
+  cacheHashValue(hash, node->nSubs);
+  for (int s=0; s<node->nSubs; s++) ncclTopoHashXmlRec(hash, node->subs[s]);
+}
+
+ncclResult_t ncclTopoHashXml(struct ncclXml* xml, uint64_t* hash) {
+  *hash = 5381;
+  if (xml->maxIndex > 0) ncclTopoHashXmlRec(hash, xml->nodes);
+  return ncclSuccess;
+}
+
+static void cacheHashPath(uint64_t* hash, struct ncclTopoLinkList* path) {
+  cacheHashValue(hash, path->count);
+  cacheHashValue(hash, path->type);
+  cacheHashValue(hash, path->width);
+}
+
+// Environment variables changing paths or GPU Direct RDMA, which the search depends on
+static const char* cacheEnvs[] = { "NCCL_P2P_DISABLE", "NCCL_P2P_LEVEL", "NCCL_NET_GDR_LEVEL", "NCCL_NET_GDR_READ", "NCCL_NVB_DISABLE" };
+
+// Hash of the system as seen by ncclTopoCompute
+static void ncclTopoHashSystem(struct ncclTopoSystem* system, uint64_t* hash) {
+  *hash = system->xmlHash;
+  cacheHashValue(hash, NCCL_GRAPH_CACHE_VERSION);
+  cacheHashValue(hash, NCCL_GRAPH_XML_VERSION);
+  cacheHashValue(hash, NCCL_VERSION_CODE);
+  for (int e=0; e<sizeof(cacheEnvs)/sizeof(cacheEnvs[0]); e++) cacheHashStr(hash, getenv(cacheEnvs[e]));
+
+  int ngpus = system->nodes[GPU].count;
+  int nnets = system->nodes[NET].count;
+  cacheHashValue(hash, ngpus == system->nRanks);
+  cacheHashValue(hash, system->type);
+  cacheHashValue(hash, system->netGdrLevel);
+  cacheHashValue(hash, system->maxWidth);
+  cacheHashValue(hash, system->totalWidth);
+  cacheHashValue(hash, ngpus);
+  cacheHashValue(hash, nnets);
+  for (int n=0; n<nnets; n++) {
+    struct ncclTopoNode* net = system->nodes[NET].nodes+n;
+    int asic = 0;
+    while (system->nodes[NET].nodes[asic].net.asic != net->net.asic) asic++;
+    cacheHashValue(hash, net->id);
+    cacheHashValue(hash, asic);
+  }
+  // Ranks relative to the first one, which are the same on all nodes with the usual rank order
+  int minRank = INT_MAX;
+  for (int g=0; g<ngpus; g++) minRank = std::min(minRank, system->nodes[GPU].nodes[g].gpu.rank);
+  for (int g=0; g<ngpus; g++) {
+    struct ncclTopoNode* gpu = system->nodes[GPU].nodes+g;
+    cacheHashValue(hash, gpu->id);
+    cacheHashValue(hash, gpu->gpu.dev);
+    cacheHashValue(hash, gpu->gpu.rank-minRank);
+    for (int p=0; p<ngpus; p++) cacheHashPath(hash, gpu->paths[GPU]+p);
+    for (int n=0; n<nnets; n++) cacheHashPath(hash, gpu->paths[NET]+n);
+  }
+}
+
+ncclResult_t ncclTopoGraphCacheKey(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, int crossNic, uint64_t* key) {
+  *key = 0;
+  const char* dir = getenv("RCCL_GRAPH_CACHE_DIR");
+  if (dir == NULL || dir[0] == '\0') return ncclSuccess;
+  INFO(NCCL_ENV, "RCCL_GRAPH_CACHE_DIR set by environment to %s", dir);
+
+  uint64_t hash;
+  ncclTopoHashSystem(system, &hash);
+  cacheHashValue(&hash, graph->id);
+  cacheHashValue(&hash, graph->pattern);
+  cacheHashValue(&hash, crossNic);
+  cacheHashValue(&hash, graph->collNet);
+  cacheHashValue(&hash, graph->minChannels);
+  cacheHashValue(&hash, graph->maxChannels);
+  *key = hash ? hash : 1;
+  return ncclSuccess;
+}
+
+static void ncclTopoGraphCachePath(uint64_t key, char* path) {
+  snprintf(path, PATH_MAX, "%s/rccl-graph-%016lx.xml", getenv("RCCL_GRAPH_CACHE_DIR"), key);
+}
+
+ncclResult_t ncclTopoGraphCacheLoad(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, uint64_t key, int* loaded) {
+  *loaded = 0;
+  char path[PATH_MAX];
+  ncclTopoGraphCachePath(key, path);
+  if (access(path, R_OK) != 0) return ncclSuccess;
+
+  // Load into a copy, graph is left untouched unless the file is valid
+  struct ncclXml* xml;
+  struct ncclTopoGraph* cached;
+  NCCLCHECK(ncclCalloc(&xml, 1));
+  ncclResult_t ret = ncclCalloc(&cached, 1);
+  if (ret != ncclSuccess) {
+    free(xml);
+    return ret;
+  }
+  memcpy(cached, graph, sizeof(struct ncclTopoGraph));
+  cached->crossNic = 1; // Whether crossNic is allowed is part of the key
+  int nChannels = -1;
+  if (ncclTopoGetXmlGraphFromFile(path, xml) == ncclSuccess &&
+      ncclTopoGetGraphFromXml(xml->nodes, system, cached, &nChannels) == ncclSuccess && nChannels >= 0) {
+    memcpy(graph, cached, sizeof(struct ncclTopoGraph));
+    *loaded = 1;
+    INFO(NCCL_GRAPH, "Search %d : %d channels loaded from graph cache %s", graph->id, graph->nChannels, path);
+  } else {
+    INFO(NCCL_GRAPH, "Search %d : ignoring invalid graph cache %s", graph->id, path);
+  }
+  free(cached);
+  free(xml);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTopoGraphCacheStore(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, uint64_t key) {
+  const char* dir = getenv("RCCL_GRAPH_CACHE_DIR");
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    INFO(NCCL_GRAPH, "Could not create graph cache directory %s : %s", dir, strerror(errno));
+    return ncclSuccess;
+  }
+  if (access(dir, W_OK) != 0) {
+    INFO(NCCL_GRAPH, "Graph cache directory %s is not writable, not caching graph %d", dir, graph->id);
+    return ncclSuccess;
+  }
+  char path[PATH_MAX], tmpPath[PATH_MAX];
+  ncclTopoGraphCachePath(key, path);
+  snprintf(tmpPath, PATH_MAX, "%s.%d.%lx", path, getpid(), (unsigned long)pthread_self());
+
+  struct ncclXml* xml;
+  NCCLCHECK(ncclCalloc(&xml, 1));
+  ncclResult_t ret = ncclTopoGetXmlFromGraphs(1, &graph, system, xml);
+  if (ret == ncclSuccess) ret = ncclTopoDumpXmlToFile(tmpPath, xml);
+  free(xml);
+  NCCLCHECK(ret);
+  if (rename(tmpPath, path) != 0) {
+    INFO(NCCL_GRAPH, "Could not write graph cache %s : %s", path, strerror(errno));
+    unlink(tmpPath);
+    return ncclSuccess;
+  }
+  INFO(NCCL_GRAPH, "Search %d : stored in graph cache %s", graph->id, path);
+  return ncclSuccess;
+}
+
+// Graphs computed by one rank and sent to the ranks with the same topology, see RCCL_GRAPH_SHARE.
+// Channels are stored with GPU indexes instead of ranks, so that they apply to any node.
+
+// Environment variables changing how the graphs are computed, besides those of cacheEnvs
+static const char* shareEnvs[] = { "NCCL_GRAPH_FILE", "NCCL_RINGS", "NCCL_CROSS_NIC", "RCCL_MODEL_MATCHING_DISABLE", "RCCL_ENABLE_MULTIPLE_SAT" };
+
+struct ncclTopoSharedGraphs {
+  uint64_t fingerprint;
+  int type;        // Of the system after the search, model matching may change it
+  int netGdrLevel;
+  int ngraphs;
+  int ngpus;
+};
+
+struct ncclTopoSharedGraph {
+  int id;
+  int pattern;
+  int crossNic;
+  int collNet;
+  int minChannels;
+  int maxChannels;
+  int nChannels;
+  float speedIntra;
+  float speedInter;
+  int typeIntra;
+  int typeInter;
+  int sameChannels;
+  int nIntraChannels;
+  // Followed by int inter[nChannels*2], int intraNets[nChannels*ngpus*2] if nIntraChannels > 0,
+  // and uint8_t intra[nChannels*ngpus], padded to the alignment of the next graph
+};
+
+static int ncclTopoSharedGraphSize(struct ncclTopoSharedGraph* shared, int ngpus) {
+  int size = sizeof(struct ncclTopoSharedGraph) + shared->nChannels*2*sizeof(int) +
+    (shared->nIntraChannels ? shared->nChannels*ngpus*2*sizeof(int) : 0) + shared->nChannels*ngpus*sizeof(uint8_t);
+  return ROUNDUP(size, alignof(struct ncclTopoSharedGraph));
+}
+
+ncclResult_t ncclTopoGraphsFingerprint(struct ncclTopoSystem* system, uint64_t* fingerprint) {
+  uint64_t hash;
+  ncclTopoHashSystem(system, &hash);
+  for (int e=0; e<sizeof(shareEnvs)/sizeof(shareEnvs[0]); e++) cacheHashStr(&hash, getenv(shareEnvs[e]));
+  *fingerprint = hash ? hash : 1;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTopoSerializeGraphs(struct ncclTopoSystem* system, uint64_t fingerprint, int ngraphs, struct ncclTopoGraph** graphs, char** data, int* size) {
+  int ngpus = system->nodes[GPU].count;
+  int bytes = sizeof(struct ncclTopoSharedGraphs);
+  for (int i=0; i<ngraphs; i++) {
+    struct ncclTopoSharedGraph shared = { .nChannels = graphs[i]->nChannels, .nIntraChannels = graphs[i]->nIntraChannels };
+    bytes += ncclTopoSharedGraphSize(&shared, ngpus);
+  }
+  NCCLCHECK(ncclCalloc(data, bytes));
+  struct ncclTopoSharedGraphs* header = (struct ncclTopoSharedGraphs*)*data;
+  header->fingerprint = fingerprint;
+  header->type = system->type;
+  header->netGdrLevel = system->netGdrLevel;
+  header->ngraphs = ngraphs;
+  header->ngpus = ngpus;
+  char* ptr = *data+sizeof(struct ncclTopoSharedGraphs);
+  for (int i=0; i<ngraphs; i++) {
+    struct ncclTopoGraph* graph = graphs[i];
+    struct ncclTopoSharedGraph* shared = (struct ncclTopoSharedGraph*)ptr;
+    shared->id = graph->id;
+    shared->pattern = graph->pattern;
+    shared->crossNic = graph->crossNic;
+    shared->collNet = graph->collNet;
+    shared->minChannels = graph->minChannels;
+    shared->maxChannels = graph->maxChannels;
+    shared->nChannels = graph->nChannels;
+    shared->speedIntra = graph->speedIntra;
+    shared->speedInter = graph->speedInter;
+    shared->typeIntra = graph->typeIntra;
+    shared->typeInter = graph->typeInter;
+    shared->sameChannels = graph->sameChannels;
+    shared->nIntraChannels = graph->nIntraChannels;
+    int* inter = (int*)(shared+1);
+    memcpy(inter, graph->inter, graph->nChannels*2*sizeof(int));
+    int* intraNets = inter+graph->nChannels*2;
+    if (graph->nIntraChannels) {
+      memcpy(intraNets, graph->intraNets, graph->nChannels*ngpus*2*sizeof(int));
+      intraNets += graph->nChannels*ngpus*2;
+    }
+    uint8_t* intra = (uint8_t*)intraNets;
+    for (int c=0; c<graph->nChannels*ngpus; c++) {
+      int g;
+      NCCLCHECK(ncclTopoRankToIndex(system, graph->intra[c], &g));
+      intra[c] = g;
+    }
+    ptr += ncclTopoSharedGraphSize(shared, ngpus);
+  }
+  *size = bytes;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTopoDeserializeGraphs(struct ncclTopoSystem* system, uint64_t fingerprint, int ngraphs, struct ncclTopoGraph** graphs, char* data, int size, int* valid) {
+  *valid = 0;
+  int ngpus = system->nodes[GPU].count;
+  struct ncclTopoSharedGraphs* header = (struct ncclTopoSharedGraphs*)data;
+  if (size < sizeof(struct ncclTopoSharedGraphs) || header->fingerprint != fingerprint ||
+      header->ngraphs != ngraphs || header->ngpus != ngpus) return ncclSuccess;
+
+  // Check the sizes and the GPU indexes before touching the graphs
+  char* ptr = data+sizeof(struct ncclTopoSharedGraphs);
+  for (int i=0; i<ngraphs; i++) {
+    struct ncclTopoSharedGraph* shared = (struct ncclTopoSharedGraph*)ptr;
+    if (ptr+sizeof(struct ncclTopoSharedGraph) > data+size || shared->nChannels < 0 || shared->nChannels > MAXCHANNELS) return ncclSuccess;
+    if (ptr+ncclTopoSharedGraphSize(shared, ngpus) > data+size) return ncclSuccess;
+    uint8_t* intra = (uint8_t*)((int*)(shared+1) + shared->nChannels*2 + (shared->nIntraChannels ? shared->nChannels*ngpus*2 : 0));
+    for (int c=0; c<shared->nChannels*ngpus; c++) {
+      if (intra[c] >= ngpus) return ncclSuccess;
+    }
+    ptr += ncclTopoSharedGraphSize(shared, ngpus);
+  }
+  if (ptr != data+size) return ncclSuccess;
+
+  ptr = data+sizeof(struct ncclTopoSharedGraphs);
+  for (int i=0; i<ngraphs; i++) {
+    struct ncclTopoGraph* graph = graphs[i];
+    struct ncclTopoSharedGraph* shared = (struct ncclTopoSharedGraph*)ptr;
+    graph->id = shared->id;
+    graph->pattern = shared->pattern;
+    graph->crossNic = shared->crossNic;
+    graph->collNet = shared->collNet;
+    graph->minChannels = shared->minChannels;
+    graph->maxChannels = shared->maxChannels;
+    graph->nChannels = shared->nChannels;
+    graph->speedIntra = shared->speedIntra;
+    graph->speedInter = shared->speedInter;
+    graph->typeIntra = shared->typeIntra;
+    graph->typeInter = shared->typeInter;
+    graph->sameChannels = shared->sameChannels;
+    graph->nIntraChannels = shared->nIntraChannels;
+    int* inter = (int*)(shared+1);
+    memcpy(graph->inter, inter, graph->nChannels*2*sizeof(int));
+    int* intraNets = inter+graph->nChannels*2;
+    memset(graph->intraNets, 0, MAXCHANNELS*NCCL_TOPO_MAX_NODES*2*sizeof(int));
+    if (graph->nIntraChannels) {
+      memcpy(graph->intraNets, intraNets, graph->nChannels*ngpus*2*sizeof(int));
+      intraNets += graph->nChannels*ngpus*2;
+    }
+    uint8_t* intra = (uint8_t*)intraNets;
+    for (int c=0; c<graph->nChannels*ngpus; c++) graph->intra[c] = system->nodes[GPU].nodes[intra[c]].gpu.rank;
+    ptr += ncclTopoSharedGraphSize(shared, ngpus);
+  }
+  system->type = header->type;
+  system->netGdrLevel = header->netGdrLevel;
+  *valid = 1;
+  return ncclSuccess;
+}
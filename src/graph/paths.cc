@@ -32,9 +32,16 @@ static ncclResult_t getPath(struct ncclTopoSystem* system, struct ncclTopoNode*
 
 NCCL_PARAM(NvbDisable, "NVB_DISABLE", 0);
 
+// [RCCL] Paths start without a CPU step
+static ncclResult_t allocPaths(struct ncclTopoSystem* system, struct ncclTopoNode* node, int t) {
+  NCCLCHECK(ncclCalloc(node->paths+t, system->nodes[t].count));
+  for (int i=0; i<system->nodes[t].count; i++) node->paths[t][i].cpu = -1;
+  return ncclSuccess;
+}
+
 static ncclResult_t ncclTopoSetPaths(struct ncclTopoNode* baseNode, struct ncclTopoSystem* system) {
   if (baseNode->paths[baseNode->type] == NULL) {
-    NCCLCHECK(ncclCalloc(baseNode->paths+baseNode->type, system->nodes[baseNode->type].count));
+    NCCLCHECK(allocPaths(system, baseNode, baseNode->type));
   }
 
   // breadth-first search to set all paths to that node in the system
@@ -58,26 +65,24 @@ static ncclResult_t ncclTopoSetPaths(struct ncclTopoNode* baseNode, struct ncclT
         struct ncclTopoLink* link = node->links+l;
         struct ncclTopoNode* remNode = link->remNode;
         if (remNode->paths[baseNode->type] == NULL) {
-          NCCLCHECK(ncclCalloc(remNode->paths+baseNode->type, system->nodes[baseNode->type].count));
+          NCCLCHECK(allocPaths(system, remNode, baseNode->type));
         }
         struct ncclTopoLinkList* remPath;
         NCCLCHECK(getPath(system, remNode, baseNode->type, baseNode->id, &remPath));
         float width = std::min(path->width, link->width);
         if (remPath->width < width) {
           // Find reverse link
-          for (int l=0; l<remNode->nlinks; l++) {
-            if (remNode->links[l].remNode == node) {
-              remPath->list[0] = remNode->links+l;
-              break;
-            }
+          int revLink;
+          for (revLink=0; revLink<remNode->nlinks; revLink++) {
+            if (remNode->links[revLink].remNode == node) break;
           }
-          if (remPath->list[0] == NULL) {
+          if (revLink == remNode->nlinks) {
             WARN("Failed to find reverse path from remNode %d/%lx nlinks %d to node %d/%lx",
                  remNode->type, remNode->id, remNode->nlinks, node->type, node->id);
             return ncclInternalError;
           }
-          // Copy the rest of the path
-          for (int i=0; i<path->count; i++) remPath->list[i+1] = path->list[i];
+          // [RCCL] The rest of the path is the path of node
+          remPath->link = revLink;
           remPath->count = path->count + 1;
           remPath->width = width;
 
@@ -122,8 +127,10 @@ static void printNodePaths(struct ncclTopoSystem* system, struct ncclTopoNode* n
 #ifdef ENABLE_TRACE
       line[0] = 0;
       int offset = 0;
-      for (int i=0; i<node->paths[t][n].count; i++) {
-        struct ncclTopoLink* link = node->paths[t][n].list[i];
+      struct ncclTopoLink* links[NCCL_TOPO_MAX_HOPS];
+      int count = ncclTopoGetPathLinks(system, node, t, n, links);
+      for (int i=0; i<count; i++) {
+        struct ncclTopoLink* link = links[i];
         struct ncclTopoNode* remNode = link->remNode;
         sprintf(line+offset, "--%s->%s/%lX", topoLinkTypeStr[link->type], topoNodeTypeStr[remNode->type], remNode->id);
         offset = strlen(line);
@@ -174,14 +181,11 @@ static ncclResult_t addCpuStep(struct ncclTopoSystem* system, int c, int t1, int
   struct ncclTopoNode* cpuNode = system->nodes[CPU].nodes+c;
   struct ncclTopoNode* srcNode = system->nodes[t1].nodes+i1;
 
-  int l=0;
-  // Node 1 -> CPU
-  for (int i=0; i<srcNode->paths[CPU][c].count; i++) srcNode->paths[t2][i2].list[l++] = srcNode->paths[CPU][c].list[i];
-  // CPU -> Node 2
-  for (int i=0; i<cpuNode->paths[t2][i2].count; i++) srcNode->paths[t2][i2].list[l++] = cpuNode->paths[t2][i2].list[i];
+  // [RCCL] Node 1 -> CPU, then CPU -> Node 2, see ncclTopoGetPathLinks
+  srcNode->paths[t2][i2].cpu = c;
 
   // Update path characteristics
-  srcNode->paths[t2][i2].count = l;
+  srcNode->paths[t2][i2].count = srcNode->paths[CPU][c].count + cpuNode->paths[t2][i2].count;
   srcNode->paths[t2][i2].type = std::max(srcNode->paths[CPU][c].type, cpuNode->paths[t2][i2].type);
   srcNode->paths[t2][i2].width = std::min(srcNode->paths[CPU][c].width, cpuNode->paths[t2][i2].width);
   return ncclSuccess;
@@ -259,7 +263,9 @@ ncclResult_t ncclTopoCheckP2p(struct ncclTopoSystem* system, int64_t id1, int64_
   // Set intermediate GPU rank, if routing through an intermediate GPU.
   struct ncclTopoLinkList* path = gpu1->paths[GPU]+g2;
   if (path->count == 2) {
-    struct ncclTopoNode* intermediateNode = path->list[0]->remNode;
+    struct ncclTopoLink* links[2];
+    ncclTopoGetPathLinks(system, gpu1, GPU, g2, links);
+    struct ncclTopoNode* intermediateNode = links[0]->remNode;
     if (intermediateNode->type == GPU && intermediateRank) {
       *intermediateRank = intermediateNode->gpu.rank;
     }
@@ -374,6 +380,7 @@ ncclResult_t ncclTopoComputePaths(struct ncclTopoSystem* system, struct ncclPeer
 
   // Remove everything in case we're re-computing
   for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) ncclTopoRemovePathType(system, t);
+  system->pathsStale = 0; // [RCCL]
 
   // Set direct paths from/to CPUs. We need them in many cases.
   for (int c=0; c<system->nodes[CPU].count; c++) {
@@ -541,6 +548,11 @@ ncclResult_t ncclTopoTrimSystem(struct ncclTopoSystem* system, struct ncclComm*
 
 void ncclTopoFree(struct ncclTopoSystem* system) {
   for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) ncclTopoRemovePathType(system, t);
+  // [RCCL]
+  free(system->searchTable);
+  free(system->searchHopsIndex);
+  free(system->searchHops);
+  // [/RCCL]
   free(system);
 }
 
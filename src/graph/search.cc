@@ -34,7 +34,47 @@ static float getTotalWidth(struct ncclTopoSystem* system, struct ncclTopoNode* g
   }
   return std::max(pciWidth, nvlinkWidth);
 }
+// [RCCL] Rebuilding the hops of paths from their next hops each time the search follows them
+// would slow it down. They are kept for paths from and to GPUs and NETs, GPUs coming first.
+static int searchHopsNode(struct ncclTopoSystem* system, int type, int index) {
+  return (type == NET ? system->nodes[GPU].count : 0) + index;
+}
+
+static ncclResult_t ncclTopoSearchInitHops(struct ncclTopoSystem* system) {
+  free(system->searchHopsIndex);
+  free(system->searchHops);
+  system->searchHopsIndex = NULL;
+  system->searchHops = NULL;
+  int types[] = { GPU, NET };
+  int n = system->nodes[GPU].count + system->nodes[NET].count;
+  NCCLCHECK(ncclCalloc(&system->searchHopsIndex, n*n));
+  int nhops = 0;
+  for (int pass=0; pass<2; pass++) {
+    if (pass == 1) NCCLCHECK(ncclCalloc(&system->searchHops, std::max(nhops, 1)));
+    nhops = 0;
+    for (int t1=0; t1<2; t1++) {
+      for (int i1=0; i1<system->nodes[types[t1]].count; i1++) {
+        struct ncclTopoNode* node = system->nodes[types[t1]].nodes+i1;
+        for (int t2=0; t2<2; t2++) {
+          if (node->paths[types[t2]] == NULL) continue;
+          for (int i2=0; i2<system->nodes[types[t2]].count; i2++) {
+            if (pass == 0) {
+              nhops += node->paths[types[t2]][i2].count;
+              continue;
+            }
+            system->searchHopsIndex[searchHopsNode(system, types[t1], i1)*n+searchHopsNode(system, types[t2], i2)] = nhops;
+            nhops += ncclTopoGetPathLinks(system, node, types[t2], i2, system->searchHops+nhops);
+          }
+        }
+      }
+    }
+  }
+  return ncclSuccess;
+}
+// [/RCCL]
+
 ncclResult_t ncclTopoSearchInit(struct ncclTopoSystem* system) {
+  NCCLCHECK(ncclTopoSearchInitHops(system)); // [RCCL]
   system->maxWidth = 0.0;
   system->totalWidth = 0.0;
   int inter = system->nodes[NET].count;
@@ -65,10 +105,46 @@ static ncclResult_t findRevLink(struct ncclTopoNode* node1, struct ncclTopoNode*
 // This is unfortunately needed since manipulating floats often results in rounding errors.
 #define SUB_ROUND(a, b) (a = roundf((a-b)*1000)/1000)
 
-static ncclResult_t followPath(struct ncclTopoLinkList* path, struct ncclTopoNode* start, int maxSteps, float speed, int* steps) {
+// [RCCL] Search state hashing, see ncclTopoSearchKey
+static uint64_t searchMix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Cheaper than searchMix, for the weights of links and NICs which are mixed into keys later on
+static uint64_t searchWeight(ptrdiff_t offset) {
+  uint64_t x = (uint64_t)offset * 0x9e3779b97f4a7c15ULL;
+  return x ^ (x >> 29);
+}
+
+static uint64_t searchHashFloat(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+// searchHash is the sum of the widths weighted by a random number per link or NIC, so that it only
+// depends on the current widths, whatever the order in which they were consumed. It is updated
+// from the old value each time a width changes.
+static void ncclTopoSearchHashLink(struct ncclTopoSystem* system, struct ncclTopoLink* link, float oldWidth) {
+  if (system->searchPrune == 0) return;
+  system->searchHash += searchWeight((char*)link-(char*)system) * (searchHashFloat(link->width) - searchHashFloat(oldWidth));
+}
+
+static void ncclTopoSearchHashNet(struct ncclTopoSystem* system, struct ncclTopoNode* net, float oldWidth, int oldMaxChannels) {
+  if (system->searchPrune == 0) return;
+  uint64_t r = searchWeight((char*)net-(char*)system);
+  system->searchHash += r * (searchHashFloat(net->net.width) - searchHashFloat(oldWidth));
+  system->searchHash += searchMix(r) * (uint64_t)(net->net.maxChannels - oldMaxChannels);
+}
+// [/RCCL]
+
+static ncclResult_t followPath(struct ncclTopoSystem* system, struct ncclTopoLinkList* path, struct ncclTopoLink** links, struct ncclTopoNode* start, int maxSteps, float speed, int* steps) {
   float pciSpeed = speed;
   for (int step=0; step<path->count; step++) {
-    struct ncclTopoNode* node = path->list[step]->remNode;
+    struct ncclTopoNode* node = links[step]->remNode;
     if (node->type == CPU) {
       // Account for P2P inefficiency through Intel CPU RC
       if (path->type == PATH_PHB && start->type == GPU &&
@@ -81,7 +157,7 @@ static ncclResult_t followPath(struct ncclTopoLinkList* path, struct ncclTopoNod
 
   struct ncclTopoNode* node = start;
   for (int step=0; step<maxSteps; step++) {
-    struct ncclTopoLink* link = path->list[step];
+    struct ncclTopoLink* link = links[step];
     struct ncclTopoLink* revLink = NULL;
     float fwSpeed = link->type == LINK_PCI ? pciSpeed : speed;
     float revSpeed = 0;
@@ -94,8 +170,14 @@ static ncclResult_t followPath(struct ncclTopoLinkList* path, struct ncclTopoNod
       revSpeed += fwSpeed;
     }
     if (link->width < fwSpeed || (revSpeed && revLink->width < revSpeed)) { *steps = step; return ncclSuccess; }
+    float width = link->width; // [RCCL]
     SUB_ROUND(link->width, fwSpeed);
-    if (revSpeed) SUB_ROUND(revLink->width, revSpeed);
+    ncclTopoSearchHashLink(system, link, width); // [RCCL]
+    if (revSpeed) {
+      width = revLink->width; // [RCCL]
+      SUB_ROUND(revLink->width, revSpeed);
+      ncclTopoSearchHashLink(system, revLink, width); // [RCCL]
+    }
     node = link->remNode;
   }
   *steps = maxSteps;
@@ -122,8 +204,12 @@ static ncclResult_t ncclTopoFollowPath(struct ncclTopoSystem* system, struct ncc
   speed *= mult;
 
   // Check there is enough bandwidth on paths.
+  // [RCCL]
+  int n = system->nodes[GPU].count + system->nodes[NET].count;
+  struct ncclTopoLink** links = system->searchHops + system->searchHopsIndex[searchHopsNode(system, type1, index1)*n+searchHopsNode(system, type2, index2)];
+  // [/RCCL]
   int step = 0;
-  NCCLCHECK(followPath(path, node1, path->count, speed, &step));
+  NCCLCHECK(followPath(system, path, links, node1, path->count, speed, &step));
   if (step < path->count) goto rewind;
 
   // Enough bandwidth : return destination node.
@@ -133,7 +219,7 @@ static ncclResult_t ncclTopoFollowPath(struct ncclTopoSystem* system, struct ncc
 
 rewind:
   // Not enough bandwidth : rewind and exit.
-  NCCLCHECK(followPath(path, node1, step, -speed, &step));
+  NCCLCHECK(followPath(system, path, links, node1, step, -speed, &step));
   return ncclSuccess;
 }
 
@@ -278,6 +364,48 @@ ncclResult_t ncclTopoReplayGetGpu(struct ncclTopoSystem* system, struct ncclTopo
   return ncclSuccess;
 }
 
+// [RCCL] Transposition table
+//
+// The search often reaches the same state through different orders : the same channels found
+// in another order, or GPUs behind the same switch visited in another order, consuming the same
+// link widths. Once a state has been fully explored, exploring it again can only find graphs
+// which are not better than the ones found the first time, and those were already compared to
+// the best graph. States are identified by a hash of everything the rest of the search depends
+// on, and only reused within the same search.
+RCCL_PARAM(TopoSearchPrune, "TOPO_SEARCH_PRUNE", 1);
+
+// Entries are overwritten by newer states, which are the likeliest to be reached again. Larger
+// tables miss the cache on every step and slow down searches which run out of time.
+#define NCCL_TOPO_SEARCH_TABLE_SIZE (1<<14)
+// Stop using the table when less than 1/NCCL_TOPO_SEARCH_MIN_HITS of the lookups hit, checked
+// every NCCL_TOPO_SEARCH_CHECK lookups
+#define NCCL_TOPO_SEARCH_CHECK (1<<14)
+#define NCCL_TOPO_SEARCH_MIN_HITS 16
+
+static uint64_t ncclTopoSearchKey(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, struct ncclTopoNode* gpu, int step, int backToNet, int backToFirstRank, int forcedOrder) {
+  int ngpus = system->nodes[GPU].count;
+  int c = graph->nChannels;
+  const uint64_t flag = 1ULL<<c;
+  uint64_t key = searchMix(system->searchId) ^ system->searchHash;
+  key = searchMix(key ^ ((uint64_t)c | (uint64_t)step << 16 | (uint64_t)(gpu-system->nodes[GPU].nodes) << 32 | (uint64_t)forcedOrder << 48));
+  key = searchMix(key ^ ((uint64_t)(backToNet+1) | (uint64_t)(backToFirstRank+1) << 16 | (uint64_t)(uint32_t)graph->nHops << 32));
+  // First GPU of the channel, and GPUs used by the channel in any order
+  uint64_t used = graph->intra[c*ngpus];
+  for (int g=0; g<ngpus; g++) {
+    if (system->nodes[GPU].nodes[g].used & flag) used ^= g < 32 ? 1ULL << (32+g) : searchMix(g);
+  }
+  key = searchMix(key ^ used);
+  if (system->nodes[NET].count) key = searchMix(key ^ ((uint64_t)(uint32_t)graph->inter[c*2] | (uint64_t)graph->inter[c*2+1] << 32));
+  // Replaying the previous channel, or having the next channels replay this one, depends on the order of GPUs
+  if (forcedOrder == FORCED_ORDER_REPLAY || graph->sameChannels) {
+    uint64_t order = 0;
+    for (int i=(c ? (c-1)*ngpus : 0); i<=c*ngpus+step; i++) order = order*0x100000001b3ULL + (uint32_t)graph->intra[i] + 1;
+    key = searchMix(key ^ order);
+  }
+  return key ? key : 1;
+}
+// [/RCCL]
+
 ncclResult_t ncclTopoSearchRecGpu(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, struct ncclTopoGraph* saveGraph, struct ncclTopoNode* gpu, int step, int backToNet, int backToFirstRank, int forcedOrder, int *time);
 
 ncclResult_t ncclTopoSearchTryGpu(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, struct ncclTopoGraph* saveGraph, int step, int backToNet, int backToFirstRank, int forcedOrder, int *time, int type, int index, int g) {
@@ -308,7 +436,7 @@ static int ncclTopoCountXGMI(struct ncclTopoSystem* system, struct ncclTopoGraph
         node = system->nodes[GPU].nodes+j;
         for (int k = 0; k<system->nodes[GPU].count; k++) {
           if (node->paths[GPU][k].count == 1) {
-            struct ncclTopoLink* link = node->paths[GPU][k].list[0];
+            struct ncclTopoLink* link = node->links+node->paths[GPU][k].link;
             struct ncclTopoNode* remNode = link->remNode;
             if (remNode->gpu.rank == n) {
               if (link->type == LINK_NVL)
@@ -343,6 +471,7 @@ ncclResult_t ncclTopoCompareGraphs(struct ncclTopoSystem* system, struct ncclTop
 
 ncclResult_t ncclTopoSearchRecGpu(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, struct ncclTopoGraph* saveGraph, struct ncclTopoNode* gpu, int step, int backToNet, int backToFirstRank, int forcedOrder, int *time) {
   if ((*time) <= 0) return ncclSuccess;
+  if (system->searchCancel && __atomic_load_n(system->searchCancel, __ATOMIC_RELAXED)) return ncclSuccess; // [RCCL]
   (*time)--;
 
   int ngpus = system->nodes[GPU].count;
@@ -363,6 +492,21 @@ ncclResult_t ncclTopoSearchRecGpu(struct ncclTopoSystem* system, struct ncclTopo
   }
   graph->intra[graph->nChannels*ngpus+step] = gpu->gpu.rank;
   int g = gpu - system->nodes[GPU].nodes;
+  // [RCCL]
+  uint64_t key = 0;
+  if (system->searchPrune) {
+    key = ncclTopoSearchKey(system, graph, gpu, step, backToNet, backToFirstRank, forcedOrder);
+    if (system->searchTable[key%NCCL_TOPO_SEARCH_TABLE_SIZE] == key) {
+      system->searchHits++;
+      return ncclSuccess;
+    }
+    // Searches which rarely reach the same state twice are faster without the table
+    if (++system->searchLookups % NCCL_TOPO_SEARCH_CHECK == 0 && system->searchHits < system->searchLookups/NCCL_TOPO_SEARCH_MIN_HITS) {
+      system->searchPrune = 0;
+      key = 0;
+    }
+  }
+  // [/RCCL]
   if (step == backToNet) {
     // first get back to NIC
     if (system->nodes[NET].count) {
@@ -426,6 +570,8 @@ ncclResult_t ncclTopoSearchRecGpu(struct ncclTopoSystem* system, struct ncclTopo
     // Next path
     NCCLCHECK(ncclTopoSearchRecGpu(system, graph, saveGraph, gpu, ngpus, -1, -1, forcedOrder, time));
   }
+  // [RCCL] Fully explored, unless the search ran out of time
+  if (key && system->searchPrune && *time > 0) system->searchTable[key%NCCL_TOPO_SEARCH_TABLE_SIZE] = key;
   return ncclSuccess;
 }
 
@@ -482,6 +628,49 @@ ncclResult_t ncclTopoSelectNets(struct ncclTopoSystem* system, int* nets, int* n
   return ncclSuccess;
 }
 
+// [RCCL] Symmetry breaking
+//
+// Returns whether net1 and net2 are attached to the same node through identical NICs, which
+// searches consumed in the same way so far. Starting a channel from either then leads to the
+// same graphs, up to swapping them.
+static int sameLink(struct ncclTopoLink* link1, struct ncclTopoLink* link2) {
+  return link1->type == link2->type && link1->width == link2->width;
+}
+
+static struct ncclTopoLink* getLink(struct ncclTopoNode* node, struct ncclTopoNode* remNode) {
+  for (int l=0; l<node->nlinks; l++) {
+    if (node->links[l].remNode == remNode) return node->links+l;
+  }
+  return NULL;
+}
+
+static int ncclTopoSearchNetTwins(struct ncclTopoSystem* system, struct ncclTopoNode* net1, struct ncclTopoNode* net2) {
+  if (net1->net.width != net2->net.width || net1->net.maxChannels != net2->net.maxChannels ||
+      net1->net.collSupport != net2->net.collSupport || net1->net.gdrSupport != net2->net.gdrSupport) return 0;
+  // NICs sharing their bandwidth with other NETs are not interchangeable
+  for (int n=0; n<system->nodes[NET].count; n++) {
+    struct ncclTopoNode* net = system->nodes[NET].nodes+n;
+    if (net == net1 || net == net2) continue;
+    if ((net->net.asic == net1->net.asic && net->net.port == net1->net.port) ||
+        (net->net.asic == net2->net.asic && net->net.port == net2->net.port)) return 0;
+  }
+  if (net1->nlinks != 1 || net2->nlinks != 1 || !sameLink(net1->links, net2->links)) return 0;
+  struct ncclTopoNode* nic1 = net1->links[0].remNode;
+  struct ncclTopoNode* nic2 = net2->links[0].remNode;
+  struct ncclTopoLink* rev1 = getLink(nic1, net1);
+  struct ncclTopoLink* rev2 = getLink(nic2, net2);
+  if (rev1 == NULL || rev2 == NULL || !sameLink(rev1, rev2)) return 0;
+  if (nic1 == nic2) return 1; // Ports of the same NIC
+  if (nic1->nlinks != 2 || nic2->nlinks != 2) return 0;
+  struct ncclTopoLink* up1 = nic1->links + (rev1 == nic1->links ? 1 : 0);
+  struct ncclTopoLink* up2 = nic2->links + (rev2 == nic2->links ? 1 : 0);
+  if (up1->remNode != up2->remNode || !sameLink(up1, up2)) return 0;
+  struct ncclTopoLink* down1 = getLink(up1->remNode, nic1);
+  struct ncclTopoLink* down2 = getLink(up2->remNode, nic2);
+  return down1 && down2 && sameLink(down1, down2);
+}
+// [/RCCL]
+
 ncclResult_t ncclTopoSearchRecNet(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, struct ncclTopoGraph* saveGraph, int backToNet, int backToFirstRank, int* time) {
   const int speed = graph->speedInter;
   int* nets;
@@ -495,15 +684,24 @@ ncclResult_t ncclTopoSearchRecNet(struct ncclTopoSystem* system, struct ncclTopo
     if (graph->collNet && net->net.collSupport == 0) continue;
     if (net->net.width < speed) continue;
     if (net->net.maxChannels == 0) continue;
+    // [RCCL] Skip NETs equivalent to one already tried
+    if (system->searchTable) {
+      int j;
+      for (j=0; j<i; j++) if (ncclTopoSearchNetTwins(system, system->nodes[NET].nodes+nets[j], net)) break;
+      if (j<i) continue;
+    }
 
     graph->inter[graph->nChannels*2] = net->id;
     for (int i=0; i<system->nodes[NET].count; i++) {
       if ((system->nodes[NET].nodes[i].net.asic == net->net.asic) &&
           (system->nodes[NET].nodes[i].net.port == net->net.port)) {
+        float width = system->nodes[NET].nodes[i].net.width; // [RCCL]
         system->nodes[NET].nodes[i].net.width -= speed;
+        ncclTopoSearchHashNet(system, system->nodes[NET].nodes+i, width, system->nodes[NET].nodes[i].net.maxChannels); // [RCCL]
       }
     }
     net->net.maxChannels--;
+    ncclTopoSearchHashNet(system, net, net->net.width, net->net.maxChannels+1); // [RCCL]
 
     // First try to replay the last channel
     if (graph->nChannels > 0) {
@@ -564,10 +762,13 @@ ncclResult_t ncclTopoSearchRecNet(struct ncclTopoSystem* system, struct ncclTopo
     }
 
     net->net.maxChannels++;
+    ncclTopoSearchHashNet(system, net, net->net.width, net->net.maxChannels-1); // [RCCL]
     for (int i=0; i<system->nodes[NET].count; i++) {
       if ((system->nodes[NET].nodes[i].net.asic == net->net.asic) &&
           (system->nodes[NET].nodes[i].net.port == net->net.port)) {
+        float width = system->nodes[NET].nodes[i].net.width; // [RCCL]
         system->nodes[NET].nodes[i].net.width += speed;
+        ncclTopoSearchHashNet(system, system->nodes[NET].nodes+i, width, system->nodes[NET].nodes[i].net.maxChannels); // [RCCL]
       }
     }
   }
@@ -627,12 +828,27 @@ ncclResult_t ncclTopoSearchRec(struct ncclTopoSystem* system, struct ncclTopoGra
       // Finally, try all other possibilities unless we are forced to use the same channels
       for (int g=0; g<system->nodes[GPU].count; g++) {
         NCCLCHECK(ncclTopoSearchTryGpu(system, graph, saveGraph, 0, backToNet, backToFirstRank, 0, time, -1, -1, g));
+        // [RCCL] Rings starting from other GPUs are rotations of the rings starting from the first one
+        if (system->searchTable && backToFirstRank != -1) break;
       }
     }
   }
   return ncclSuccess;
 }
 
+// [RCCL] Starts a new search, which does not reuse the states explored by previous searches since
+// they were compared to other best graphs.
+static ncclResult_t ncclTopoSearchStart(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, struct ncclTopoGraph* saveGraph, int* time) {
+  if (rcclParamTopoSearchPrune() && system->searchTable == NULL) {
+    NCCLCHECK(ncclCalloc(&system->searchTable, NCCL_TOPO_SEARCH_TABLE_SIZE));
+  }
+  system->searchId++;
+  system->searchHash = 0;
+  system->searchPrune = system->searchTable ? 1 : 0;
+  system->searchLookups = system->searchHits = 0;
+  return ncclTopoSearchRec(system, graph, saveGraph, time);
+}
+
 /************************************/
 /* User defined graph from XML file */
 /************************************/
@@ -770,6 +986,342 @@ float speedArrayInter[] = { 48.0, 30.0, 24.0, 22.0, 18.0, 15.0, 12.0, 10.0, 9.0,
 RCCL_PARAM(ModelMatchingDisable, "MODEL_MATCHING_DISABLE", 0);
 RCCL_PARAM(EnableMultipleSAT, "ENABLE_MULTIPLE_SAT", 0);
 
+// [RCCL] Parallel search
+//
+// Pass 1 of ncclTopoCompute tries a fixed sequence of configurations, relaxing the constraints
+// after each search, until one finds a graph. On large systems most of these searches time out
+// without finding anything, one after another. Once a search has used its full budget in vain,
+// helper threads search the next configurations ahead of time, assuming the best graph so far
+// will not change, each on its own copy of the system. Results are used in order, and only if the configuration
+// and the best graph they started from are the ones of the serial search. Searches which no
+// longer match are cancelled. Since timeouts count steps, the graphs are the same as searching
+// serially, whatever the number of threads.
+RCCL_PARAM(TopoSearchThreads, "TOPO_SEARCH_THREADS", 8);
+
+#define NCCL_TOPO_SEARCH_JOBS_PER_THREAD 2
+
+static int ncclTopoSearchTimeout(struct ncclTopoGraph* graph) {
+  return graph->sameChannels ? NCCL_SEARCH_TIMEOUT_SAMECHANNELS :
+    graph->pattern == NCCL_TOPO_PATTERN_TREE ? NCCL_SEARCH_TIMEOUT_TREE : NCCL_SEARCH_TIMEOUT;
+}
+
+// Relaxes the constraints of tmpGraph after a search of pass 1, given the best graph so far.
+// Returns 0 once pass 1 is over.
+static int ncclTopoSearchRelax(struct ncclTopoSystem* system, struct ncclTopoGraph* tmpGraph, struct ncclTopoGraph* graph, int crossNic, float* speedArray, int nspeeds, int* speedIndex, int time, int64_t* globalTimeout) {
+  int ngpus = system->nodes[GPU].count;
+
+  // Try having different channels
+  if (tmpGraph->sameChannels == 1) {
+    tmpGraph->sameChannels = 0;
+    return 1;
+  }
+  tmpGraph->sameChannels = 1;
+
+  if (time != -1) *globalTimeout += time;
+  else *globalTimeout = NCCL_SEARCH_GLOBAL_TIMEOUT;
+  if (*globalTimeout < 0 && graph->nChannels) return 0;
+
+  int maxTypeIntra = system->nodes[NET].count > 0 ? tmpGraph->typeInter : PATH_SYS;
+  if (tmpGraph->typeIntra < maxTypeIntra && (graph->nChannels == 0 || tmpGraph->typeIntra < graph->typeIntra)) {
+    tmpGraph->typeIntra += 1;
+    return 1;
+  }
+  tmpGraph->typeIntra = ngpus == 1 ? PATH_LOC : PATH_NVL;
+  if (system->nodes[NET].count > 0 && tmpGraph->typeInter < PATH_SYS && (graph->nChannels == 0 || tmpGraph->typeInter < graph->typeInter || tmpGraph->typeInter < PATH_PXB)) {
+    tmpGraph->typeInter += 1;
+    return 1;
+  }
+  tmpGraph->typeInter = PATH_PIX;
+
+  // Try a simpler tree
+  if (tmpGraph->pattern == NCCL_TOPO_PATTERN_SPLIT_TREE) {
+    tmpGraph->pattern = NCCL_TOPO_PATTERN_TREE;
+    return 1;
+  }
+  tmpGraph->pattern = graph->pattern;
+
+  if (crossNic && tmpGraph->crossNic == 0) {
+    // Try again with crossNic if permitted
+    tmpGraph->crossNic = crossNic;
+    return 1;
+  }
+  tmpGraph->crossNic = 0;
+
+  // Decrease speed until we find a solution
+  if ((*speedIndex < nspeeds-1) && (graph->nChannels == 0 || (speedArray[*speedIndex+1]/graph->speedInter > .49))) {
+    tmpGraph->speedInter = tmpGraph->speedIntra = speedArray[++(*speedIndex)];
+    return 1;
+  }
+  *speedIndex = 0;
+  while (speedArray[*speedIndex] > system->maxWidth && *speedIndex < nspeeds-1) (*speedIndex)++;
+  tmpGraph->speedIntra = tmpGraph->speedInter = speedArray[*speedIndex];
+  return 0;
+}
+
+static int ncclTopoSearchSameConfig(struct ncclTopoGraph* g1, struct ncclTopoGraph* g2) {
+  return g1->pattern == g2->pattern && g1->crossNic == g2->crossNic && g1->collNet == g2->collNet &&
+    g1->minChannels == g2->minChannels && g1->maxChannels == g2->maxChannels &&
+    g1->speedIntra == g2->speedIntra && g1->speedInter == g2->speedInter &&
+    g1->typeIntra == g2->typeIntra && g1->typeInter == g2->typeInter && g1->sameChannels == g2->sameChannels;
+}
+
+// Copies the system, with links and paths pointing into the copy
+static ncclResult_t ncclTopoSearchCopySystem(struct ncclTopoSystem* system, struct ncclTopoSystem** copyPtr) {
+  struct ncclTopoSystem* copy;
+  NCCLCHECK(ncclCalloc(&copy, 1));
+  memcpy(copy, system, sizeof(struct ncclTopoSystem));
+  copy->searchCancel = NULL;
+  copy->searchTable = NULL;
+  copy->searchHopsIndex = NULL;
+  copy->searchHops = NULL;
+  ptrdiff_t offset = (char*)copy - (char*)system;
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    for (int n=0; n<copy->nodes[t].count; n++) {
+      struct ncclTopoNode* node = copy->nodes[t].nodes+n;
+      for (int l=0; l<node->nlinks; l++) node->links[l].remNode = (struct ncclTopoNode*)((char*)node->links[l].remNode+offset);
+      for (int t2=0; t2<NCCL_TOPO_NODE_TYPES; t2++) node->paths[t2] = NULL;
+    }
+  }
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    for (int n=0; n<copy->nodes[t].count; n++) {
+      struct ncclTopoNode* node = system->nodes[t].nodes+n;
+      struct ncclTopoNode* copyNode = copy->nodes[t].nodes+n;
+      for (int t2=0; t2<NCCL_TOPO_NODE_TYPES; t2++) {
+        if (node->paths[t2] == NULL) continue;
+        int count = system->nodes[t2].count;
+        ncclResult_t ret = ncclCalloc(copyNode->paths+t2, count);
+        if (ret != ncclSuccess) {
+          ncclTopoFree(copy);
+          return ret;
+        }
+        // Paths only hold link indexes, which are the same in the copy
+        memcpy(copyNode->paths[t2], node->paths[t2], count*sizeof(struct ncclTopoLinkList));
+      }
+    }
+  }
+  ncclResult_t ret = ncclTopoSearchInitHops(copy);
+  if (ret != ncclSuccess) {
+    ncclTopoFree(copy);
+    return ret;
+  }
+  *copyPtr = copy;
+  return ncclSuccess;
+}
+
+// Restores the state modified by searches, so that results do not depend on previous searches
+static void ncclTopoSearchResetSystem(struct ncclTopoSystem* copy, struct ncclTopoSystem* system) {
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    for (int n=0; n<system->nodes[t].count; n++) {
+      struct ncclTopoNode* node = system->nodes[t].nodes+n;
+      struct ncclTopoNode* copyNode = copy->nodes[t].nodes+n;
+      copyNode->used = node->used;
+      for (int l=0; l<node->nlinks; l++) copyNode->links[l].width = node->links[l].width;
+      if (t == NET) {
+        copyNode->net.width = node->net.width;
+        copyNode->net.maxChannels = node->net.maxChannels;
+      }
+    }
+  }
+}
+
+enum ncclTopoSearchJobState { ncclTopoSearchJobFree, ncclTopoSearchJobPending, ncclTopoSearchJobRunning, ncclTopoSearchJobDone };
+
+struct ncclTopoSearchJob {
+  struct ncclTopoGraph tmpGraph;   // Configuration searched
+  struct ncclTopoGraph saveGraph;  // Best graph, starting from the best graph when queued
+  int time;
+  ncclResult_t ret;
+  int state;
+  int cancel;                      // Set once the result is no longer needed
+  uint64_t seq;                    // In the sequence of searches
+  uint64_t gen;                    // Of the best graph the search starts from
+};
+
+struct ncclTopoSearchPool;
+struct ncclTopoSearchThread {
+  struct ncclTopoSearchPool* pool;
+  struct ncclTopoSystem* system;   // Copy searched by the thread
+  pthread_t thread;
+};
+
+struct ncclTopoSearchPool {
+  struct ncclTopoSystem* system;   // Not modified while helper threads run
+  int crossNic;
+  float* speedArray;
+  int nspeeds;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;             // Signaled when jobs are queued or done, and on stop
+  int stop;
+  struct ncclTopoSearchJob* jobs;  // Job seq is in jobs[seq%nJobs]
+  int nJobs;
+  uint64_t headSeq;                // Next job to use, jobs up to nextSeq are queued
+  uint64_t nextSeq;
+  uint64_t gen;                    // Incremented when the best graph changes
+  struct ncclTopoGraph nextGraph;  // Configuration of the next job to queue
+  int nextSpeedIndex;
+  int nextDone;                    // Pass 1 is over after the last queued job
+  struct ncclTopoSearchThread* threads;
+  int nThreads;
+  int searches;                    // Stats
+  int used;
+  int usedAhead;
+};
+
+static void* ncclTopoSearchThreadMain(void* arg) {
+  struct ncclTopoSearchThread* thread = (struct ncclTopoSearchThread*)arg;
+  struct ncclTopoSearchPool* pool = thread->pool;
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->stop == 0) {
+    struct ncclTopoSearchJob* job = NULL;
+    for (int j=0; j<pool->nJobs; j++) {
+      struct ncclTopoSearchJob* pending = pool->jobs+j;
+      if (pending->state == ncclTopoSearchJobPending && (job == NULL || pending->seq < job->seq)) job = pending;
+    }
+    if (job == NULL) {
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+      continue;
+    }
+    job->state = ncclTopoSearchJobRunning;
+    pool->searches++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    ncclTopoSearchResetSystem(thread->system, pool->system);
+    thread->system->searchCancel = &job->cancel;
+    job->ret = ncclTopoSearchStart(thread->system, &job->tmpGraph, &job->saveGraph, &job->time);
+
+    pthread_mutex_lock(&pool->mutex);
+    job->state = job->cancel ? ncclTopoSearchJobFree : ncclTopoSearchJobDone;
+    pthread_cond_broadcast(&pool->cond);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+// Queues the next configurations, assuming searches will not find a better graph than graph.
+// Called with the pool mutex held.
+static void ncclTopoSearchQueue(struct ncclTopoSearchPool* pool, struct ncclTopoGraph* graph) {
+  while (pool->nextDone == 0 && pool->nextSeq-pool->headSeq < pool->nJobs) {
+    struct ncclTopoSearchJob* job = pool->jobs+pool->nextSeq%pool->nJobs;
+    if (job->state != ncclTopoSearchJobFree) break; // Cancelled search still running
+    memcpy(&job->tmpGraph, &pool->nextGraph, sizeof(struct ncclTopoGraph));
+    job->tmpGraph.nChannels = 0;
+    job->time = ncclTopoSearchTimeout(&job->tmpGraph);
+    memcpy(&job->saveGraph, graph, sizeof(struct ncclTopoGraph));
+    job->ret = ncclSuccess;
+    job->cancel = 0;
+    job->seq = pool->nextSeq++;
+    job->gen = pool->gen;
+    job->state = ncclTopoSearchJobPending;
+    // The global timeout only ends pass 1 early, which is checked when results are used
+    int64_t globalTimeout = NCCL_SEARCH_GLOBAL_TIMEOUT;
+    pool->nextDone = !ncclTopoSearchRelax(pool->system, &pool->nextGraph, graph, pool->crossNic, pool->speedArray, pool->nspeeds, &pool->nextSpeedIndex, 0, &globalTimeout);
+  }
+  pthread_cond_broadcast(&pool->cond);
+}
+
+// Cancels all queued jobs. Called with the pool mutex held.
+static void ncclTopoSearchCancel(struct ncclTopoSearchPool* pool) {
+  for (uint64_t seq=pool->headSeq; seq<pool->nextSeq; seq++) {
+    struct ncclTopoSearchJob* job = pool->jobs+seq%pool->nJobs;
+    __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+    if (job->state != ncclTopoSearchJobRunning) job->state = ncclTopoSearchJobFree;
+  }
+  pool->headSeq = pool->nextSeq;
+}
+
+// Same as ncclTopoSearchStart(system, tmpGraph, graph, time), speedIndex being that of tmpGraph
+static ncclResult_t ncclTopoSearchParallel(struct ncclTopoSearchPool* pool, struct ncclTopoGraph* tmpGraph, int speedIndex, struct ncclTopoGraph* graph, int* time) {
+  pthread_mutex_lock(&pool->mutex);
+  struct ncclTopoSearchJob* job;
+  int ahead = 1;
+  while (1) {
+    job = pool->jobs+pool->headSeq%pool->nJobs;
+    if (pool->headSeq < pool->nextSeq) {
+      if (job->gen == pool->gen && ncclTopoSearchSameConfig(&job->tmpGraph, tmpGraph)) break;
+      ncclTopoSearchCancel(pool);
+    }
+    // Mispredicted, or nothing queued yet : queue from this configuration
+    ahead = 0;
+    memcpy(&pool->nextGraph, tmpGraph, sizeof(struct ncclTopoGraph));
+    pool->nextSpeedIndex = speedIndex;
+    pool->nextDone = 0;
+    ncclTopoSearchQueue(pool, graph);
+    if (pool->headSeq == pool->nextSeq) pthread_cond_wait(&pool->cond, &pool->mutex);
+  }
+  while (job->state != ncclTopoSearchJobDone) pthread_cond_wait(&pool->cond, &pool->mutex);
+  pool->used++;
+  pool->usedAhead += ahead;
+  ncclResult_t ret = job->ret;
+  *time = job->time;
+  if (memcmp(&job->saveGraph, graph, sizeof(struct ncclTopoGraph)) != 0) {
+    memcpy(graph, &job->saveGraph, sizeof(struct ncclTopoGraph));
+    pool->gen++;
+  }
+  job->state = ncclTopoSearchJobFree;
+  pool->headSeq++;
+  // Keep searching ahead, unless the next searches will start from another graph
+  if (pool->gen != job->gen || *time == -1) ncclTopoSearchCancel(pool);
+  else ncclTopoSearchQueue(pool, graph);
+  pthread_mutex_unlock(&pool->mutex);
+  return ret;
+}
+
+static void ncclTopoSearchParallelDestroy(struct ncclTopoSearchPool* pool) {
+  pthread_mutex_lock(&pool->mutex);
+  ncclTopoSearchCancel(pool);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+  for (int t=0; t<pool->nThreads; t++) {
+    pthread_join(pool->threads[t].thread, NULL);
+    ncclTopoFree(pool->threads[t].system);
+  }
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->threads);
+  free(pool->jobs);
+  free(pool);
+}
+
+static ncclResult_t ncclTopoSearchParallelCreate(struct ncclTopoSystem* system, int crossNic, float* speedArray, int nspeeds, struct ncclTopoSearchPool** poolPtr) {
+  *poolPtr = NULL;
+  cpu_set_t affinity;
+  int nThreads = (int)rcclParamTopoSearchThreads();
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &affinity) == 0) nThreads = std::min(nThreads, CPU_COUNT(&affinity));
+  if (nThreads < 2) return ncclSuccess;
+
+  struct ncclTopoSearchPool* pool;
+  NCCLCHECK(ncclCalloc(&pool, 1));
+  pool->system = system;
+  pool->crossNic = crossNic;
+  pool->speedArray = speedArray;
+  pool->nspeeds = nspeeds;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->nJobs = nThreads*NCCL_TOPO_SEARCH_JOBS_PER_THREAD;
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECKGOTO(ncclCalloc(&pool->jobs, pool->nJobs), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&pool->threads, nThreads), ret, fail);
+  for (int t=0; t<nThreads; t++) {
+    struct ncclTopoSearchThread* thread = pool->threads+t;
+    thread->pool = pool;
+    NCCLCHECKGOTO(ncclTopoSearchCopySystem(system, &thread->system), ret, fail);
+    if (pthread_create(&thread->thread, NULL, ncclTopoSearchThreadMain, thread) != 0) {
+      WARN("Failed to create topology search thread : %s", strerror(errno));
+      ncclTopoFree(thread->system);
+      ret = ncclSystemError;
+      goto fail;
+    }
+    pool->nThreads++;
+  }
+  *poolPtr = pool;
+  return ncclSuccess;
+fail:
+  ncclTopoSearchParallelDestroy(pool);
+  return ret;
+}
+// [/RCCL]
+
 ncclResult_t ncclTopoCompute(ncclTopoSystem* system, struct ncclTopoGraph* graph) {
   int ngpus = system->nodes[GPU].count;
   int crossNic = (system->nodes[NET].count > 1) && graph->crossNic ? 1 : 0;
@@ -822,6 +1374,16 @@ ncclResult_t ncclTopoCompute(ncclTopoSystem* system, struct ncclTopoGraph* graph
     graph->maxChannels = 1;
   if (ngpus == 1) if (graph->pattern != NCCL_TOPO_PATTERN_RING) graph->pattern = NCCL_TOPO_PATTERN_TREE;
 
+  // [RCCL] Reuse the graph computed by a previous run on the same topology, see graph_cache.cc
+  uint64_t cacheKey;
+  NCCLCHECK(ncclTopoGraphCacheKey(system, graph, crossNic, &cacheKey));
+  if (cacheKey) {
+    int loaded;
+    NCCLCHECK(ncclTopoGraphCacheLoad(system, graph, cacheKey, &loaded));
+    if (loaded) return ncclSuccess;
+  }
+  // [/RCCL]
+
   // SPLIT_TREE works better on older archs.
   int ccMin;
   NCCLCHECK(ncclTopoGetCompCap(system, &ccMin, NULL));
@@ -845,13 +1407,30 @@ ncclResult_t ncclTopoCompute(ncclTopoSystem* system, struct ncclTopoGraph* graph
   tmpGraph.speedIntra = tmpGraph.speedInter = speedArray[speedIndex];
   int64_t globalTimeout = NCCL_SEARCH_GLOBAL_TIMEOUT;
 
+  struct ncclTopoSearchPool* pool = NULL; // [RCCL]
+  int poolTried = 0;
+
 search:
-  int time = tmpGraph.sameChannels ? NCCL_SEARCH_TIMEOUT_SAMECHANNELS :
-    tmpGraph.pattern == NCCL_TOPO_PATTERN_TREE ? NCCL_SEARCH_TIMEOUT_TREE : NCCL_SEARCH_TIMEOUT;
+  int time = ncclTopoSearchTimeout(&tmpGraph);
   tmpGraph.nChannels = 0;
   globalTimeout -= time;
 
-  NCCLCHECK(ncclTopoSearchRec(system, &tmpGraph, graph, &time));
+  // [RCCL] Once a search of pass 1 times out with the full budget, search the next ones ahead
+  // on helper threads
+  if (pool) {
+    ncclResult_t ret = ncclTopoSearchParallel(pool, &tmpGraph, speedIndex, graph, &time);
+    if (ret != ncclSuccess) {
+      ncclTopoSearchParallelDestroy(pool);
+      return ret;
+    }
+  } else {
+    NCCLCHECK(ncclTopoSearchStart(system, &tmpGraph, graph, &time));
+    if (pass == 1 && time == 0 && tmpGraph.sameChannels == 0 && poolTried == 0) {
+      poolTried = 1;
+      NCCLCHECK(ncclTopoSearchParallelCreate(system, crossNic, speedArray, nspeeds, &pool));
+    }
+  }
+  // [/RCCL]
 #if 0
   printf("Pattern %d, crossNic %d, Speed %g/%g, type %d/%d, channels %d-%d sameChannels %d -> nChannels %dx%g/%g %s\n", tmpGraph.pattern, tmpGraph.crossNic, tmpGraph.speedInter, tmpGraph.speedIntra, tmpGraph.typeInter, tmpGraph.typeIntra, tmpGraph.minChannels, tmpGraph.maxChannels, tmpGraph.sameChannels, graph->nChannels, graph->speedInter, graph->speedIntra, time == 0 ? "TIMEOUT" : time == -1 ? "PERFECT" : "");
   for (int c=0; c<graph->nChannels; c++) {
@@ -869,58 +1448,19 @@ search:
 
   if (pass == 1) {
     // First pass, we don't have a solution yet ; try other options
-
-    // Try having different channels
-    if (tmpGraph.sameChannels == 1) {
-      tmpGraph.sameChannels = 0;
-      goto search;
-    }
-    tmpGraph.sameChannels = 1;
-
-    if (time != -1) globalTimeout += time;
-    else globalTimeout = NCCL_SEARCH_GLOBAL_TIMEOUT;
-    if (globalTimeout < 0 && graph->nChannels) goto done;
-
-    int maxTypeIntra = system->nodes[NET].count > 0 ? tmpGraph.typeInter : PATH_SYS;
-    if (tmpGraph.typeIntra < maxTypeIntra && (graph->nChannels == 0 || tmpGraph.typeIntra < graph->typeIntra)) {
-      tmpGraph.typeIntra += 1;
-      goto search;
-    }
-    tmpGraph.typeIntra = ngpus == 1 ? PATH_LOC : PATH_NVL;
-    if (system->nodes[NET].count > 0 && tmpGraph.typeInter < PATH_SYS && (graph->nChannels == 0 || tmpGraph.typeInter < graph->typeInter || tmpGraph.typeInter < PATH_PXB)) {
-      tmpGraph.typeInter += 1;
-      goto search;
-    }
-    tmpGraph.typeInter = PATH_PIX;
-
-    // Try a simpler tree
-    if (tmpGraph.pattern == NCCL_TOPO_PATTERN_SPLIT_TREE) {
-      tmpGraph.pattern = NCCL_TOPO_PATTERN_TREE;
-      goto search;
-    }
-    tmpGraph.pattern = graph->pattern;
-
-    if (crossNic && tmpGraph.crossNic == 0) {
-      // Try again with crossNic if permitted
-      tmpGraph.crossNic = crossNic;
-      goto search;
-    }
-    tmpGraph.crossNic = 0;
-
-    // Decrease speed until we find a solution
-    if ((speedIndex < nspeeds-1) && (graph->nChannels == 0 || (speedArray[speedIndex+1]/graph->speedInter > .49))) {
-      tmpGraph.speedInter = tmpGraph.speedIntra = speedArray[++speedIndex];
-      goto search;
-    }
-    speedIndex = 0;
-    while (speedArray[speedIndex] > system->maxWidth && speedIndex < nspeeds-1) speedIndex++;
-    tmpGraph.speedIntra = tmpGraph.speedInter = speedArray[speedIndex];
-
+    if (ncclTopoSearchRelax(system, &tmpGraph, graph, crossNic, speedArray, nspeeds, &speedIndex, time, &globalTimeout)) goto search;
   }
 
 done:
   // We have a solution. Start from that solution and move to pass 2.
   if (pass == 1) {
+    // [RCCL]
+    if (pool) {
+      INFO(NCCL_GRAPH, "Search %d : %d searches on %d threads, %d used of which %d ahead of time", graph->id, pool->searches, pool->nThreads, pool->used, pool->usedAhead);
+      ncclTopoSearchParallelDestroy(pool);
+      pool = NULL;
+    }
+    // [/RCCL]
     time = -1;
     memcpy(&tmpGraph, graph, sizeof(tmpGraph));
     speedIndex = 0;
@@ -960,6 +1500,7 @@ done:
     graph->speedInter /= DIVUP(dupChannels, graph->nChannels);
     graph->nChannels = dupChannels;
   }
+  if (cacheKey) NCCLCHECK(ncclTopoGraphCacheStore(system, graph, cacheKey)); // [RCCL]
   return ncclSuccess;
 }
 
@@ -1056,7 +1597,7 @@ ncclResult_t ncclTopoGetLinkType(struct ncclTopoSystem* system, int cudaDev1, in
       struct ncclTopoNode *node = system->nodes[GPU].nodes+i;
       for (int k = 0; k<system->nodes[GPU].count; k++) {
         if (node->paths[GPU][k].count == 1) {
-          struct ncclTopoLink* link = node->paths[GPU][k].list[0];
+          struct ncclTopoLink* link = node->links+node->paths[GPU][k].link;
           struct ncclTopoNode* remNode = link->remNode;
           if (remNode->gpu.dev == cudaDev2) {
             *isXGMI = (link->type == LINK_NVL);
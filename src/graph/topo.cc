@@ -132,6 +132,39 @@ ncclResult_t ncclTopoCreateNode(struct ncclTopoSystem* system, struct ncclTopoNo
   return ncclSuccess;
 }
 
+// [RCCL] Removes the paths of node to the node being removed
+static void ncclTopoRemovePaths(struct ncclTopoSystem* system, struct ncclTopoNode* node, int type, int index) {
+  if (node->paths[type]) {
+    memmove(node->paths[type]+index, node->paths[type]+index+1, (system->nodes[type].count-index-1)*sizeof(struct ncclTopoLinkList));
+  }
+  if (type != CPU) return;
+  // Paths diverted through the removed CPU can not be updated
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    if (node->paths[t] == NULL) continue;
+    int count = system->nodes[t].count - (t == type ? 1 : 0);
+    for (int i=0; i<count; i++) {
+      struct ncclTopoLinkList* path = node->paths[t]+i;
+      if (path->cpu == index) system->pathsStale = 1;
+      else if (path->cpu > index) path->cpu--;
+    }
+  }
+}
+
+// [RCCL] Removes link from the first hops of the paths of node, once the paths to the node being
+// removed are gone. Paths going through the removed node can not be updated, they are marked stale.
+static void ncclTopoRemovePathsLink(struct ncclTopoSystem* system, struct ncclTopoNode* node, int type, int link) {
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    if (node->paths[t] == NULL) continue;
+    int count = system->nodes[t].count - (t == type ? 1 : 0);
+    for (int i=0; i<count; i++) {
+      struct ncclTopoLinkList* path = node->paths[t]+i;
+      if (path->count == 0) continue;
+      if (path->link == link) system->pathsStale = 1;
+      else if (path->link > link) path->link--;
+    }
+  }
+}
+
 ncclResult_t ncclTopoRemoveNode(struct ncclTopoSystem* system, int type, int index) {
   struct ncclTopoNode* delNode = system->nodes[type].nodes+index;
   for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
@@ -139,10 +172,12 @@ ncclResult_t ncclTopoRemoveNode(struct ncclTopoSystem* system, int type, int ind
     for (int n=0; n<system->nodes[t].count; n++) {
       struct ncclTopoNode* node = system->nodes[t].nodes+n;
       if (node == delNode) continue;
+      ncclTopoRemovePaths(system, node, type, index); // [RCCL]
       for (int l=0; l<node->nlinks; l++) {
         while (l<node->nlinks && node->links[l].remNode == delNode) {
           memmove(node->links+l, node->links+l+1, (node->nlinks-l-1)*sizeof(struct ncclTopoLink));
           node->nlinks--;
+          ncclTopoRemovePathsLink(system, node, type, l); // [RCCL]
         }
         if (l<node->nlinks && node->links[l].remNode->type == type && node->links[l].remNode >= delNode) {
           node->links[l].remNode--;
@@ -733,6 +768,7 @@ ncclResult_t ncclTopoGetSystem(struct ncclComm* comm, struct ncclTopoSystem** sy
   }
 
   NCCLCHECK(ncclTopoGetSystemFromXml(xml, system));
+  NCCLCHECK(ncclTopoHashXml(xml, &(*system)->xmlHash)); // [RCCL]
   free(xml);
   return ncclSuccess;
 }
@@ -836,6 +872,26 @@ ncclResult_t ncclTopoGetCpuAffinity(struct ncclTopoSystem* system, int rank, cpu
   return ncclSuccess;
 }
 
+// [RCCL] Affinity of the CPU closest to a NIC, empty if the NIC is unknown
+ncclResult_t ncclTopoGetNetCpuAffinity(struct ncclTopoSystem* system, int64_t netId, cpu_set_t* affinity) {
+  CPU_ZERO(affinity);
+  for (int n=0; n<system->nodes[NET].count; n++) {
+    struct ncclTopoNode* net = system->nodes[NET].nodes+n;
+    if (net->id != netId) continue;
+    int cpuIndex = -1, minHops = 0;
+    for (int c=0; c<system->nodes[CPU].count; c++) {
+      int nHops = net->paths[CPU][c].count;
+      if (cpuIndex == -1 || nHops < minHops) {
+        cpuIndex = c;
+        minHops = nHops;
+      }
+    }
+    if (cpuIndex != -1) memcpy(affinity, &system->nodes[CPU].nodes[cpuIndex].cpu.affinity, sizeof(cpu_set_t));
+  }
+  return ncclSuccess;
+}
+// [/RCCL]
+
 ncclResult_t ncclTopoGetNetCount(struct ncclTopoSystem* system, int* count) {
   *count = system->nodes[NET].count;
   return ncclSuccess;
@@ -68,8 +68,11 @@ struct ncclTopoLink {
 #define NCCL_TOPO_MAX_LINKS 32
 #define NCCL_TOPO_MAX_HOPS (NCCL_TOPO_MAX_NODES*NCCL_TOPO_NODE_TYPES)
 
+// [RCCL] Paths only store their first hop. The next hops are those of the path of the next node
+// to the same destination, see ncclTopoGetPathLinks.
 struct ncclTopoLinkList {
-  struct ncclTopoLink* list[NCCL_TOPO_MAX_HOPS];
+  int16_t link;   // Index of the first hop in the links of the source node
+  int16_t cpu;    // CPU the path is diverted through, -1 if none (see addCpuStep)
   int count;
   float width;
   int type;
@@ -137,6 +140,20 @@ struct ncclTopoSystem {
   int type;
   int nRanks;
   int netGdrLevel;
+  int* searchCancel; // [RCCL] Stops the search once set, see ncclTopoSearchParallel
+  uint64_t xmlHash;  // [RCCL] Of the trimmed topology, see graph_cache.cc
+  int pathsStale;    // [RCCL] Nodes were removed since paths were computed, see ncclTopoRemoveNode
+  // [RCCL] Search states already explored, see ncclTopoSearchKey
+  uint64_t* searchTable;
+  int searchPrune;     // Whether the current search still uses searchTable
+  int searchLookups;
+  int searchHits;
+  uint64_t searchId;
+  uint64_t searchHash; // Of the link and NIC widths consumed by the current search
+  // Hops of the paths between GPUs and NETs, which the search follows over and over, see ncclTopoSearchInit
+  int* searchHopsIndex;
+  struct ncclTopoLink** searchHops;
+  // [/RCCL]
 };
 
 ncclResult_t ncclTopoGetNode(struct ncclTopoSystem* system, struct ncclTopoNode** node, int type, uint64_t id);
@@ -152,6 +169,13 @@ ncclResult_t ncclTopoGetSystemFromXml(struct ncclXml* xml, struct ncclTopoSystem
 ncclResult_t ncclTopoGetGraphFromXml(struct ncclXmlNode *xmlGraphs, struct ncclTopoSystem* system, struct ncclTopoGraph* graph, int* nChannels);
 ncclResult_t ncclTopoGetXmlFromGraphs(int ngraphs, struct ncclTopoGraph** graphs, struct ncclTopoSystem* system, struct ncclXml *xml);
 
+// [RCCL] Graph cache, see RCCL_GRAPH_CACHE_DIR
+ncclResult_t ncclTopoHashXml(struct ncclXml* xml, uint64_t* hash);
+ncclResult_t ncclTopoGraphCacheKey(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, int crossNic, uint64_t* key);
+ncclResult_t ncclTopoGraphCacheLoad(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, uint64_t key, int* loaded);
+ncclResult_t ncclTopoGraphCacheStore(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, uint64_t key);
+// [/RCCL]
+
 ncclResult_t ncclTopoGetCompCap(struct ncclTopoSystem* system, int* ccMin, int* ccMax);
 
 static ncclResult_t ncclTopoIdToIndex(struct ncclTopoSystem* system, int type, int64_t id, int* index) {
@@ -176,6 +200,25 @@ static ncclResult_t ncclTopoRankToIndex(struct ncclTopoSystem* system, int rank,
   return ncclInternalError;
 }
 
+// [RCCL] Fills links with the hops of the path from node to the node type/index, returns the number of hops
+static int ncclTopoGetPathLinks(struct ncclTopoSystem* system, struct ncclTopoNode* node, int type, int index, struct ncclTopoLink** links) {
+  struct ncclTopoLinkList* path = node->paths[type]+index;
+  if (path->count == 0) return 0;
+  int count = 0;
+  if (path->cpu != -1) {
+    // Paths to CPUs and paths from CPUs are never diverted
+    count = ncclTopoGetPathLinks(system, node, CPU, path->cpu, links);
+    node = system->nodes[CPU].nodes+path->cpu;
+  }
+  struct ncclTopoNode* dest = system->nodes[type].nodes+index;
+  while (node != dest) {
+    struct ncclTopoLink* link = node->links+node->paths[type][index].link;
+    links[count++] = link;
+    node = link->remNode;
+  }
+  return count;
+}
+
 // Returns NVLink speed in GB/s
 static float ncclTopoNVLinkSpeed(int cudaCompCap) {
   return
@@ -423,12 +423,14 @@ group_cleanup:
         }
         /* Free all proxy ops in state->nextOps */
         struct ncclProxyState* state = &comm->proxyState;
-	pthread_mutex_lock(&state->poolMutex);
-	for (struct ncclProxyArgs *op = state->nextOps; op; op = op->next) {
-          op->next = state->pool;
-          state->pool = op;
+        struct ncclProxyArgs *next;
+        for (struct ncclProxyArgs *op = state->nextOps; op; op = next) {
+          next = op->next;
+          // [RCCL] Back to the pool of its size
+          struct ncclProxyArgs** pool = op->maxSubs == 1 ? &state->pool : &state->poolShared;
+          op->next = *pool;
+          *pool = op;
         }
-	pthread_mutex_unlock(&state->poolMutex);
         state->nextOps = NULL;
 
         ncclLaunchReset(comm);
@@ -61,8 +61,8 @@ struct ncclRecvMem {
     struct {
       uint64_t tail;
       char pad1[CACHE_LINE_SIZE-sizeof(uint64_t)];
-      int sizesFifo[NCCL_STEPS];
-      void* ptrsFifo[NCCL_STEPS];
+      int sizesFifo[NCCL_MAX_STEPS]; // [RCCL]
+      void* ptrsFifo[NCCL_MAX_STEPS]; // [RCCL]
     };
     char pad4[MEM_ALIGN];
   };
@@ -45,6 +45,8 @@ extern const char* ncclProtoStr[NCCL_NUM_PROTOCOLS];
 
 #define NCCL_MAX_OPS 2048
 #define NCCL_STEPS 8
+// [RCCL] Most steps of a connection with the SIMPLE protocol, see ncclConnInfo::simpleSteps
+#define NCCL_MAX_STEPS 16
 
 union ncclLLFifoLine {
   /* Flags have to be *after* data, because otherwise, an incomplete receive
@@ -124,6 +126,11 @@ struct ncclConnInfo {
   // descriptions in primitives.h.
   uint32_t* next_hdp_reg;  // Next GPU in ring (for p2p transport use only)
   uint32_t* curr_hdp_reg;  // Current GPU's HDP register
+
+  // [RCCL] Slots of the SIMPLE buffer, each of buffSizes[NCCL_PROTO_SIMPLE]/NCCL_STEPS bytes. A
+  // power of 2 from NCCL_STEPS to NCCL_MAX_STEPS, more than NCCL_STEPS only for network links
+  // with a large bandwidth-delay product.
+  int simpleSteps;
 };
 
 struct ncclConnector {
@@ -134,6 +141,7 @@ struct ncclConnector {
   void* transportResources;
   struct ncclConnInfo conn;
   struct ncclComm *comm;
+  int proxyShard; // [RCCL] Proxy thread progressing the connector, see RCCL_PROXY_NIC_THREADS
 };
 
 struct ncclRing {
@@ -40,6 +40,7 @@ ncclResult_t ncclTopoGetLinkType(struct ncclTopoSystem* system, int cudaDev1, in
 
 // Find CPU affinity
 ncclResult_t ncclTopoGetCpuAffinity(struct ncclTopoSystem* system, int rank, cpu_set_t* affinity);
+ncclResult_t ncclTopoGetNetCpuAffinity(struct ncclTopoSystem* system, int64_t netId, cpu_set_t* affinity); // [RCCL]
 
 #define NCCL_TOPO_CPU_ARCH_X86 1
 #define NCCL_TOPO_CPU_ARCH_POWER 2
@@ -90,6 +91,12 @@ ncclResult_t ncclTopoCompute(struct ncclTopoSystem* system, struct ncclTopoGraph
 ncclResult_t ncclTopoPrintGraph(struct ncclTopoSystem* system, struct ncclTopoGraph* graph);
 ncclResult_t ncclTopoDumpGraphs(struct ncclTopoSystem* system, int ngraphs, struct ncclTopoGraph** graphs);
 
+// [RCCL] Graphs computed by one rank for the ranks with the same fingerprint, see RCCL_GRAPH_SHARE
+ncclResult_t ncclTopoGraphsFingerprint(struct ncclTopoSystem* system, uint64_t* fingerprint);
+ncclResult_t ncclTopoSerializeGraphs(struct ncclTopoSystem* system, uint64_t fingerprint, int ngraphs, struct ncclTopoGraph** graphs, char** data, int* size);
+ncclResult_t ncclTopoDeserializeGraphs(struct ncclTopoSystem* system, uint64_t fingerprint, int ngraphs, struct ncclTopoGraph** graphs, char* data, int size, int* valid);
+// [/RCCL]
+
 struct ncclTopoRanks {
   int ringRecv[MAXCHANNELS];
   int ringSend[MAXCHANNELS];
@@ -79,6 +79,14 @@ typedef ncclNet_v4_t ncclNet_t;
 
 #define NCCL_PLUGIN_SYMBOL ncclNetPlugin_v4
 
+// [RCCL] Optional extension of ncclNet_v4_t, which plugins may export as NCCL_PLUGIN_TEST_MANY_SYMBOL.
+// Tests n requests at once, as test() would test each of them : done[i] is set, and sizes[i] if
+// sizes is not NULL. Completed requests are freed. Without it, test() is called on each request.
+typedef ncclResult_t (*ncclNetTestMany_t)(void** requests, int n, int* done, int* sizes);
+
+#define NCCL_PLUGIN_TEST_MANY_SYMBOL rcclNetPluginTestMany_v4
+// [/RCCL]
+
 typedef struct {
   // Name of the collective network (mainly for logs)
   const char* name;
@@ -27,6 +27,19 @@ static ncclResult_t ncclNetIsend(void* sendComm, void* data, int size, void* mha
 static ncclResult_t ncclNetIrecv(void* recvComm, void* data, int size, void* mhandle, void** request) { NCCLCHECK(ncclNet->irecv(recvComm, data, size, mhandle, request)); return ncclSuccess; }
 static ncclResult_t ncclNetIflush(void* recvComm, void* data, int size, void* mhandle, void** request) { NCCLCHECK(ncclNet->iflush(recvComm, data, size, mhandle, request)); return ncclSuccess; }
 static ncclResult_t ncclNetTest(void* request, int* done, int* size) { NCCLCHECK(ncclNet->test(request, done, size)); return ncclSuccess; }
+// [RCCL] Requests in flight per comm the network supports, NCCL_NET_MAX_REQUESTS for plugins
+extern int ncclNetMaxRequests;
+// NULL unless the network tests requests in batches natively
+extern ncclNetTestMany_t ncclNetTestManyFunc;
+static ncclResult_t ncclNetTestMany(void** requests, int n, int* done, int* sizes) {
+  if (ncclNetTestManyFunc) {
+    NCCLCHECK(ncclNetTestManyFunc(requests, n, done, sizes));
+    return ncclSuccess;
+  }
+  for (int i=0; i<n; i++) NCCLCHECK(ncclNet->test(requests[i], done+i, sizes ? sizes+i : NULL));
+  return ncclSuccess;
+}
+// [/RCCL]
 static ncclResult_t ncclNetCloseSend(void* sendComm) { NCCLCHECK(ncclNet->closeSend(sendComm)); return ncclSuccess; }
 static ncclResult_t ncclNetCloseRecv(void* recvComm) { NCCLCHECK(ncclNet->closeRecv(recvComm)); return ncclSuccess; }
 static ncclResult_t ncclNetCloseListen(void* listenComm) { NCCLCHECK(ncclNet->closeListen(listenComm)); return ncclSuccess; }
@@ -80,5 +93,38 @@ cleanup1:
 
 extern ncclNet_t ncclNetIb;
 extern ncclNet_t ncclNetSocket;
+extern ncclNet_t ncclNetSocketUring; // [RCCL] NET/Socket driven by io_uring
+// [RCCL] Native batched tests of the internal networks
+ncclResult_t ncclIbTestMany(void** requests, int n, int* done, int* sizes);
+ncclResult_t ncclSocketTestMany(void** requests, int n, int* done, int* sizes);
+ncclResult_t ncclSocketUringTestMany(void** requests, int n, int* done, int* sizes);
+// [/RCCL]
+
+// [RCCL] Syscall and copy counters of a NET/Socket send or recv comm
+struct ncclSocketStats {
+  uint64_t sendCalls;
+  uint64_t recvCalls;
+  uint64_t zcCalls;    // Sends issued with MSG_ZEROCOPY
+  uint64_t zcBytes;
+  uint64_t zcCopied;   // Zero-copy sends the kernel completed with a copy anyway
+  uint64_t errqueueCalls;
+  uint64_t enterCalls; // io_uring_enter, with RCCL_SOCKET_IO_URING
+};
+ncclResult_t ncclSocketGetStats(void* comm, struct ncclSocketStats* stats);
+
+// Striping of a NET/Socket send comm. With RCCL_SOCKET_ADAPTIVE, stripes and minChunkSize
+// are tuned from the throughput measured on the first large transfers.
+struct ncclSocketTuning {
+  int nSocks;
+  int nThreads;
+  int nRails;       // Interfaces the sockets are spread over, with RCCL_SOCKET_MULTIRAIL
+  int adaptive;
+  int calibrated;
+  int stripes;      // Sockets a large message is split across
+  int minChunkSize; // Smallest chunk sent on a socket
+  double socketBw;  // Measured bytes per second per socket
+};
+ncclResult_t ncclSocketGetTuning(void* comm, struct ncclSocketTuning* tuning);
+// [/RCCL]
 
 #endif
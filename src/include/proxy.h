@@ -13,21 +13,15 @@
 enum ncclProxyOpState { ncclProxyOpNone, ncclProxyOpReady, ncclProxyOpProgress };
 
 struct ncclProxyArgs;
+struct ncclProxySubProfile;
 typedef ncclResult_t (*proxyProgressFunc_t)(struct ncclProxyArgs*);
 
 #define NCCL_PROXY_MAX_SUBS MAXCHANNELS
 static_assert(NCCL_MAX_WORK_ELEMENTS <= MAXCHANNELS, "Not enough sub space for max work elements");
 
+// [RCCL] Fields are grouped so that the state updated at every step comes first, in the same
+// cache lines, ahead of the setup fields.
 struct ncclProxySubArgs {
-  struct ncclChannel* channel;
-  struct ncclConnector* connector;
-  int nsteps;
-  ssize_t sendbytes;
-  ssize_t recvbytes;
-  int sendChunkSize;
-  int recvChunkSize;
-  int delta;
-
   // Internal state
   uint64_t base;
   uint64_t posted;
@@ -36,39 +30,62 @@ struct ncclProxySubArgs {
   uint64_t transmitted;
   uint64_t done;
   uint64_t end;
-  void* requests[NCCL_STEPS];
+  struct ncclConnector* connector;
+  void* requests[NCCL_MAX_STEPS]; // [RCCL] Up to simpleSteps of the connection
+  int sizes[NCCL_MAX_STEPS];      // [RCCL] Of completed requests, see netTestRequests
+
+  struct ncclChannel* channel;
+  int nsteps;
+  ssize_t sendbytes;
+  ssize_t recvbytes;
+  int sendChunkSize;
+  int recvChunkSize;
+  int delta;
+
+  // [RCCL] Profiling, see proxy_profile.h
+  int peer;
+  int send;
+  uint64_t postTime;
+  struct ncclProxySubProfile* prof;
+  // [/RCCL]
 };
 
 struct ncclProxyArgs {
   proxyProgressFunc_t progress;
-  struct ncclProxySubArgs subs[NCCL_PROXY_MAX_SUBS];
+  int state;
+  int idle;
   int nsubs;
   int done;
   int sliceSteps;
   int chunkSteps;
   int chunkSize;
+  int protocol;
+  char* sharedBuff[NCCL_STEPS];
+  int sharedSize[NCCL_STEPS];
+  uint64_t hdp_flushed;
+
+  // Element linking
+  struct ncclProxyArgs* next;
+  struct ncclProxyArgs* nextPeer;
+  struct ncclProxyArgs** proxyAppendPtr;
+
   uint64_t opCount;
   uint64_t commOpCount;
-  int protocol;
   ncclDataType_t dtype;
   ncclRedOp_t redOp;
   ncclPattern_t pattern;
   int root;
-  int state;
-  char* sharedBuff[NCCL_STEPS];
-  int sharedSize[NCCL_STEPS];
-
-  int idle;
-  uint64_t hdp_flushed;
   uint8_t connIndex;
   uint8_t sendIdx;
   uint8_t recvIdx;
-
-  // Element linking
+  int priority;             // [RCCL] 1 for latency sensitive operations, progressed first
   pthread_mutex_t mutex;
-  struct ncclProxyArgs* next;
-  struct ncclProxyArgs* nextPeer;
-  struct ncclProxyArgs** proxyAppendPtr;
+
+  // [RCCL] Operations allocated by the proxy only have room for maxSubs subs, which are copied
+  // up to nsubs. Only those on shared connectors, which group subs, have NCCL_PROXY_MAX_SUBS.
+  int maxSubs;
+  struct ncclProxySubArgs subs[NCCL_PROXY_MAX_SUBS];
+  // [/RCCL]
 };
 
 struct ncclProxySharedBuffers {
@@ -79,27 +96,70 @@ struct ncclProxySharedBuffers {
   // Collnet sharing is technically per device, but for now MAXDEVICES == MAXCHANNELS.
   struct ncclProxyArgs* proxyAppendCollNet[2*MAXCHANNELS];
   void* collNetResources;
+  int proxyAppendShard[2*MAXCHANNELS];             // [RCCL] Proxy thread of the shared connectors, 0 if unset
+};
+
+// [RCCL] How the proxy thread spends its time, see RCCL_PROXY_SPIN_US and tools/proxy-bench
+struct ncclProxyIdleStats {
+  uint64_t busyNs;       // Progressing operations
+  uint64_t spinNs;       // Polling operations which made no progress
+  uint64_t sleepNs;      // Sleeping, with or without operations to progress
+  uint64_t sleeps;
+  uint64_t wakeups;      // Sleeps ended by another thread, the others timed out
+  uint64_t wakeupNs;     // Total and maximum time from a wakeup signal to the proxy thread running
+  uint64_t maxWakeupNs;
+  uint64_t passes;       // Over the running operations
 };
+// [/RCCL]
 
 struct ncclProxyPool;
+struct ncclProxyEngine;
+struct ncclProxyShard;
 struct ncclProxyState {
-  pthread_cond_t cond;
-  pthread_mutex_t opsMutex;
-  pthread_mutex_t poolMutex;
   bool stop;
   struct ncclProxySharedBuffers sharedBuffs;
   struct ncclProxyArgs* ops;           // Running operations, used by proxy thread
-  struct ncclProxyArgs* postedOps;     // Posted operations, shared between proxy and main thread, locked with opsMutex
+  // [RCCL] Lock-free handoffs between the main and the proxy threads. Posted operations are
+  // pushed on a stack in reverse order by any thread, and taken all at once by the proxy thread.
+  struct ncclProxyArgs* postedStack;   // Shared between proxy and main threads
+  struct ncclProxyWakeup wakeup;       // Signaled when operations are posted, or by network plugins
+  struct ncclProxyIdleStats stats;
+  struct ncclProxyEngine* engine;      // Shared thread progressing this communicator, if any
+  struct ncclComm* engineNext;         // Next communicator of that thread
+  int engineDone;                      // Set by that thread once it no longer progresses this communicator
+  struct ncclProxyProfile* profile;    // NULL unless profiling
+  int64_t priorityBytes;               // Operations up to that size are high priority
+  int priorityRatio;                   // Passes per pass progressing normal priority operations
+  int highPriority;                    // High priority operations were in progress after the last pass
+  int numaNode;                        // Of the memory of operations, -1 if unknown
+  size_t poolSize;                     // Bytes allocated for operations
+  struct ncclProxyShard* shards;       // Threads progressing the connectors of NICs, see RCCL_PROXY_NIC_THREADS
+  int nShards;
+  // [/RCCL]
+  struct ncclProxyArgs* postedOps;     // Posted operations in order, used by proxy thread
   struct ncclProxyArgs* postedOpsEnd;
   struct ncclProxyArgs* nextOps;       // Pending operations, used by main thread (could still be cancelled)
   struct ncclProxyArgs* nextOpsEnd;
   struct ncclProxyArgs* pool;          // Free operations for main thread
+  struct ncclProxyArgs* poolShared;    // [RCCL] Same, with room for NCCL_PROXY_MAX_SUBS subs
   struct ncclProxyArgs* poolFreed;     // Freed operations by the progress thread
-  struct ncclProxyArgs* poolReturned;  // Shared between main and progress thread, lock with poolMutex
+  struct ncclProxyArgs* poolReturned;  // Pushed by the progress thread, taken all at once by the main thread
 
   struct ncclProxyPool* pools;
 };
 
+// [RCCL] Proxy thread of a communicator progressing the connectors of one or more NICs, on
+// the CPUs closest to the first one. Operations are allocated by the main thread of the
+// communicator, and handed over to the shard of their connector.
+struct ncclProxyShard {
+  struct ncclProxyState state;         // Only the fields needed to progress operations are set
+  struct ncclComm* comm;
+  int netDev;
+  pthread_t thread;
+  cpu_set_t affinity;
+};
+// [/RCCL]
+
 typedef ncclResult_t (*threadFunc_t)(struct ncclProxyArgs*);
 
 enum proxyMode {
@@ -110,10 +170,13 @@ enum proxyMode {
 
 ncclResult_t ncclProxySaveColl(struct ncclProxyArgs* args, int nranks);
 ncclResult_t ncclProxyComputeP2p(struct ncclInfo* info, struct ncclProxyArgs* args);
+int ncclProxyPriority(struct ncclInfo* info); // [RCCL]
 ncclResult_t ncclProxySaveP2p(struct ncclComm* comm, struct ncclProxyArgs* args);
 ncclResult_t ncclProxyStart(struct ncclComm* comm);
 ncclResult_t ncclProxyCreate(struct ncclComm* comm);
 ncclResult_t ncclProxyDestroy(struct ncclComm* comm);
+ncclResult_t ncclProxyFree(struct ncclComm* comm); // [RCCL] After the transports are freed
+ncclResult_t ncclProxyNetShard(struct ncclComm* comm, int netDev, const cpu_set_t* netAffinity, struct ncclConnector* connector); // [RCCL]
 
 ncclResult_t ncclProxySharedBuffersInit(struct ncclComm* comm, int cuda, int* size, char** ptr);
 ncclResult_t ncclProxySharedBuffersGetP2p(struct ncclComm* comm, int cuda, int type, int channel, int slot, int index, char** ptr);
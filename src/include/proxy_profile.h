@@ -0,0 +1,50 @@
+/*
+Copyright (c) 2021 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef NCCL_PROXY_PROFILE_H_
+#define NCCL_PROXY_PROFILE_H_
+
+#include "nccl.h"
+
+// Proxy operation profiling, enabled with RCCL_PROXY_PROFILE=1 or RCCL_PROXY_TRACE_FILE.
+// The proxy thread timestamps each step of each operation, and aggregates the durations into
+// histograms per channel, peer and direction, printed when the communicator is destroyed.
+// With RCCL_PROXY_TRACE_FILE, the last RCCL_PROXY_TRACE_EVENTS events are also written as a
+// Chrome trace (chrome://tracing, Perfetto).
+
+struct ncclComm;
+struct ncclProxyArgs;
+struct ncclProxyProfile;
+
+ncclResult_t ncclProxyProfileInit(struct ncclComm* comm, struct ncclProxyProfile** profile);
+// Main thread, when the operations are posted to the proxy thread
+void ncclProxyProfilePost(struct ncclProxyArgs* ops);
+// Proxy thread, after each progress call and when the operation is removed
+ncclResult_t ncclProxyProfileProgress(struct ncclProxyProfile* profile, struct ncclProxyArgs* op);
+void ncclProxyProfileRemove(struct ncclProxyProfile* profile, struct ncclProxyArgs* op);
+// Moves what other recorded into profile, then frees other. Each proxy thread records in a
+// profile of its own, see proxyShardStart.
+ncclResult_t ncclProxyProfileMerge(struct ncclProxyProfile* profile, struct ncclProxyProfile* other);
+// Prints the histograms, writes the trace, and frees the profile
+ncclResult_t ncclProxyProfileDestroy(struct ncclProxyProfile* profile);
+
+#endif
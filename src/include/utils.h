@@ -9,6 +9,7 @@
 
 #include "nccl.h"
 #include <stdint.h>
+#include <sched.h>
 
 int ncclCudaCompCap();
 
@@ -37,6 +38,25 @@ static long log2i(long n) {
  return l;
 }
 
+// [RCCL] Lets other threads wake up a proxy thread sleeping while it has nothing to progress
+struct ncclProxyWakeup {
+  int sleeping;      // Futex, set while the proxy thread sleeps
+  uint64_t wakeNs;   // When another thread last woke it up
+};
+// Wakeup of the proxy thread, set on that thread only. Network plugins called from the
+// proxy thread keep it, so that their helper threads can signal request completions.
+extern thread_local struct ncclProxyWakeup* ncclProxyCurrentWakeup;
+void ncclProxyWakeupSignal(struct ncclProxyWakeup* wakeup);
+uint64_t ncclTimeNs();
+
+// NUMA node of the first CPU of a set, -1 if unknown
+int ncclCpusetNumaNode(const cpu_set_t* cpuset);
+// Zeroed, page aligned memory preferably placed on a NUMA node (any node if -1), whichever
+// thread touches it first
+ncclResult_t ncclNumaAlloc(void** ptr, size_t size, int node);
+void ncclNumaFree(void* ptr, size_t size);
+// [/RCCL]
+
 // Recyclable list that avoids frequent malloc/free
 template<typename T>
 struct ncclListElem {
@@ -59,6 +59,8 @@ NCCL_PARAM(CheckPointers, "CHECK_POINTERS", 0);
 
 ncclNet_t* ncclNet = NULL;
 ncclCollNet_t* ncclCollNet = NULL;
+ncclNetTestMany_t ncclNetTestManyFunc = NULL; // [RCCL]
+int ncclNetMaxRequests = NCCL_NET_MAX_REQUESTS; // [RCCL]
 
 struct allocationTracker allocTracker[MAX_ALLOC_TRACK_NGPU] = {};
 
@@ -79,7 +81,7 @@ ncclResult_t initCollNet(ncclCollNet_t* collnet) {
   return ncclSuccess;
 }
 
-ncclResult_t initNetPlugin(ncclNet_t** net, ncclCollNet_t** collnet) {
+ncclResult_t initNetPlugin(ncclNet_t** net, ncclCollNet_t** collnet, ncclNetTestMany_t* testMany) {
   char ncclNetPluginName[128];
   const char* envPluginName = getenv("NCCL_NET_PLUGIN");
   if (envPluginName && strlen(envPluginName)) {
@@ -106,6 +108,12 @@ ncclResult_t initNetPlugin(ncclNet_t** net, ncclCollNet_t** collnet) {
     if (netPluginLib != NULL) dlclose(netPluginLib);
     return ncclSuccess;
   }
+  // [RCCL] Check for batched tests
+  *testMany = (ncclNetTestMany_t) dlsym(netPluginLib, STR(NCCL_PLUGIN_TEST_MANY_SYMBOL));
+  if (*testMany == NULL) {
+    INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Failed to find " STR(NCCL_PLUGIN_TEST_MANY_SYMBOL) " symbol, requests are tested one by one.");
+  }
+  // [/RCCL]
   // Check for CollNet
   *collnet = (ncclCollNet_t*) dlsym(netPluginLib, STR(NCCL_COLLNET_PLUGIN_SYMBOL));
   if (*collnet == NULL) {
@@ -114,22 +122,30 @@ ncclResult_t initNetPlugin(ncclNet_t** net, ncclCollNet_t** collnet) {
   return ncclSuccess;
 }
 
+// [RCCL] Drive NET/Socket with io_uring instead of helper threads. Falls back to the
+// helper threads when the kernel does not support it.
+RCCL_PARAM(SocketIoUring, "SOCKET_IO_URING", 0);
+// [/RCCL]
+
 ncclResult_t initNet() {
   // Always initialize bootstrap network
   NCCLCHECK(bootstrapNetInit());
 
   // Initialize main communication network
-  ncclNet_t* nets[3] = { NULL, &ncclNetIb, &ncclNetSocket };
-  ncclCollNet_t* collNets[3] = { NULL, NULL, NULL };
-  NCCLCHECK(initNetPlugin(nets+0, collNets+0));
+  ncclNet_t* nets[4] = { NULL, &ncclNetIb, rcclParamSocketIoUring() ? &ncclNetSocketUring : NULL, &ncclNetSocket }; // [RCCL]
+  ncclCollNet_t* collNets[4] = { NULL, NULL, NULL, NULL };
+  ncclNetTestMany_t testManys[4] = { NULL, ncclIbTestMany, ncclSocketUringTestMany, ncclSocketTestMany }; // [RCCL]
+  NCCLCHECK(initNetPlugin(nets+0, collNets+0, testManys+0));
   char* netName = getenv("NCCL_NET");
 
-  for (int i=0; i<3; i++) {
+  for (int i=0; i<4; i++) {
     if (nets[i] == NULL) continue;
     if (netName && strcmp(netName, nets[i]->name) != 0) continue;
     // net plugin is already initialized
     if (initNet(nets[i]) != ncclSuccess) continue;
     ncclNet = nets[i];
+    ncclNetTestManyFunc = testManys[i]; // [RCCL]
+    ncclNetMaxRequests = i == 0 ? NCCL_NET_MAX_REQUESTS : NCCL_MAX_STEPS; // [RCCL] Internal networks go deeper
     if (collNets[i] && initCollNet(collNets[i]) == ncclSuccess) {
       ncclCollNet = collNets[i];
     }
@@ -445,6 +461,7 @@ static ncclResult_t commFree(ncclComm_t comm) {
 
   for (int channel=0; channel<MAXCHANNELS; channel++)
     NCCLCHECK(freeChannel(comm->channels+channel, comm->nRanks));
+  NCCLCHECK(ncclProxyFree(comm)); // [RCCL]
 
   if (comm->doneEvent != NULL)
     CUDACHECK(hipEventDestroy(comm->doneEvent));
@@ -771,6 +788,8 @@ static ncclResult_t computeBuffSizes(struct ncclComm* comm) {
 
   if (cpuArch == NCCL_TOPO_CPU_ARCH_ARM) defaults[NCCL_PROTO_SIMPLE] = DEFAULT_BUFFSIZE_ARM;
 
+  // [RCCL] Buffers of NCCL_STEPS steps, which fixes the step size. Network connections with a large
+  // bandwidth-delay product get more steps of that size, see ncclConnInfo::simpleSteps.
   for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
     comm->buffSizes[p] = comm->hostDevComm.buffSizes[p] = envs[p] != -2 ? envs[p] : defaults[p];
   }
@@ -782,6 +801,95 @@ NCCL_PARAM(GraphDumpFileRank, "GRAPH_DUMP_FILE_RANK", 0);
 NCCL_PARAM(CollNetNodeThreshold, "COLLNET_NODE_THRESHOLD", 2);
 NCCL_PARAM(NvbPreconnect, "NVB_PRECONNECT", 1);
 
+static ncclResult_t computeGraphs(struct ncclComm* comm, struct ncclTopoGraph* ringGraph, struct ncclTopoGraph* treeGraph, struct ncclTopoGraph* collNetGraph) {
+  ringGraph->id = 0;
+  ringGraph->pattern = NCCL_TOPO_PATTERN_RING;
+  ringGraph->crossNic = ncclParamCrossNic();
+  ringGraph->collNet = 0;
+  ringGraph->minChannels = 1;
+  ringGraph->maxChannels = MAXCHANNELS/2;
+  NCCLCHECK(ncclTopoCompute(comm->topo, ringGraph));
+
+  treeGraph->id = 1;
+  treeGraph->pattern = NCCL_TOPO_PATTERN_BALANCED_TREE;
+  treeGraph->crossNic = ncclParamCrossNic();
+  treeGraph->collNet = 0;
+  treeGraph->minChannels = comm->topo->nodes[NET].count != 0 ? 1 : ringGraph->nChannels;
+  treeGraph->maxChannels = ringGraph->nChannels;
+  NCCLCHECK(ncclTopoCompute(comm->topo, treeGraph));
+
+  collNetGraph->id = 2;
+  collNetGraph->pattern = NCCL_TOPO_PATTERN_TREE;
+  collNetGraph->collNet = 1;
+  collNetGraph->crossNic = ncclParamCrossNic();
+  collNetGraph->minChannels = 1;
+  collNetGraph->maxChannels = ringGraph->nChannels;
+  NCCLCHECK(ncclTopoCompute(comm->topo, collNetGraph));
+  return ncclSuccess;
+}
+
+// [RCCL] With RCCL_GRAPH_SHARE=1, the first rank of each node computes the graphs for the other
+// ranks of the node, and with RCCL_GRAPH_SHARE=2 rank 0 computes them for all ranks. Ranks whose
+// system does not have the same fingerprint compute their own.
+RCCL_PARAM(GraphShare, "GRAPH_SHARE", 0);
+#define GRAPH_SHARE_SIZE_TAG (-1)
+#define GRAPH_SHARE_DATA_TAG (-2)
+
+static ncclResult_t getGraphs(struct ncclComm* comm, int intraNodeRanks, struct ncclTopoGraph* ringGraph, struct ncclTopoGraph* treeGraph, struct ncclTopoGraph* collNetGraph) {
+  int mode = rcclParamGraphShare();
+  int* ranks = comm->intraNodeGlobalRanks;
+  int rank = comm->intraNodeRank;
+  int nranks = intraNodeRanks;
+  if (mode == 2) {
+    rank = comm->rank;
+    nranks = comm->nRanks;
+  }
+  if ((mode != 1 && mode != 2) || nranks == 1) return computeGraphs(comm, ringGraph, treeGraph, collNetGraph);
+
+  struct ncclTopoGraph* graphs[3] = { ringGraph, treeGraph, collNetGraph };
+  uint64_t fingerprint;
+  NCCLCHECK(ncclTopoGraphsFingerprint(comm->topo, &fingerprint));
+  ncclResult_t ret = ncclSuccess;
+  char* data = NULL;
+  int size = 0;
+  int valid = 0;
+  if (mode == 2) {
+    NCCLCHECK(ncclCalloc(&ranks, nranks));
+    for (int r=0; r<nranks; r++) ranks[r] = r;
+  }
+
+  if (rank == 0) {
+    ncclResult_t res = computeGraphs(comm, ringGraph, treeGraph, collNetGraph);
+    if (res == ncclSuccess) res = ncclTopoSerializeGraphs(comm->topo, fingerprint, 3, graphs, &data, &size);
+    // No graphs tells the other ranks to compute their own
+    if (res != ncclSuccess) size = 0;
+    NCCLCHECKGOTO(bootstrapBroadcast(comm->bootstrap, ranks, rank, nranks, 0, GRAPH_SHARE_SIZE_TAG, &size, sizeof(int)), ret, end);
+    if (size) NCCLCHECKGOTO(bootstrapBroadcast(comm->bootstrap, ranks, rank, nranks, 0, GRAPH_SHARE_DATA_TAG, data, size), ret, end);
+    INFO(NCCL_INIT|NCCL_GRAPH, "Graphs computed for %d ranks, %d bytes", nranks, size);
+    ret = res;
+    goto end;
+  }
+
+  NCCLCHECKGOTO(bootstrapBroadcast(comm->bootstrap, ranks, rank, nranks, 0, GRAPH_SHARE_SIZE_TAG, &size, sizeof(int)), ret, end);
+  if (size) {
+    NCCLCHECKGOTO(ncclCalloc(&data, size), ret, end);
+    NCCLCHECKGOTO(bootstrapBroadcast(comm->bootstrap, ranks, rank, nranks, 0, GRAPH_SHARE_DATA_TAG, data, size), ret, end);
+    NCCLCHECKGOTO(ncclTopoDeserializeGraphs(comm->topo, fingerprint, 3, graphs, data, size, &valid), ret, end);
+  }
+  if (valid) {
+    INFO(NCCL_INIT|NCCL_GRAPH, "Using graphs computed by rank %d", ranks[0]);
+  } else {
+    INFO(NCCL_INIT|NCCL_GRAPH, "Graphs of rank %d do not match the local topology, computing them", ranks[0]);
+    NCCLCHECKGOTO(computeGraphs(comm, ringGraph, treeGraph, collNetGraph), ret, end);
+  }
+
+end:
+  free(data);
+  if (mode == 2) free(ranks);
+  return ret;
+}
+// [/RCCL]
+
 static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* commId) {
   // We use 2 AllGathers
   // 1. { peerInfo, comm, compCap}
@@ -874,42 +982,18 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   NCCLCHECK(ncclTopoComputePaths(comm->topo, comm->peerInfo));
   // Remove inaccessible GPUs and unused NICs
   NCCLCHECK(ncclTopoTrimSystem(comm->topo, comm));
-  // Recompute paths after trimming
-  NCCLCHECK(ncclTopoComputePaths(comm->topo, comm->peerInfo));
+  // Recompute paths after trimming, if removing nodes could not update them (see ncclTopoRemoveNode)
+  if (comm->topo->pathsStale) NCCLCHECK(ncclTopoComputePaths(comm->topo, comm->peerInfo)); // [RCCL]
   // Init search
   NCCLCHECK(ncclTopoSearchInit(comm->topo));
   // Print final topology
   NCCLCHECK(ncclTopoPrint(comm->topo));
 
   // Get rings and trees
-  struct ncclTopoGraph ringGraph;
-  ringGraph.id = 0;
-  ringGraph.pattern = NCCL_TOPO_PATTERN_RING;
-  ringGraph.crossNic = ncclParamCrossNic();
-  ringGraph.collNet = 0;
-  ringGraph.minChannels = 1;
-  ringGraph.maxChannels = MAXCHANNELS/2;
-  NCCLCHECK(ncclTopoCompute(comm->topo, &ringGraph));
+  struct ncclTopoGraph ringGraph, treeGraph, collNetGraph;
+  NCCLCHECK(getGraphs(comm, intraNodeRanks, &ringGraph, &treeGraph, &collNetGraph)); // [RCCL]
   NCCLCHECK(ncclTopoPrintGraph(comm->topo, &ringGraph));
-
-  struct ncclTopoGraph treeGraph;
-  treeGraph.id = 1;
-  treeGraph.pattern = NCCL_TOPO_PATTERN_BALANCED_TREE;
-  treeGraph.crossNic = ncclParamCrossNic();
-  treeGraph.collNet = 0;
-  treeGraph.minChannels = comm->topo->nodes[NET].count != 0 ? 1 : ringGraph.nChannels;
-  treeGraph.maxChannels = ringGraph.nChannels;
-  NCCLCHECK(ncclTopoCompute(comm->topo, &treeGraph));
   NCCLCHECK(ncclTopoPrintGraph(comm->topo, &treeGraph));
-
-  struct ncclTopoGraph collNetGraph;
-  collNetGraph.id = 2;
-  collNetGraph.pattern = NCCL_TOPO_PATTERN_TREE;
-  collNetGraph.collNet = 1;
-  collNetGraph.crossNic = ncclParamCrossNic();
-  collNetGraph.minChannels = 1;
-  collNetGraph.maxChannels = ringGraph.nChannels;
-  NCCLCHECK(ncclTopoCompute(comm->topo, &collNetGraph));
   NCCLCHECK(ncclTopoPrintGraph(comm->topo, &collNetGraph));
 
   bool allXgmi = true;
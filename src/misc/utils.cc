@@ -10,6 +10,11 @@
 
 #include "nvmlwrap.h"
 #include <hip/hip_runtime.h>
+#include <dirent.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 // Get current Compute Capability
 int ncclCudaCompCap() {
@@ -192,3 +197,62 @@ bool matchIfList(const char* string, int port, struct netIf* ifList, int listSiz
   }
   return false;
 }
+
+// [RCCL]
+thread_local struct ncclProxyWakeup* ncclProxyCurrentWakeup = NULL;
+
+uint64_t ncclTimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// Costs a load unless the proxy thread is sleeping
+void ncclProxyWakeupSignal(struct ncclProxyWakeup* wakeup) {
+  if (wakeup == NULL || __atomic_load_n(&wakeup->sleeping, __ATOMIC_SEQ_CST) == 0) return;
+  __atomic_store_n(&wakeup->wakeNs, ncclTimeNs(), __ATOMIC_RELAXED);
+  if (__atomic_exchange_n(&wakeup->sleeping, 0, __ATOMIC_SEQ_CST)) {
+    syscall(SYS_futex, &wakeup->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+int ncclCpusetNumaNode(const cpu_set_t* cpuset) {
+  int cpu = 0;
+  while (cpu < CPU_SETSIZE && !CPU_ISSET(cpu, cpuset)) cpu++;
+  if (cpu == CPU_SETSIZE) return -1;
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* dir = opendir(path);
+  if (dir == NULL) return -1;
+  int node = -1;
+  struct dirent* entry;
+  while (node == -1 && (entry = readdir(dir)) != NULL) {
+    if (sscanf(entry->d_name, "node%d", &node) != 1) node = -1;
+  }
+  closedir(dir);
+  return node;
+}
+
+// Sets the memory policy of the mapping rather than the affinity of the calling thread, so that
+// the pages land on the node even when another thread touches them first.
+#define RCCL_MPOL_PREFERRED 1
+ncclResult_t ncclNumaAlloc(void** ptr, size_t size, int node) {
+  void* mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    WARN("Failed to map %ld bytes : %s", size, strerror(errno));
+    return ncclSystemError;
+  }
+  if (node >= 0 && node < 64) {
+    unsigned long nodemask = 1UL << node;
+    if (syscall(SYS_mbind, mem, size, RCCL_MPOL_PREFERRED, &nodemask, 8*sizeof(nodemask), 0) != 0) {
+      INFO(NCCL_INIT, "Could not place memory on NUMA node %d : %s", node, strerror(errno));
+    }
+  }
+  *ptr = mem;
+  return ncclSuccess;
+}
+
+void ncclNumaFree(void* ptr, size_t size) {
+  munmap(ptr, size);
+}
+// [/RCCL]
@@ -8,6 +8,9 @@
 #include "comm.h"
 #include "info.h"
 #include "collectives.h"
+#include "proxy_profile.h"
+#include "cpuset.h"
+#include <linux/futex.h>
 
 enum { proxyRecv=0, proxySend=1 };
 
@@ -26,49 +29,144 @@ static bool NeedProxy(int type, int pattern, int root, struct ncclRing* ring, in
 }
 
 #define PROXYARGS_ALLOCATE_SIZE 128
+// [RCCL] Slab of PROXYARGS_ALLOCATE_SIZE operations, each with room for the same number of
+// subs and starting on a cache line, on the NUMA node of the communicator
 struct ncclProxyPool {
   struct ncclProxyPool *next;
-  struct ncclProxyArgs elems[PROXYARGS_ALLOCATE_SIZE];
+  char* elems;
+  size_t elemSize;
+  size_t size;
 };
+// [/RCCL]
 
-static ncclResult_t allocateArgs(struct ncclComm* comm, struct ncclProxyArgs** argsptr) {
-  struct ncclProxyState* state = &comm->proxyState;
-  struct ncclProxyArgs* elem;
-  if (state->pool == NULL) {
-    // Check whether there are freed elements
-    if (state->poolReturned) {
-      pthread_mutex_lock(&state->poolMutex);
-      state->pool = state->poolReturned;
-      state->poolReturned = NULL;
-      pthread_mutex_unlock(&state->poolMutex);
-    } else {
-      // Allocate a new pool of elements. Make sure we allocate the memory close
-      // to the network thread
-      struct ncclProxyPool* newPool;
-      cpu_set_t affinitySave;
-      if (CPU_COUNT(&comm->cpuAffinity)) {
-        sched_getaffinity(0, sizeof(cpu_set_t), &affinitySave);
-        sched_setaffinity(0, sizeof(cpu_set_t), &comm->cpuAffinity);
-      }
-      NCCLCHECK(ncclCalloc(&newPool, 1));
-      if (CPU_COUNT(&comm->cpuAffinity)) {
-        sched_setaffinity(0, sizeof(cpu_set_t), &affinitySave);
-      }
+// [RCCL] Lock-free handoffs between the main and the proxy threads
+static struct ncclProxyArgs* reverseOps(struct ncclProxyArgs* op) {
+  struct ncclProxyArgs* reversed = NULL;
+  while (op) {
+    struct ncclProxyArgs* next = op->next;
+    op->next = reversed;
+    reversed = op;
+    op = next;
+  }
+  return reversed;
+}
 
-      struct ncclProxyArgs* newElems = newPool->elems;
-      // Chain newly allocated elements
-      for (int i=0; i<PROXYARGS_ALLOCATE_SIZE; i++) {
-        if (i+1 < PROXYARGS_ALLOCATE_SIZE) newElems[i].next = newElems+i+1;
+// Pushes the list first -> ... -> last on top of the stack *top
+static void pushOps(struct ncclProxyArgs** top, struct ncclProxyArgs* first, struct ncclProxyArgs* last) {
+  struct ncclProxyArgs* old = __atomic_load_n(top, __ATOMIC_RELAXED);
+  do {
+    last->next = old;
+  } while (!__atomic_compare_exchange_n(top, &old, first, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+// Sleeps until another thread signals the proxy thread, or for at most timeoutNs (0 : no timeout).
+// Returns whether it was signaled. Without timeout, also returns right away if pending() finds
+// operations posted or stop requested in the meantime.
+template<typename FUNC>
+static bool proxySleep(struct ncclProxyWakeup* wakeup, uint64_t timeoutNs, struct ncclProxyIdleStats* stats, const FUNC& pending) {
+  bool woken = true;
+  __atomic_store_n(&wakeup->sleeping, 1, __ATOMIC_SEQ_CST);
+  if (timeoutNs || !pending()) {
+    struct timespec ts = { (time_t)(timeoutNs/1000000000ULL), (long)(timeoutNs%1000000000ULL) };
+    uint64_t start = ncclTimeNs();
+    syscall(SYS_futex, &wakeup->sleeping, FUTEX_WAIT_PRIVATE, 1, timeoutNs ? &ts : NULL, NULL, 0);
+    uint64_t end = ncclTimeNs();
+    stats->sleeps++;
+    stats->sleepNs += end-start;
+    // Whoever woke us up cleared the flag
+    woken = __atomic_exchange_n(&wakeup->sleeping, 0, __ATOMIC_SEQ_CST) == 0;
+    uint64_t wakeNs = __atomic_load_n(&wakeup->wakeNs, __ATOMIC_RELAXED);
+    if (woken) {
+      stats->wakeups++;
+      if (wakeNs > start && wakeNs < end) {
+        stats->wakeupNs += end-wakeNs;
+        stats->maxWakeupNs = std::max(stats->maxWakeupNs, end-wakeNs);
       }
-      // Add them all to the pool list
-      state->pool = newElems;
-      // Save the pool memory block for later resource release
-      newPool->next = state->pools;
-      state->pools = newPool;
     }
   }
-  elem = state->pool;
-  state->pool = state->pool->next;
+  __atomic_store_n(&wakeup->sleeping, 0, __ATOMIC_SEQ_CST);
+  return woken;
+}
+
+// Whether the proxy thread has posted operations to take, or should stop
+static bool proxyPending(struct ncclProxyState* state) {
+  return __atomic_load_n(&state->postedStack, __ATOMIC_SEQ_CST) != NULL || __atomic_load_n(&state->stop, __ATOMIC_SEQ_CST);
+}
+
+// Hands the operations freed by the proxy thread back to the main thread
+static void returnFreedOps(struct ncclProxyState* state) {
+  if (state->poolFreed == NULL) return;
+  struct ncclProxyArgs* end = state->poolFreed;
+  while (end->next) end = end->next;
+  pushOps(&state->poolReturned, state->poolFreed, end);
+  state->poolFreed = NULL;
+}
+// [/RCCL]
+
+// [RCCL]
+static size_t proxyArgsSize(int maxSubs) {
+  size_t size = offsetof(struct ncclProxyArgs, subs) + maxSubs*sizeof(struct ncclProxySubArgs);
+  return DIVUP(size, CACHE_LINE_SIZE)*CACHE_LINE_SIZE;
+}
+
+// Allocate a new pool of elements. Make sure we allocate the memory close to the network thread,
+// through the memory policy rather than by changing the affinity of the calling thread.
+static ncclResult_t allocatePool(struct ncclComm* comm, int maxSubs, struct ncclProxyArgs** elems) {
+  struct ncclProxyState* state = &comm->proxyState;
+  if (state->pools == NULL) state->numaNode = ncclCpusetNumaNode(&comm->cpuAffinity);
+  struct ncclProxyPool* newPool;
+  NCCLCHECK(ncclCalloc(&newPool, 1));
+  newPool->elemSize = proxyArgsSize(maxSubs);
+  newPool->size = PROXYARGS_ALLOCATE_SIZE*newPool->elemSize;
+  ncclResult_t ret = ncclNumaAlloc((void**)&newPool->elems, newPool->size, state->numaNode);
+  if (ret != ncclSuccess) {
+    free(newPool);
+    return ret;
+  }
+  // Chain newly allocated elements
+  for (int i=0; i<PROXYARGS_ALLOCATE_SIZE; i++) {
+    struct ncclProxyArgs* elem = (struct ncclProxyArgs*)(newPool->elems+i*newPool->elemSize);
+    elem->maxSubs = maxSubs;
+    if (i+1 < PROXYARGS_ALLOCATE_SIZE) elem->next = (struct ncclProxyArgs*)(newPool->elems+(i+1)*newPool->elemSize);
+  }
+  *elems = (struct ncclProxyArgs*)newPool->elems;
+  // Save the pool memory block for later resource release
+  newPool->next = state->pools;
+  state->pools = newPool;
+  state->poolSize += newPool->size;
+  return ncclSuccess;
+}
+
+static struct ncclProxyArgs** proxyPoolOf(struct ncclProxyState* state, struct ncclProxyArgs* elem) {
+  return elem->maxSubs == 1 ? &state->pool : &state->poolShared;
+}
+
+// Puts the operations returned by a proxy thread back in the pool of their size
+static void takeReturnedOps(struct ncclProxyState* state, struct ncclProxyState* from) {
+  if (__atomic_load_n(&from->poolReturned, __ATOMIC_RELAXED) == NULL) return;
+  struct ncclProxyArgs* returned = __atomic_exchange_n(&from->poolReturned, NULL, __ATOMIC_ACQUIRE);
+  while (returned) {
+    struct ncclProxyArgs* next = returned->next;
+    struct ncclProxyArgs** returnedPool = proxyPoolOf(state, returned);
+    returned->next = *returnedPool;
+    *returnedPool = returned;
+    returned = next;
+  }
+}
+// [/RCCL]
+
+static ncclResult_t allocateArgs(struct ncclComm* comm, int maxSubs, struct ncclProxyArgs** argsptr) {
+  struct ncclProxyState* state = &comm->proxyState;
+  struct ncclProxyArgs** pool = maxSubs == 1 ? &state->pool : &state->poolShared;
+  struct ncclProxyArgs* elem;
+  if (*pool == NULL) {
+    // Check whether there are freed elements
+    takeReturnedOps(state, state); // [RCCL]
+    for (int s=0; s<state->nShards; s++) takeReturnedOps(state, &state->shards[s].state); // [RCCL]
+    if (*pool == NULL) NCCLCHECK(allocatePool(comm, maxSubs, pool));
+  }
+  elem = *pool;
+  *pool = elem->next;
   elem->next = elem->nextPeer = NULL;
   *argsptr = elem;
   return ncclSuccess;
@@ -81,7 +179,7 @@ static ncclResult_t allocateArgs(struct ncclComm* comm, struct ncclProxyArgs** a
 #define DEBUG_PROXY_PRINT(...)
 #endif
 
-#define OP_INDEX(op) ((op) ? (op)-state->pools->elems : -1)
+#define OP_INDEX(op) ((op) ? ((char*)(op)-state->pools->elems)/(long)state->pools->elemSize : -1)
 #define OP_SEEN 0x100000
 ncclResult_t dumpProxyState(struct ncclProxyState* state) {
 #ifdef DEBUG_PROXY
@@ -106,20 +204,22 @@ ncclResult_t dumpProxyState(struct ncclProxyState* state) {
   }
   printf("[X]\n");
 
-  struct ncclProxyArgs* free = state->pool;
-  while (free) {
-    if (free->idle & OP_SEEN) {
-      WARN("Free list loop at element %ld", OP_INDEX(free));
+  for (struct ncclProxyArgs* free : { state->pool, state->poolShared }) {
+    while (free) {
+      if (free->idle & OP_SEEN) {
+        WARN("Free list loop at element %ld", OP_INDEX(free));
+      }
+      free->idle |= OP_SEEN;
+      free = free->next;
     }
-    free->idle |= OP_SEEN;
-    free = free->next;
   }
 
   struct ncclProxyPool* p = state->pools;
   int i = 0;
   while (p) {
     for (int e=0; e<PROXYARGS_ALLOCATE_SIZE; e++) {
-      if ((p->elems[e].idle & OP_SEEN) == 0) {
+      struct ncclProxyArgs* elem = (struct ncclProxyArgs*)(p->elems+e*p->elemSize);
+      if ((elem->idle & OP_SEEN) == 0) {
         WARN("Element %d of pool %d has been lost", e, i);
         struct ncclProxyArgs* free = state->pool;
         printf("Free list ");
@@ -130,7 +230,7 @@ ncclResult_t dumpProxyState(struct ncclProxyState* state) {
         printf("\n");
         return ncclInternalError;
       }
-      p->elems[e].idle -= OP_SEEN;
+      elem->idle -= OP_SEEN;
     }
     p = p->next;
     i++;
@@ -139,6 +239,24 @@ ncclResult_t dumpProxyState(struct ncclProxyState* state) {
   return ncclSuccess;
 }
 
+// [RCCL] Priority classes. Operations of collectives and point-to-point transfers up to
+// RCCL_PROXY_PRIORITY_BYTES (0 to disable), or on streams with a higher than default priority,
+// are high priority : they go first in the list of operations, and while some are in progress
+// the other operations are only progressed every RCCL_PROXY_PRIORITY_RATIO passes (1 to disable).
+// Operations on the same connector still progress in order.
+RCCL_PARAM(ProxyPriorityBytes, "PROXY_PRIORITY_BYTES", 65536);
+RCCL_PARAM(ProxyPriorityRatio, "PROXY_PRIORITY_RATIO", 4);
+
+int ncclProxyPriority(struct ncclInfo* info) {
+  struct ncclProxyState* state = &info->comm->proxyState;
+  if (state->priorityRatio <= 1) return 0;
+  if ((int64_t)info->nBytes <= state->priorityBytes) return 1;
+  int priority;
+  // Lower values are higher priorities, the default being 0
+  return hipStreamGetPriority(info->stream, &priority) == hipSuccess && priority < 0 ? 1 : 0;
+}
+// [/RCCL]
+
 static ncclResult_t ProxyAppend(struct ncclProxyState* state, struct ncclProxyArgs* args) {
   struct ncclProxyArgs* proxyAppend = *args->proxyAppendPtr;
   int shared = args->subs[0].connector->conn.shared;
@@ -152,7 +270,7 @@ static ncclResult_t ProxyAppend(struct ncclProxyState* state, struct ncclProxyAr
         WARN("Proxy append mismatch");
         return ncclInternalError;
       }
-      if (proxyAppend->nsubs >= NCCL_PROXY_MAX_SUBS) {
+      if (proxyAppend->nsubs >= proxyAppend->maxSubs) {
         WARN("Proxy append out of bound");
         return ncclInternalError;
       }
@@ -174,6 +292,11 @@ static ncclResult_t ProxyAppend(struct ncclProxyState* state, struct ncclProxyAr
       // Create the list
       DEBUG_PROXY_PRINT("Insert  %5ld (%d/%5ld) as first element\n", OP_INDEX(args), shared, args->opCount);
       state->ops = args;
+    } else if (args->priority) {
+      // [RCCL] High priority elements go first
+      args->next = state->ops;
+      state->ops = args;
+      DEBUG_PROXY_PRINT("Insert  %5ld (%d/%5ld) as first element\n", OP_INDEX(args), shared, args->opCount);
     } else {
       // Append element at the end of the list
       struct ncclProxyArgs* last = state->ops;
@@ -201,12 +324,20 @@ static ncclResult_t SaveProxy(int type, int peer, struct ncclProxyArgs* args, in
 
   struct ncclProxyState* state = &connector->comm->proxyState;
   struct ncclProxyArgs* op;
-  NCCLCHECK(allocateArgs(connector->comm, &op));
-  memcpy(op, args, sizeof(struct ncclProxyArgs));
+  // [RCCL] Only operations on shared connectors get more subs, see ProxyAppend
+  NCCLCHECK(allocateArgs(connector->comm, connector->conn.shared ? NCCL_PROXY_MAX_SUBS : 1, &op));
+  memcpy(op, args, offsetof(struct ncclProxyArgs, maxSubs));
+  memcpy(op->subs, args->subs, args->nsubs*sizeof(struct ncclProxySubArgs));
+  // [/RCCL]
   op->subs[0].connector = connector;
   op->progress = connector->transportComm->proxy;
   op->state = ncclProxyOpReady;
   op->proxyAppendPtr = connector->proxyAppendPtr;
+  // [RCCL]
+  op->subs[0].peer = peer;
+  op->subs[0].send = type == proxySend;
+  op->subs[0].prof = NULL;
+  // [/RCCL]
 
   if (state->nextOps == NULL) state->nextOps = op;
   else state->nextOpsEnd->next = op;
@@ -258,6 +389,7 @@ ncclResult_t ncclProxyComputeP2p(struct ncclInfo* info, struct ncclProxyArgs* ar
   sub->delta = info->delta;
   sub->recvbytes = info->recvbytes;
   sub->sendbytes = info->sendbytes;
+  args->priority = ncclProxyPriority(info); // [RCCL]
 
   int stepSize = info->comm->buffSizes[NCCL_PROTO_SIMPLE]/NCCL_STEPS/SENDRECV_SLICEFACTOR;
   info->recvChunkSize = stepSize;
@@ -344,16 +476,25 @@ static ncclResult_t removeOp(struct ncclProxyState* state, struct ncclProxyArgs*
   return ncclSuccess;
 }
 
-static ncclResult_t progressOps(struct ncclProxyState* state, struct ncclProxyArgs** opsPtr, int* idle, struct ncclComm* comm) {
+// [RCCL] Progresses the operations of the given priority, or all of them when priority is -1
+static ncclResult_t progressPriorityOps(struct ncclProxyState* state, struct ncclProxyArgs** opsPtr, int* idle, int priority, int* highPriority) {
   struct ncclProxyArgs* prevOp = NULL;
   struct ncclProxyArgs* op = *opsPtr;
   while (op) {
     if (op->state == ncclProxyOpNone) return ncclInternalError;
+    if (priority != -1 && op->priority != priority) {
+      prevOp = op;
+      op = op->next;
+      continue;
+    }
     NCCLCHECK(op->progress(op));
     *idle &= op->idle;
+    if (state->profile) NCCLCHECK(ncclProxyProfileProgress(state->profile, op));
     if (op->state == ncclProxyOpNone) {
+      if (state->profile) ncclProxyProfileRemove(state->profile, op);
       NCCLCHECK(removeOp(state, &op, &prevOp));
     } else {
+      *highPriority |= op->priority;
       prevOp = op;
       op = op->next;
     }
@@ -361,23 +502,41 @@ static ncclResult_t progressOps(struct ncclProxyState* state, struct ncclProxyAr
   return ncclSuccess;
 }
 
+static ncclResult_t progressOps(struct ncclProxyState* state, struct ncclProxyArgs** opsPtr, int* idle, struct ncclComm* comm) {
+  int highPriority = 0;
+  uint64_t pass = ++state->stats.passes;
+  if (state->highPriority && state->priorityRatio > 1 && pass % state->priorityRatio) {
+    // Only progress the other operations when the high priority ones have nothing to do
+    int highIdle = 1;
+    NCCLCHECK(progressPriorityOps(state, opsPtr, &highIdle, 1, &highPriority));
+    *idle &= highIdle;
+    if (highIdle) NCCLCHECK(progressPriorityOps(state, opsPtr, idle, 0, &highPriority));
+  } else {
+    NCCLCHECK(progressPriorityOps(state, opsPtr, idle, -1, &highPriority));
+  }
+  state->highPriority = highPriority;
+  return ncclSuccess;
+}
+// [/RCCL]
+
 ncclResult_t ncclProxyAppendPosted(struct ncclProxyState* state) {
   // Return any freed element first
-  if (state->poolFreed) {
-    struct ncclProxyArgs* end = state->poolFreed;
-    while (end->next) end = end->next;
-    pthread_mutex_lock(&state->poolMutex);
-    end->next = state->poolReturned;
-    state->poolReturned = state->poolFreed;
-    pthread_mutex_unlock(&state->poolMutex);
-    state->poolFreed = NULL;
-  }
+  returnFreedOps(state);
 
   // Then wait until we have new work to do
-  pthread_mutex_lock(&state->opsMutex);
   while (state->postedOps == NULL) {
-    if (state->stop) return ncclSuccess;
-    pthread_cond_wait(&state->cond, &state->opsMutex);
+    // [RCCL] Take everything posted so far, back in order
+    struct ncclProxyArgs* posted = reverseOps(__atomic_exchange_n(&state->postedStack, NULL, __ATOMIC_ACQUIRE));
+    if (posted) {
+      state->postedOps = posted;
+      struct ncclProxyArgs* end = posted;
+      while (end->next) end = end->next;
+      state->postedOpsEnd = end;
+      break;
+    }
+    if (__atomic_load_n(&state->stop, __ATOMIC_SEQ_CST)) return ncclSuccess;
+    proxySleep(&state->wakeup, 0, &state->stats, [=]() { return proxyPending(state); });
+    // [/RCCL]
   }
 
   // Sort operations as we append them : collectives and
@@ -405,28 +564,58 @@ ncclResult_t ncclProxyAppendPosted(struct ncclProxyState* state) {
   state->postedOps = op;
   if (op == NULL) state->postedOpsEnd = NULL;
   NCCLCHECK(dumpProxyState(state));
-  pthread_mutex_unlock(&state->opsMutex);
-
-  if (state->poolFreed) {
-    struct ncclProxyArgs* end = state->poolFreed;
-    while (end->next) end = end->next;
-    pthread_mutex_lock(&state->poolMutex);
-    end->next = state->poolReturned;
-    state->poolReturned = state->poolFreed;
-    pthread_mutex_unlock(&state->poolMutex);
-    state->poolFreed = NULL;
-  }
 
+  returnFreedOps(state);
   return ncclSuccess;
 }
 
 
-void* persistentThread(void *comm_) {
-  struct ncclComm* comm = (struct ncclComm*)comm_;
-  struct ncclProxyState* state = &comm->proxyState;
-  char threadName[16];
-  sprintf(threadName, "NCCLproxy %5d", comm->rank);
-  nvtxNameOsThreadA(syscall(SYS_gettid), threadName);
+// [RCCL] Idle policy of the proxy thread, while it has operations none of which progresses.
+// It yields for RCCL_PROXY_SPIN_US, then sleeps 1us, 2us, 4us ... up to RCCL_PROXY_SLEEP_US, until
+// operations get posted or a network plugin signals a completion. Nothing signals progress of
+// the GPU, hence the bounded sleeps. RCCL_PROXY_SLEEP_US=0 yields forever.
+RCCL_PARAM(ProxySpinUs, "PROXY_SPIN_US", 50);
+RCCL_PARAM(ProxySleepUs, "PROXY_SLEEP_US", 0);
+
+struct ncclProxyIdle {
+  uint64_t spinNs;
+  uint64_t maxSleepNs;
+  uint64_t idleStart;
+  uint64_t sleepNs;
+};
+
+static void proxyIdleInit(struct ncclProxyIdle* idle) {
+  idle->spinNs = std::max(rcclParamProxySpinUs(), 0L)*1000;
+  idle->maxSleepNs = std::max(rcclParamProxySleepUs(), 0L)*1000;
+  idle->idleStart = idle->sleepNs = 0;
+}
+
+// Called after each pass over the operations, yields or sleeps when none progressed
+static void proxyIdleWait(struct ncclProxyIdle* idle, int progressed, uint64_t now, struct ncclProxyWakeup* wakeup, struct ncclProxyIdleStats* stats) {
+  if (progressed) {
+    idle->idleStart = idle->sleepNs = 0;
+    return;
+  }
+  if (idle->idleStart == 0) idle->idleStart = now;
+  if (idle->maxSleepNs == 0 || now-idle->idleStart < idle->spinNs) {
+    sched_yield(); // No request progressed. Let others run.
+  } else {
+    idle->sleepNs = std::min(idle->sleepNs ? 2*idle->sleepNs : 1000, idle->maxSleepNs);
+    // Spin again after being signaled, something is likely to progress
+    if (proxySleep(wakeup, idle->sleepNs, stats, []() { return false; })) idle->idleStart = idle->sleepNs = 0;
+  }
+}
+// [/RCCL]
+
+// [RCCL] Progresses the operations of the communicator, or of one of its shards
+static void* proxyProgressThread(struct ncclComm* comm, struct ncclProxyState* state) {
+  // [RCCL]
+  ncclProxyCurrentWakeup = &state->wakeup;
+  struct ncclProxyIdleStats* stats = &state->stats;
+  struct ncclProxyIdle policy;
+  proxyIdleInit(&policy);
+  uint64_t last = ncclTimeNs();
+  // [/RCCL]
 
   struct ncclProxyArgs** opsPtr = &state->ops;
   while (1) {
@@ -434,11 +623,27 @@ void* persistentThread(void *comm_) {
       return NULL;
     }
 
-    while (*opsPtr == NULL) {
-      if (state->stop) {
-        // No more commands to process and proxy has been requested to stop
-        return NULL;
+    if (*opsPtr == NULL) {
+      uint64_t slept = stats->sleepNs;
+      while (*opsPtr == NULL) {
+        if (__atomic_load_n(&state->stop, __ATOMIC_SEQ_CST) && state->postedOps == NULL &&
+            __atomic_load_n(&state->postedStack, __ATOMIC_SEQ_CST) == NULL) {
+          // No more commands to process and proxy has been requested to stop
+          return NULL;
+        }
+        ncclResult_t ret = ncclProxyAppendPosted(state);
+        if (ret != ncclSuccess) {
+          comm->fatalError = ret;
+          INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
+          return NULL;
+        }
       }
+      uint64_t now = ncclTimeNs();
+      stats->busyNs += now-last-(stats->sleepNs-slept);
+      last = now;
+      policy.idleStart = policy.sleepNs = 0;
+    } else if (state->postedOps || __atomic_load_n(&state->postedStack, __ATOMIC_RELAXED)) {
+      // [RCCL] Append operations posted meanwhile, high priority ones would wait for the others otherwise
       ncclResult_t ret = ncclProxyAppendPosted(state);
       if (ret != ncclSuccess) {
         comm->fatalError = ret;
@@ -453,22 +658,320 @@ void* persistentThread(void *comm_) {
       INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
       return NULL;
     }
-    if (idle) {
-      sched_yield(); // No request progressed. Let others run.
+    // [RCCL]
+    uint64_t now = ncclTimeNs();
+    if (idle) stats->spinNs += now-last;
+    else stats->busyNs += now-last;
+    uint64_t slept = stats->sleeps;
+    proxyIdleWait(&policy, !idle, now, &state->wakeup, stats);
+    last = stats->sleeps == slept ? now : ncclTimeNs(); // Sleeping time is accounted apart
+    // [/RCCL]
+  }
+}
+
+void* persistentThread(void *comm_) {
+  struct ncclComm* comm = (struct ncclComm*)comm_;
+  char threadName[16];
+  sprintf(threadName, "NCCLproxy %5d", comm->rank);
+  nvtxNameOsThreadA(syscall(SYS_gettid), threadName);
+  return proxyProgressThread(comm, &comm->proxyState); // [RCCL]
+}
+
+// [RCCL] Shared proxy threads. With RCCL_PROXY_SHARED=n, communicators on the same device share
+// up to n proxy threads, pinned to the CPUs close to the device, instead of having one each.
+// A communicator is progressed by a single thread, the one with the fewest communicators when
+// it was created. Each thread progresses its communicators in turn.
+RCCL_PARAM(ProxyShared, "PROXY_SHARED", 0);
+
+struct ncclProxyEngine {
+  int cudaDev;
+  pthread_t thread;
+  pthread_mutex_t mutex;        // Protects the list of communicators
+  pthread_cond_t cond;          // Signaled when a communicator leaves
+  struct ncclComm* comms;       // Linked through proxyState.engineNext
+  int nComms;
+  int refs;                     // Communicators which may still signal wakeup, see ncclProxyFree
+  int id;
+  bool stop;
+  struct ncclProxyWakeup wakeup;
+  struct ncclProxyEngine* next;
+};
+
+static pthread_mutex_t proxyEnginesLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ncclProxyEngine* proxyEngines = NULL;
+
+// One pass of a shared thread over the operations of a communicator. Returns false when the
+// communicator should leave the thread : stop requested and nothing left to do, abort, or error.
+static bool sharedProgressComm(struct ncclComm* comm, int* idle) {
+  struct ncclProxyState* state = &comm->proxyState;
+  if (*comm->abortFlag) return false;
+  bool posted = state->postedOps || __atomic_load_n(&state->postedStack, __ATOMIC_SEQ_CST);
+  if (state->ops == NULL && !posted) {
+    returnFreedOps(state);
+    return !__atomic_load_n(&state->stop, __ATOMIC_SEQ_CST);
+  }
+  if (posted) {
+    ncclResult_t ret = ncclProxyAppendPosted(state);
+    if (ret != ncclSuccess) {
+      comm->fatalError = ret;
+      INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
+      return false;
+    }
+    *idle = 0;
+  }
+  ncclResult_t ret = progressOps(state, &state->ops, idle, comm);
+  if (ret != ncclSuccess) {
+    comm->fatalError = ret;
+    INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
+    return false;
+  }
+  return true;
+}
+
+// Whether any communicator of the engine has posted operations or should stop. Communicators
+// are only removed by the engine thread, and added at the head of the list.
+static bool sharedPending(struct ncclProxyEngine* engine) {
+  if (__atomic_load_n(&engine->stop, __ATOMIC_SEQ_CST)) return true;
+  for (struct ncclComm* comm = __atomic_load_n(&engine->comms, __ATOMIC_ACQUIRE); comm; comm = comm->proxyState.engineNext) {
+    if (proxyPending(&comm->proxyState)) return true;
+  }
+  return false;
+}
+
+static void* sharedProxyThread(void* engine_) {
+  struct ncclProxyEngine* engine = (struct ncclProxyEngine*)engine_;
+  char threadName[16];
+  snprintf(threadName, sizeof(threadName), "NCCLproxy d%d.%d", engine->cudaDev, engine->id);
+  nvtxNameOsThreadA(syscall(SYS_gettid), threadName);
+  ncclProxyCurrentWakeup = &engine->wakeup;
+  struct ncclProxyIdle policy;
+  proxyIdleInit(&policy);
+  uint64_t last = ncclTimeNs();
+
+  while (1) {
+    int progressed = 0, busy = 0;
+    pthread_mutex_lock(&engine->mutex);
+    if (engine->stop) {
+      pthread_mutex_unlock(&engine->mutex);
+      return NULL;
+    }
+    struct ncclComm** commPtr = &engine->comms;
+    while (*commPtr) {
+      struct ncclComm* comm = *commPtr;
+      struct ncclProxyState* state = &comm->proxyState;
+      int idle = 1;
+      bool keep = sharedProgressComm(comm, &idle);
+      uint64_t now = ncclTimeNs();
+      if (idle) state->stats.spinNs += now-last;
+      else state->stats.busyNs += now-last;
+      last = now;
+      if (state->ops) busy = 1;
+      progressed |= !idle;
+      if (keep) {
+        commPtr = &state->engineNext;
+      } else {
+        *commPtr = state->engineNext;
+        engine->nComms--;
+        state->engineDone = 1;
+        pthread_cond_broadcast(&engine->cond);
+      }
+    }
+    pthread_mutex_unlock(&engine->mutex);
+
+    struct ncclProxyIdleStats sleepStats;
+    memset(&sleepStats, 0, sizeof(sleepStats));
+    if (busy) {
+      proxyIdleWait(&policy, progressed, last, &engine->wakeup, &sleepStats);
+    } else if (!progressed) {
+      // No operation left in any communicator, wait for some to be posted
+      proxySleep(&engine->wakeup, 0, &sleepStats, [=]() { return sharedPending(engine); });
+      policy.idleStart = policy.sleepNs = 0;
+    }
+    if (sleepStats.sleeps) {
+      // Every communicator of the thread was waiting
+      pthread_mutex_lock(&engine->mutex);
+      for (struct ncclComm* comm = engine->comms; comm; comm = comm->proxyState.engineNext) {
+        struct ncclProxyIdleStats* stats = &comm->proxyState.stats;
+        stats->sleepNs += sleepStats.sleepNs;
+        stats->sleeps += sleepStats.sleeps;
+        stats->wakeups += sleepStats.wakeups;
+        stats->wakeupNs += sleepStats.wakeupNs;
+        stats->maxWakeupNs = std::max(stats->maxWakeupNs, sleepStats.maxWakeupNs);
+      }
+      pthread_mutex_unlock(&engine->mutex);
+      last = ncclTimeNs();
+    }
+  }
+}
+
+static ncclResult_t sharedProxyAdd(struct ncclComm* comm) {
+  struct ncclProxyEngine* engine = NULL;
+  int nEngines = 0;
+  pthread_mutex_lock(&proxyEnginesLock);
+  for (struct ncclProxyEngine* e = proxyEngines; e; e = e->next) {
+    if (e->cudaDev != comm->cudaDev) continue;
+    nEngines++;
+    if (engine == NULL || e->nComms < engine->nComms) engine = e;
+  }
+  if (engine == NULL || (engine->nComms > 0 && nEngines < rcclParamProxyShared())) {
+    ncclResult_t ret = ncclCalloc(&engine, 1);
+    if (ret != ncclSuccess) {
+      pthread_mutex_unlock(&proxyEnginesLock);
+      return ret;
+    }
+    engine->cudaDev = comm->cudaDev;
+    engine->id = nEngines;
+    engine->mutex = PTHREAD_MUTEX_INITIALIZER;
+    engine->cond = PTHREAD_COND_INITIALIZER;
+    engine->nComms = 1;
+    engine->refs = 1;
+    engine->comms = comm;
+    comm->proxyState.engine = engine;
+    pthread_create(&engine->thread, NULL, sharedProxyThread, engine);
+    if (CPU_COUNT(&comm->cpuAffinity)) pthread_setaffinity_np(engine->thread, sizeof(cpu_set_t), &comm->cpuAffinity);
+    engine->next = proxyEngines;
+    proxyEngines = engine;
+    INFO(NCCL_INIT, "Proxy : created shared thread %d for device %d", engine->id, engine->cudaDev);
+  } else {
+    pthread_mutex_lock(&engine->mutex);
+    comm->proxyState.engine = engine;
+    comm->proxyState.engineNext = engine->comms;
+    __atomic_store_n(&engine->comms, comm, __ATOMIC_RELEASE);
+    engine->nComms++;
+    engine->refs++;
+    pthread_mutex_unlock(&engine->mutex);
+  }
+  pthread_mutex_unlock(&proxyEnginesLock);
+  return ncclSuccess;
+}
+
+// Waits until the shared thread is done with the communicator, then stops the thread if it
+// has no communicator left. The engine is freed by ncclProxyFree, once no network comm of its
+// communicators can signal its wakeup anymore.
+static ncclResult_t sharedProxyRemove(struct ncclComm* comm) {
+  struct ncclProxyEngine* engine = comm->proxyState.engine;
+  pthread_mutex_lock(&proxyEnginesLock);
+  pthread_mutex_lock(&engine->mutex);
+  while (comm->proxyState.engineDone == 0) pthread_cond_wait(&engine->cond, &engine->mutex);
+  if (engine->nComms == 0) __atomic_store_n(&engine->stop, true, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&engine->mutex);
+  if (engine->stop) {
+    ncclProxyWakeupSignal(&engine->wakeup);
+    pthread_join(engine->thread, NULL);
+    struct ncclProxyEngine** e = &proxyEngines;
+    while (*e != engine) e = &(*e)->next;
+    *e = engine->next;
+  }
+  pthread_mutex_unlock(&proxyEnginesLock);
+  return ncclSuccess;
+}
+
+// Wakeup of the thread progressing the communicator
+static struct ncclProxyWakeup* proxyWakeup(struct ncclProxyState* state) {
+  return state->engine ? &state->engine->wakeup : &state->wakeup;
+}
+
+// Proxy threads per NIC. With RCCL_PROXY_NIC_THREADS=n, the connectors of the network transport
+// are progressed by up to n threads per communicator, one per NIC, each pinned to the CPUs closest
+// to its NIC, instead of the proxy thread of the communicator. NICs beyond n share the threads.
+// Shared connectors of a channel use the same thread, the one of the first NIC they connect to.
+// Other transports, and shared proxy threads (RCCL_PROXY_SHARED), are not affected.
+RCCL_PARAM(ProxyNicThreads, "PROXY_NIC_THREADS", 0);
+
+static void* proxyShardThread(void* shard_) {
+  struct ncclProxyShard* shard = (struct ncclProxyShard*)shard_;
+  char threadName[16];
+  snprintf(threadName, sizeof(threadName), "NCCLproxy %d.n%d", shard->comm->rank, shard->netDev);
+  nvtxNameOsThreadA(syscall(SYS_gettid), threadName);
+  return proxyProgressThread(shard->comm, &shard->state);
+}
+
+static ncclResult_t proxyShardStart(struct ncclComm* comm, struct ncclProxyShard* shard) {
+  shard->state.priorityBytes = comm->proxyState.priorityBytes;
+  shard->state.priorityRatio = comm->proxyState.priorityRatio;
+  // Profiles are not thread safe, each thread records in its own one, merged in ncclProxyDestroy
+  if (comm->proxyState.profile) NCCLCHECK(ncclProxyProfileInit(comm, &shard->state.profile));
+  pthread_create(&shard->thread, NULL, proxyShardThread, shard);
+  const cpu_set_t* affinity = CPU_COUNT(&shard->affinity) ? &shard->affinity : &comm->cpuAffinity;
+  if (CPU_COUNT(affinity) && pthread_setaffinity_np(shard->thread, sizeof(cpu_set_t), affinity) != 0) {
+    INFO(NCCL_INIT, "Proxy : unable to pin the thread of NET/%d, it runs on any CPU", shard->netDev);
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclProxyNetShard(struct ncclComm* comm, int netDev, const cpu_set_t* netAffinity, struct ncclConnector* connector) {
+  struct ncclProxyState* state = &comm->proxyState;
+  int maxShards = rcclParamProxyNicThreads();
+  connector->proxyShard = 0;
+  if (maxShards <= 0 || rcclParamProxyShared() > 0) return ncclSuccess;
+  int* appendShard = NULL;
+  if (connector->conn.shared) {
+    appendShard = state->sharedBuffs.proxyAppendShard + (connector->proxyAppendPtr - state->sharedBuffs.proxyAppend);
+    if (*appendShard) {
+      connector->proxyShard = *appendShard;
+      return ncclSuccess;
     }
   }
+  if (state->shards == NULL) NCCLCHECK(ncclCalloc(&state->shards, maxShards));
+  int s = 0;
+  while (s < state->nShards && state->shards[s].netDev != netDev) s++;
+  if (s == state->nShards && state->nShards == maxShards) {
+    s = netDev % state->nShards;
+  } else if (s == state->nShards) {
+    struct ncclProxyShard* shard = state->shards+s;
+    shard->comm = comm;
+    shard->netDev = netDev;
+    memcpy(&shard->affinity, netAffinity, sizeof(cpu_set_t));
+    char affinityStr[sizeof(cpu_set_t)*2];
+    NCCLCHECK(ncclCpusetToStr(&shard->affinity, affinityStr));
+    INFO(NCCL_INIT, "Proxy : thread %d progresses NET/%d on CPUs %s", s, netDev, CPU_COUNT(&shard->affinity) ? affinityStr : "of the communicator");
+    state->nShards++;
+    // Threads created after the communicator start right away
+    if (comm->proxyThread) NCCLCHECK(proxyShardStart(comm, shard));
+  }
+  connector->proxyShard = s+1;
+  if (appendShard) *appendShard = s+1;
+  return ncclSuccess;
 }
 
+// Hands operations over to the thread progressing them. Reversed, so that the thread gets them
+// in order when it reverses the stack.
+static void proxyPost(struct ncclProxyState* state, struct ncclProxyArgs* first) {
+  pushOps(&state->postedStack, reverseOps(first), first);
+  ncclProxyWakeupSignal(proxyWakeup(state));
+}
+
+// Splits the operations by shard, in order
+static void proxyPostShards(struct ncclProxyState* state, struct ncclProxyArgs* first) {
+  while (first) {
+    struct ncclProxyArgs* next = first->next;
+    int shard = first->subs[0].connector->proxyShard;
+    struct ncclProxyState* target = shard ? &state->shards[shard-1].state : state;
+    first->next = NULL;
+    if (target->nextOps == NULL) target->nextOps = first;
+    else target->nextOpsEnd->next = first;
+    target->nextOpsEnd = first;
+    first = next;
+  }
+  for (int s=-1; s<state->nShards; s++) {
+    struct ncclProxyState* target = s == -1 ? state : &state->shards[s].state;
+    if (target->nextOps == NULL) continue;
+    proxyPost(target, target->nextOps);
+    target->nextOps = target->nextOpsEnd = NULL;
+  }
+}
+// [/RCCL]
+
 ncclResult_t ncclProxyStart(struct ncclComm* comm) {
   struct ncclProxyState* state = &comm->proxyState;
   if (state->nextOps == NULL) return ncclSuccess;
-  pthread_mutex_lock(&state->opsMutex);
-  if (state->postedOps) state->postedOpsEnd->next = state->nextOps;
-  else state->postedOps = state->nextOps;
-  state->postedOpsEnd = state->nextOpsEnd;
+  // [RCCL] Handed over to the proxy thread, or split between the threads of NICs
+  struct ncclProxyArgs* first = state->nextOps;
+  if (state->profile) ncclProxyProfilePost(first);
   state->nextOps = state->nextOpsEnd = NULL;
-  pthread_cond_signal(&state->cond);
-  pthread_mutex_unlock(&state->opsMutex);
+  if (state->nShards) proxyPostShards(state, first);
+  else proxyPost(state, first);
+  // [/RCCL]
   comm->opCount++;
   return ncclSuccess;
 }
@@ -521,12 +1024,22 @@ ncclResult_t ncclProxySharedBuffersDestroy(struct ncclComm* comm) {
 }
 
 ncclResult_t ncclProxyCreate(struct ncclComm* comm) {
+  // [RCCL]
+  if (!comm->proxyThread && comm->proxyState.engine == NULL) NCCLCHECK(ncclProxyProfileInit(comm, &comm->proxyState.profile));
+  comm->proxyState.priorityBytes = rcclParamProxyPriorityBytes();
+  comm->proxyState.priorityRatio = rcclParamProxyPriorityRatio();
+  if (rcclParamProxyShared() > 0) {
+    if (comm->proxyState.engine == NULL) {
+      comm->proxyState.ops = NULL;
+      NCCLCHECK(sharedProxyAdd(comm));
+    }
+    return ncclSuccess;
+  }
+  // [/RCCL]
   if (!comm->proxyThread) {
-    comm->proxyState.cond = PTHREAD_COND_INITIALIZER;
-    comm->proxyState.opsMutex = PTHREAD_MUTEX_INITIALIZER;
-    comm->proxyState.poolMutex = PTHREAD_MUTEX_INITIALIZER;
     comm->proxyState.ops = NULL;
     pthread_create(&comm->proxyThread, NULL, persistentThread, comm);
+    for (int s=0; s<comm->proxyState.nShards; s++) NCCLCHECK(proxyShardStart(comm, comm->proxyState.shards+s)); // [RCCL]
   }
   return ncclSuccess;
 }
@@ -535,23 +1048,62 @@ ncclResult_t ncclProxyDestroy(struct ncclComm* comm) {
   struct ncclProxyState* state = &comm->proxyState;
 
   // Request the proxy to stop and then wake it
-  pthread_mutex_lock(&state->opsMutex);
-  state->stop = true;
-  pthread_cond_signal(&state->cond);
-  pthread_mutex_unlock(&state->opsMutex);
+  __atomic_store_n(&state->stop, true, __ATOMIC_SEQ_CST);
+  ncclProxyWakeupSignal(proxyWakeup(state));
   if (comm->proxyThread) pthread_join(comm->proxyThread, NULL);
+  // [RCCL]
+  for (int s=0; s<state->nShards && comm->proxyThread; s++) {
+    struct ncclProxyShard* shard = state->shards+s;
+    __atomic_store_n(&shard->state.stop, true, __ATOMIC_SEQ_CST);
+    ncclProxyWakeupSignal(&shard->state.wakeup);
+    pthread_join(shard->thread, NULL);
+    struct ncclProxyIdleStats* stats = &shard->state.stats;
+    INFO(NCCL_INIT, "Proxy thread of NET/%d : busy %.1f ms, idle %.1f ms, asleep %.1f ms, %lu sleeps, %lu wakeups",
+        shard->netDev, stats->busyNs/1e6, stats->spinNs/1e6, stats->sleepNs/1e6, stats->sleeps, stats->wakeups);
+    NCCLCHECK(ncclProxyProfileMerge(state->profile, shard->state.profile));
+    shard->state.profile = NULL;
+  }
+  state->nShards = 0;
+  bool shared = state->engine != NULL;
+  if (shared) NCCLCHECK(sharedProxyRemove(comm));
+  struct ncclProxyIdleStats* stats = &state->stats;
+  if (comm->proxyThread || shared) {
+    INFO(NCCL_INIT, "Proxy thread : busy %.1f ms, idle %.1f ms, asleep %.1f ms, %lu sleeps, %lu wakeups, wakeup latency avg %.1f us max %.1f us, %zu KB of operations on NUMA node %d",
+        stats->busyNs/1e6, stats->spinNs/1e6, stats->sleepNs/1e6, stats->sleeps, stats->wakeups,
+        stats->wakeups ? stats->wakeupNs/1e3/stats->wakeups : 0, stats->maxWakeupNs/1e3, state->poolSize/1024, state->numaNode);
+  }
+  NCCLCHECK(ncclProxyProfileDestroy(state->profile));
+  state->profile = NULL;
+  // [/RCCL]
 
   // Free off any memory allocated for the proxy arg pools
-  pthread_mutex_lock(&state->poolMutex);
   struct ncclProxyState* proxyState = &comm->proxyState;
   while (proxyState->pools != NULL) {
     struct ncclProxyPool *next = proxyState->pools->next;
+    ncclNumaFree(proxyState->pools->elems, proxyState->pools->size); // [RCCL]
     free(proxyState->pools);
     proxyState->pools = next;
   }
-  pthread_mutex_unlock(&state->poolMutex);
 
   NCCLCHECK(ncclProxySharedBuffersDestroy(comm));
 
   return ncclSuccess;
 }
+
+// [RCCL] Network comms keep signaling the wakeup of the thread which last progressed them (see
+// ncclProxyCurrentWakeup) until they are closed, so the shards and the shared engine are only
+// freed once the transports of the communicator are.
+ncclResult_t ncclProxyFree(struct ncclComm* comm) {
+  struct ncclProxyState* state = &comm->proxyState;
+  free(state->shards);
+  state->shards = NULL;
+  struct ncclProxyEngine* engine = state->engine;
+  if (engine == NULL) return ncclSuccess;
+  state->engine = NULL;
+  pthread_mutex_lock(&proxyEnginesLock);
+  bool last = --engine->refs == 0;
+  pthread_mutex_unlock(&proxyEnginesLock);
+  if (last) free(engine);
+  return ncclSuccess;
+}
+// [/RCCL]
@@ -0,0 +1,403 @@
+/*
+Copyright (c) 2021 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "proxy_profile.h"
+#include "comm.h"
+#include "param.h"
+#include <limits.h>
+
+RCCL_PARAM(ProxyProfile, "PROXY_PROFILE", 0);
+RCCL_PARAM(ProxyTraceEvents, "PROXY_TRACE_EVENTS", 65536);
+
+// Log-linear histogram of durations in ns, with 8 buckets per power of 2 (12.5% precision)
+#define HIST_SUB_BITS 3
+#define HIST_SUBS (1<<HIST_SUB_BITS)
+#define HIST_MAX_LOG2 40
+#define HIST_BUCKETS ((HIST_MAX_LOG2-HIST_SUB_BITS+2)*HIST_SUBS)
+
+struct ncclProxyHistogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint32_t buckets[HIST_BUCKETS];
+};
+
+static int histBucket(uint64_t value) {
+  if (value < HIST_SUBS) return value;
+  int log2 = 63-__builtin_clzll(value);
+  if (log2 > HIST_MAX_LOG2) return HIST_BUCKETS-1;
+  return (log2-HIST_SUB_BITS+1)*HIST_SUBS + ((value >> (log2-HIST_SUB_BITS)) & (HIST_SUBS-1));
+}
+
+// Middle of the bucket
+static uint64_t histValue(int bucket) {
+  if (bucket < HIST_SUBS) return bucket;
+  int shift = bucket/HIST_SUBS-1;
+  return ((uint64_t)(HIST_SUBS + bucket%HIST_SUBS) << shift) + ((1ULL << shift) >> 1);
+}
+
+static void histAdd(struct ncclProxyHistogram* hist, uint64_t value) {
+  hist->count++;
+  hist->sum += value;
+  hist->max = std::max(hist->max, value);
+  hist->buckets[histBucket(value)]++;
+}
+
+static uint64_t histPercentile(struct ncclProxyHistogram* hist, double percentile) {
+  uint64_t target = (uint64_t)(percentile*hist->count/100);
+  uint64_t count = 0;
+  for (int b=0; b<HIST_BUCKETS; b++) {
+    count += hist->buckets[b];
+    if (count > target) return std::min(histValue(b), hist->max);
+  }
+  return hist->max;
+}
+
+// What is measured, per step for net and gpu :
+// - op   : from the post of the operation to its removal
+// - post : from the post of the operation to its first network send or receive
+// - net  : send : isend posted to completed. recv : irecv posted to data received
+// - gpu  : send : buffer given to the GPU to data ready. recv : data received to buffer released by the GPU
+enum { profOp, profPost, profNet, profGpu, profMetrics };
+static const char* profMetricNames[profMetrics] = { "op", "post", "net", "gpu" };
+
+struct ncclProxyProfileEntry {
+  int channel;
+  int peer;
+  int send;
+  uint64_t ops;
+  struct ncclProxyHistogram hists[profMetrics];
+};
+
+struct ncclProxySubProfile {
+  struct ncclProxyProfileEntry* entry;
+  // Steps accounted for
+  uint64_t posted;
+  uint64_t received;
+  uint64_t transmitted;
+  uint64_t done;
+  uint64_t firstPostNs;
+  uint64_t stepNs[NCCL_MAX_STEPS]; // When each step in flight reached its current stage, see profileSteps
+  struct ncclProxySubProfile* next;
+};
+
+#define SUB_PROFILE_CHUNK 64
+struct ncclProxySubProfileChunk {
+  struct ncclProxySubProfileChunk* next;
+  struct ncclProxySubProfile subs[SUB_PROFILE_CHUNK];
+};
+
+struct ncclProxyTraceEvent {
+  uint64_t startNs;
+  uint64_t durNs;
+  uint64_t opCount;
+  int peer;
+  int step;
+  int16_t channel;
+  uint8_t send;
+  uint8_t metric;
+};
+
+struct ncclProxyProfile {
+  int rank;
+  uint64_t startNs;
+  struct ncclProxyProfileEntry** entries;
+  int nEntries;
+  int maxEntries;
+  struct ncclProxySubProfile* freeSubs;
+  struct ncclProxySubProfileChunk* chunks;
+  // Ring of the last trace events
+  struct ncclProxyTraceEvent* events;
+  uint64_t nEvents;
+  int maxEvents;
+  char traceFile[PATH_MAX];
+};
+
+// Expands %h (hostname), %p (pid) and %r (rank) like NCCL_DEBUG_FILE
+static void expandTraceFile(const char* env, int rank, char* path) {
+  char* p = path;
+  char* end = path+PATH_MAX-1;
+  for (int c=0; env[c] != '\0' && p < end; c++) {
+    if (env[c] != '%' || env[c+1] == '\0') {
+      *p++ = env[c];
+      continue;
+    }
+    switch (env[++c]) {
+      case 'h':
+        getHostName(p, end-p, '.');
+        p += strlen(p);
+        break;
+      case 'p': p += snprintf(p, end-p, "%d", getpid()); break;
+      case 'r': p += snprintf(p, end-p, "%d", rank); break;
+      case '%': *p++ = '%'; break;
+      default:
+        *p++ = '%';
+        if (p < end) *p++ = env[c];
+        break;
+    }
+    p = std::min(p, end);
+  }
+  *p = '\0';
+}
+
+ncclResult_t ncclProxyProfileInit(struct ncclComm* comm, struct ncclProxyProfile** profilePtr) {
+  const char* traceEnv = getenv("RCCL_PROXY_TRACE_FILE");
+  *profilePtr = NULL;
+  if (rcclParamProxyProfile() == 0 && traceEnv == NULL) return ncclSuccess;
+  struct ncclProxyProfile* profile;
+  NCCLCHECK(ncclCalloc(&profile, 1));
+  profile->rank = comm->rank;
+  profile->startNs = ncclTimeNs();
+  if (traceEnv) {
+    expandTraceFile(traceEnv, comm->rank, profile->traceFile);
+    profile->maxEvents = std::max(rcclParamProxyTraceEvents(), 1L);
+    NCCLCHECK(ncclCalloc(&profile->events, profile->maxEvents));
+  }
+  *profilePtr = profile;
+  INFO(NCCL_INIT|NCCL_NET, "Proxy profiling enabled%s%s", traceEnv ? ", trace file " : "", profile->traceFile);
+  return ncclSuccess;
+}
+
+void ncclProxyProfilePost(struct ncclProxyArgs* ops) {
+  uint64_t now = ncclTimeNs();
+  for (struct ncclProxyArgs* op = ops; op; op = op->next) {
+    for (int s=0; s<op->nsubs; s++) op->subs[s].postTime = now;
+  }
+}
+
+static ncclResult_t getEntry(struct ncclProxyProfile* profile, int channel, int peer, int send, struct ncclProxyProfileEntry** entryPtr) {
+  for (int e=0; e<profile->nEntries; e++) {
+    struct ncclProxyProfileEntry* entry = profile->entries[e];
+    if (entry->channel == channel && entry->peer == peer && entry->send == send) {
+      *entryPtr = entry;
+      return ncclSuccess;
+    }
+  }
+  if (profile->nEntries == profile->maxEntries) {
+    int maxEntries = std::max(2*profile->maxEntries, 16);
+    struct ncclProxyProfileEntry** entries;
+    NCCLCHECK(ncclCalloc(&entries, maxEntries));
+    if (profile->nEntries) memcpy(entries, profile->entries, profile->nEntries*sizeof(struct ncclProxyProfileEntry*));
+    free(profile->entries);
+    profile->entries = entries;
+    profile->maxEntries = maxEntries;
+  }
+  struct ncclProxyProfileEntry* entry;
+  NCCLCHECK(ncclCalloc(&entry, 1));
+  entry->channel = channel;
+  entry->peer = peer;
+  entry->send = send;
+  profile->entries[profile->nEntries++] = entry;
+  *entryPtr = entry;
+  return ncclSuccess;
+}
+
+static ncclResult_t getSubProfile(struct ncclProxyProfile* profile, struct ncclProxySubArgs* sub) {
+  if (profile->freeSubs == NULL) {
+    struct ncclProxySubProfileChunk* chunk;
+    NCCLCHECK(ncclCalloc(&chunk, 1));
+    chunk->next = profile->chunks;
+    profile->chunks = chunk;
+    for (int i=0; i<SUB_PROFILE_CHUNK; i++) {
+      chunk->subs[i].next = profile->freeSubs;
+      profile->freeSubs = chunk->subs+i;
+    }
+  }
+  struct ncclProxySubProfile* prof = profile->freeSubs;
+  profile->freeSubs = prof->next;
+  memset(prof, 0, sizeof(struct ncclProxySubProfile));
+  NCCLCHECK(getEntry(profile, sub->channel->id, sub->peer, sub->send, &prof->entry));
+  sub->prof = prof;
+  return ncclSuccess;
+}
+
+static void record(struct ncclProxyProfile* profile, struct ncclProxyArgs* op, struct ncclProxySubArgs* sub, int metric, uint64_t start, uint64_t end, int step) {
+  uint64_t duration = end > start ? end-start : 0;
+  histAdd(sub->prof->entry->hists+metric, duration);
+  if (profile->events == NULL) return;
+  struct ncclProxyTraceEvent* event = profile->events + profile->nEvents++ % profile->maxEvents;
+  event->startNs = start;
+  event->durNs = duration;
+  event->opCount = op->opCount;
+  event->peer = sub->peer;
+  event->step = step;
+  event->channel = sub->channel->id;
+  event->send = sub->send;
+  event->metric = metric;
+}
+
+// Steps in flight on the connection of a sub, more than NCCL_STEPS for deep SIMPLE pipelines (see
+// ncclConnInfo::simpleSteps)
+static int profileSteps(struct ncclProxyArgs* op, struct ncclProxySubArgs* sub) {
+  int steps = op->protocol == NCCL_PROTO_SIMPLE ? sub->connector->conn.simpleSteps : 0;
+  return steps ? steps : NCCL_STEPS; // Connectors not set up by a transport (e.g. proxy-bench) keep the default
+}
+
+ncclResult_t ncclProxyProfileProgress(struct ncclProxyProfile* profile, struct ncclProxyArgs* op) {
+  if (op->state == ncclProxyOpReady) return ncclSuccess; // Counters are only valid once progressed
+  uint64_t now = ncclTimeNs();
+  int stepSize = std::max(op->sliceSteps, 1);
+  for (int s=0; s<op->nsubs; s++) {
+    struct ncclProxySubArgs* sub = op->subs+s;
+    if (sub->prof == NULL) NCCLCHECK(getSubProfile(profile, sub));
+    struct ncclProxySubProfile* prof = sub->prof;
+    int nSteps = profileSteps(op, sub);
+    // Steps go through posted, then (recv only) received, then transmitted, then done
+    for (; prof->posted < sub->posted; prof->posted += stepSize) {
+      prof->stepNs[prof->posted%nSteps] = now;
+      if (prof->firstPostNs == 0 && !sub->send) {
+        prof->firstPostNs = now;
+        record(profile, op, sub, profPost, sub->postTime, now, 0);
+      }
+    }
+    for (; prof->received < sub->received; prof->received += stepSize) {
+      uint64_t* stepNs = prof->stepNs+prof->received%nSteps;
+      record(profile, op, sub, profNet, *stepNs, now, prof->received);
+      *stepNs = now;
+    }
+    for (; prof->transmitted < sub->transmitted; prof->transmitted += stepSize) {
+      if (!sub->send) continue;
+      uint64_t* stepNs = prof->stepNs+prof->transmitted%nSteps;
+      record(profile, op, sub, profGpu, *stepNs, now, prof->transmitted);
+      *stepNs = now;
+      if (prof->firstPostNs == 0) {
+        prof->firstPostNs = now;
+        record(profile, op, sub, profPost, sub->postTime, now, 0);
+      }
+    }
+    for (; prof->done < sub->done; prof->done += stepSize) {
+      record(profile, op, sub, sub->send ? profNet : profGpu, prof->stepNs[prof->done%nSteps], now, prof->done);
+    }
+  }
+  return ncclSuccess;
+}
+
+void ncclProxyProfileRemove(struct ncclProxyProfile* profile, struct ncclProxyArgs* op) {
+  uint64_t now = ncclTimeNs();
+  for (int s=0; s<op->nsubs; s++) {
+    struct ncclProxySubArgs* sub = op->subs+s;
+    struct ncclProxySubProfile* prof = sub->prof;
+    if (prof == NULL) continue;
+    prof->entry->ops++;
+    record(profile, op, sub, profOp, sub->postTime, now, 0);
+    prof->next = profile->freeSubs;
+    profile->freeSubs = prof;
+    sub->prof = NULL;
+  }
+}
+
+static void freeProfile(struct ncclProxyProfile* profile) {
+  for (int e=0; e<profile->nEntries; e++) free(profile->entries[e]);
+  free(profile->entries);
+  while (profile->chunks) {
+    struct ncclProxySubProfileChunk* next = profile->chunks->next;
+    free(profile->chunks);
+    profile->chunks = next;
+  }
+  free(profile->events);
+  free(profile);
+}
+
+ncclResult_t ncclProxyProfileMerge(struct ncclProxyProfile* profile, struct ncclProxyProfile* other) {
+  if (other == NULL) return ncclSuccess;
+  ncclResult_t ret = ncclSuccess;
+  for (int e=0; e<other->nEntries; e++) {
+    struct ncclProxyProfileEntry* src = other->entries[e];
+    struct ncclProxyProfileEntry* dst;
+    NCCLCHECKGOTO(getEntry(profile, src->channel, src->peer, src->send, &dst), ret, end);
+    dst->ops += src->ops;
+    for (int m=0; m<profMetrics; m++) {
+      dst->hists[m].count += src->hists[m].count;
+      dst->hists[m].sum += src->hists[m].sum;
+      dst->hists[m].max = std::max(dst->hists[m].max, src->hists[m].max);
+      for (int b=0; b<HIST_BUCKETS; b++) dst->hists[m].buckets[b] += src->hists[m].buckets[b];
+    }
+  }
+  if (profile->events && other->events) {
+    uint64_t first = other->nEvents > (uint64_t)other->maxEvents ? other->nEvents-other->maxEvents : 0;
+    for (uint64_t i=first; i<other->nEvents; i++) {
+      profile->events[profile->nEvents++ % profile->maxEvents] = other->events[i%other->maxEvents];
+    }
+  }
+end:
+  freeProfile(other);
+  return ret;
+}
+
+static ncclResult_t writeTrace(struct ncclProxyProfile* profile) {
+  FILE* file = fopen(profile->traceFile, "w");
+  if (file == NULL) {
+    WARN("Proxy profile : could not open trace file %s : %s", profile->traceFile, strerror(errno));
+    return ncclSystemError;
+  }
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  // One row per channel
+  int maxChannel = -1;
+  for (int e=0; e<profile->nEntries; e++) maxChannel = std::max(maxChannel, profile->entries[e]->channel);
+  fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"rank %d proxy\"}}", profile->rank, profile->rank);
+  for (int c=0; c<=maxChannel; c++) {
+    fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"channel %d\"}}", profile->rank, c, c);
+  }
+  uint64_t first = profile->nEvents > (uint64_t)profile->maxEvents ? profile->nEvents-profile->maxEvents : 0;
+  for (uint64_t i=first; i<profile->nEvents; i++) {
+    struct ncclProxyTraceEvent* event = profile->events + i%profile->maxEvents;
+    double ts = event->startNs > profile->startNs ? (event->startNs-profile->startNs)/1e3 : 0;
+    fprintf(file, ",\n{\"name\":\"%s %s %d\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+        "\"args\":{\"opCount\":%lu,\"step\":%d}}", profMetricNames[event->metric], event->send ? "send" : "recv", event->peer,
+        profMetricNames[event->metric], ts, event->durNs/1e3, profile->rank, event->channel, event->opCount, event->step);
+  }
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  INFO(NCCL_INIT|NCCL_NET, "Proxy profile : wrote %lu events to %s%s", profile->nEvents-first, profile->traceFile,
+      first ? " (older events dropped, see RCCL_PROXY_TRACE_EVENTS)" : "");
+  return ncclSuccess;
+}
+
+ncclResult_t ncclProxyProfileDestroy(struct ncclProxyProfile* profile) {
+  if (profile == NULL) return ncclSuccess;
+  struct ncclProxyProfileEntry* slowest = NULL;
+  uint64_t slowestNs = 0;
+  for (int e=0; e<profile->nEntries; e++) {
+    struct ncclProxyProfileEntry* entry = profile->entries[e];
+    char line[512];
+    int len = 0;
+    for (int m=0; m<profMetrics; m++) {
+      struct ncclProxyHistogram* hist = entry->hists+m;
+      len += snprintf(line+len, sizeof(line)-len, " | %s %.1f/%.1f/%.1f", profMetricNames[m],
+          histPercentile(hist, 50)/1e3, histPercentile(hist, 99)/1e3, hist->max/1e3);
+    }
+    INFO(NCCL_NET, "Proxy profile : channel %2d %s peer %3d : %lu ops, p50/p99/max us%s", entry->channel,
+        entry->send ? "send" : "recv", entry->peer, entry->ops, line);
+    uint64_t netNs = histPercentile(entry->hists+profNet, 99);
+    if (slowest == NULL || netNs > slowestNs) {
+      slowest = entry;
+      slowestNs = netNs;
+    }
+  }
+  if (slowest) {
+    INFO(NCCL_NET, "Proxy profile : slowest network steps (p99 %.1f us) on channel %d %s peer %d", slowestNs/1e3,
+        slowest->channel, slowest->send ? "send" : "recv", slowest->peer);
+  }
+  ncclResult_t ret = profile->events ? writeTrace(profile) : ncclSuccess;
+  freeProfile(profile);
+  return ret;
+}
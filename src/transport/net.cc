@@ -79,6 +79,44 @@ ncclResult_t netCanConnect(int* ret, struct ncclTopoSystem* topo, struct ncclTop
 
 NCCL_PARAM(NetSharedBuffers, "NET_SHARED_BUFFERS", -2);
 
+// [RCCL] Proxy thread of the connector, close to its NIC
+static ncclResult_t netProxyShard(struct ncclComm* comm, int netDev, struct ncclConnector* connector) {
+  cpu_set_t netAffinity;
+  NCCLCHECK(ncclTopoGetNetCpuAffinity(comm->topo, netDev, &netAffinity));
+  NCCLCHECK(ncclProxyNetShard(comm, netDev, &netAffinity, connector));
+  return ncclSuccess;
+}
+
+// Pipeline depth of the SIMPLE protocol over a NIC : enough steps to keep its bandwidth-delay
+// product in flight, each step taking RCCL_NET_STEP_LATENCY_US to go through the proxies and the
+// GPUs of both sides, up to what the network supports. RCCL_NET_STEPS forces the depth. Shared
+// buffers keep NCCL_STEPS.
+RCCL_PARAM(NetSteps, "NET_STEPS", 0);
+RCCL_PARAM(NetStepLatencyUs, "NET_STEP_LATENCY_US", 20);
+
+static ncclResult_t netSimpleSteps(struct ncclComm* comm, int netDev, int shared, int* steps) {
+  *steps = NCCL_STEPS;
+  if (shared) return ncclSuccess;
+  int64_t wanted = rcclParamNetSteps();
+  if (wanted <= 0) {
+    ncclNetProperties_t props;
+    NCCLCHECK(ncclNetGetProperties(netDev, &props));
+    // Speed is in Mbps, speed/8 bytes per microsecond
+    int64_t bdp = (int64_t)props.speed/8*rcclParamNetStepLatencyUs();
+    wanted = DIVUP(bdp, comm->buffSizes[NCCL_PROTO_SIMPLE]/NCCL_STEPS);
+  }
+  int maxSteps = std::min(NCCL_MAX_STEPS, ncclNetMaxRequests);
+  while (*steps < wanted && *steps < maxSteps) *steps *= 2;
+  if (*steps > NCCL_STEPS) INFO(NCCL_INIT|NCCL_NET, "NET/%d : %d steps of %d bytes in flight", netDev, *steps, comm->buffSizes[NCCL_PROTO_SIMPLE]/NCCL_STEPS);
+  return ncclSuccess;
+}
+
+// Steps of the buffer of a sub, for the protocol of the operation
+static int netSteps(struct ncclProxyArgs* args, struct ncclProxySubArgs* sub) {
+  return args->protocol == NCCL_PROTO_SIMPLE ? sub->connector->conn.simpleSteps : NCCL_STEPS;
+}
+// [/RCCL]
+
 /* Determine if we will use this transport for this peer and return connect
  * information for this peer */
 ncclResult_t netSendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, struct ncclConnect* connectInfo, struct ncclConnector* send, int channelId, int connIndex) {
@@ -96,6 +134,8 @@ ncclResult_t netSendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, st
     NCCLCHECK(ncclTopoGetNetDev(comm->topo, myInfo->rank, graph, channelId, nicRR, &resources->netDev));
   }
   NCCLCHECK(ncclTopoCheckGdr(comm->topo, myInfo->busId, resources->netDev, 1, &resources->useGdr));
+  NCCLCHECK(netProxyShard(comm, resources->netDev, send)); // [RCCL]
+  NCCLCHECK(netSimpleSteps(comm, resources->netDev, resources->shared, &send->conn.simpleSteps)); // [RCCL]
 
   NCCLCHECK(ncclCudaHostCalloc(&resources->sendMem, 1));
   NCCLCHECK(ncclCudaHostCalloc(&resources->recvMem, 1));
@@ -107,7 +147,7 @@ ncclResult_t netSendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, st
   send->conn.ptrsFifo = resources->shared ? resources->recvMem->ptrsFifo : NULL;
   send->conn.head = &resources->sendMem->head;
   resources->sendMem->head = resources->shared ? -NCCL_STEPS : 0; // Don't give any credit yet when sharing buffers
-  for (int i=0; i<NCCL_STEPS; i++) send->conn.sizesFifo[i] = -1;
+  for (int i=0; i<NCCL_MAX_STEPS; i++) send->conn.sizesFifo[i] = -1; // [RCCL]
 
   if (resources->shared == 0) {
     int protoLoc[NCCL_NUM_PROTOCOLS];
@@ -117,6 +157,7 @@ ncclResult_t netSendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, st
     int buffSizes[NCCL_NUM_PROTOCOLS];
     for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
       buffSizes[p] = send->comm->buffSizes[p];
+      if (p == NCCL_PROTO_SIMPLE) buffSizes[p] = buffSizes[p]/NCCL_STEPS*send->conn.simpleSteps; // [RCCL]
       resources->buffSizes[protoLoc[p]] += buffSizes[p];
     }
 
@@ -166,6 +207,8 @@ ncclResult_t netRecvSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, st
     NCCLCHECK(ncclTopoGetNetDev(comm->topo, myInfo->rank, graph, channelId, nicRR, &resources->netDev));
   }
   NCCLCHECK(ncclTopoCheckGdr(comm->topo, myInfo->busId, resources->netDev, 0, &resources->useGdr));
+  NCCLCHECK(netProxyShard(comm, resources->netDev, recv)); // [RCCL]
+  NCCLCHECK(netSimpleSteps(comm, resources->netDev, resources->shared, &recv->conn.simpleSteps)); // [RCCL]
 
   NCCLCHECK(ncclCudaHostCalloc(&resources->sendMem, 1));
   NCCLCHECK(ncclCudaHostCalloc(&resources->recvMem, 1));
@@ -202,6 +245,7 @@ ncclResult_t netRecvSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, st
     int buffSizes[NCCL_NUM_PROTOCOLS];
     for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
       buffSizes[p] = recv->comm->buffSizes[p];
+      if (p == NCCL_PROTO_SIMPLE) buffSizes[p] = buffSizes[p]/NCCL_STEPS*recv->conn.simpleSteps; // [RCCL]
       resources->buffSizes[protoLoc[p]] += buffSizes[p];
     }
 
@@ -323,6 +367,44 @@ ncclResult_t netRecvFree(void* transportResources) {
 
 static_assert(NCCL_STEPS <= NCCL_NET_MAX_REQUESTS, "Not enough net requests to cover for steps");
 
+// [RCCL] Tests at once the network requests in flight of all subs : sends, or flushes and
+// receives. Completed requests are freed, so their slot is reset to NULL and their size kept in
+// sub->sizes. With networks which test requests one by one, only the oldest send, flush or
+// receive of each sub is tested, as before.
+static ncclResult_t netTestRequests(struct ncclProxyArgs* args, bool recv) {
+  void* requests[NCCL_PROXY_MAX_SUBS*NCCL_MAX_STEPS];
+  int slots[NCCL_PROXY_MAX_SUBS*NCCL_MAX_STEPS];
+  int done[NCCL_PROXY_MAX_SUBS*NCCL_MAX_STEPS];
+  int sizes[NCCL_PROXY_MAX_SUBS*NCCL_MAX_STEPS];
+  int n = 0;
+  for (int s=0; s<args->nsubs; s++) {
+    struct ncclProxySubArgs* sub = args->subs+s;
+    // Steps with send requests, or flush then receive requests
+    int nSteps = netSteps(args, sub);
+    uint64_t bounds[3] = { sub->done, sub->transmitted, sub->transmitted };
+    if (recv) bounds[0] = sub->transmitted, bounds[1] = sub->received, bounds[2] = sub->posted;
+    for (int w=0; w<2; w++) {
+      for (uint64_t step=bounds[w]; step<bounds[w+1]; step+=args->sliceSteps) {
+        int buffSlot = (sub->base+step)%nSteps;
+        if (sub->requests[buffSlot] == NULL) continue;
+        requests[n] = sub->requests[buffSlot];
+        slots[n++] = s*NCCL_MAX_STEPS+buffSlot;
+        if (ncclNetTestManyFunc == NULL) break;
+      }
+    }
+  }
+  if (n == 0) return ncclSuccess;
+  NCCLCHECK(ncclNetTestMany(requests, n, done, sizes));
+  for (int i=0; i<n; i++) {
+    if (done[i] == 0) continue;
+    struct ncclProxySubArgs* sub = args->subs+slots[i]/NCCL_MAX_STEPS;
+    sub->requests[slots[i]%NCCL_MAX_STEPS] = NULL;
+    sub->sizes[slots[i]%NCCL_MAX_STEPS] = sizes[i];
+  }
+  return ncclSuccess;
+}
+// [/RCCL]
+
 ncclResult_t netSendProxy(struct ncclProxyArgs* args) {
   if (args->state == ncclProxyOpReady) {
     for (int s=0; s<args->nsubs; s++) {
@@ -338,35 +420,37 @@ ncclResult_t netSendProxy(struct ncclProxyArgs* args) {
   args->idle = 1;
   if (args->state == ncclProxyOpProgress) {
     int p = args->protocol;
+    NCCLCHECK(netTestRequests(args, false)); // [RCCL]
     for (int s=0; s<args->nsubs; s++) {
       struct ncclProxySubArgs* sub = args->subs+s;
       if (sub->done == sub->nsteps) continue;
       struct netSendResources* resources = (struct netSendResources*) (sub->connector->transportResources);
       void* mhandle = *(resources->mhandlesProto[p]);
       int stepSize = sub->connector->comm->buffSizes[p] / NCCL_STEPS;
+      int nSteps = netSteps(args, sub); // [RCCL]
       char* localBuff = sub->connector->conn.buffs[p];
       int buffSize = stepSize*args->sliceSteps;
       if (resources->shared) buffSize /= SENDRECV_SLICEFACTOR;
       if (sub->sendbytes < buffSize) buffSize = sub->sendbytes;
       // Post buffers to the GPU
-      if (sub->posted < sub->nsteps && sub->posted < sub->done + NCCL_STEPS) {
-        int buffSlot = (sub->base+sub->posted)%NCCL_STEPS;
+      if (sub->posted < sub->nsteps && sub->posted < sub->done + nSteps) {
+        int buffSlot = (sub->base+sub->posted)%nSteps;
         if (resources->shared) {
           char* ptr;
-          int sharedBuffSlot = sub->posted%NCCL_STEPS;
+          int sharedBuffSlot = sub->posted%nSteps;
           NCCLCHECK(ncclProxySharedBuffersGetP2p(sub->connector->comm, resources->useGdr, 0, sub->channel->id, sharedBuffSlot, s, &ptr));
           resources->recvMem->ptrsFifo[buffSlot] = ptr;
           __sync_synchronize();
           volatile uint64_t* sendHead = &resources->sendMem->head;
           sub->posted += args->sliceSteps;
-          *sendHead = sub->base + sub->posted - NCCL_STEPS;
+          *sendHead = sub->base + sub->posted - nSteps;
         } else sub->posted += args->sliceSteps;
         args->idle = 0;
         continue;
       }
       // Check whether we received data from the GPU and send it to the network
-      if (sub->transmitted < sub->posted && sub->transmitted < sub->done + NCCL_STEPS) {
-        int buffSlot = (sub->base+sub->transmitted)%NCCL_STEPS;
+      if (sub->transmitted < sub->posted && sub->transmitted < sub->done + nSteps) {
+        int buffSlot = (sub->base+sub->transmitted)%nSteps;
         volatile int* sizesFifo = resources->recvMem->sizesFifo;
         volatile uint64_t* recvTail = &resources->recvMem->tail;
         if (sizesFifo[buffSlot] != -1 && ((*recvTail > (sub->base+sub->transmitted)) || p == NCCL_PROTO_LL)) {
@@ -428,11 +512,10 @@ ncclResult_t netSendProxy(struct ncclProxyArgs* args) {
       }
       // Check whether the network has completed some send operations.
       if (sub->done < sub->transmitted) {
-        int done;
-        int buffSlot = (sub->base+sub->done)%NCCL_STEPS;
-        NCCLCHECK(ncclNetTest(sub->requests[buffSlot], &done, NULL));
+        int buffSlot = (sub->base+sub->done)%nSteps;
+        int done = sub->requests[buffSlot] == NULL; // [RCCL] Tested by netTestRequests
         if (done) {
-          TRACE(NCCL_NET, "sendProxy [%lu/%d] request %p done", sub->done, buffSlot, sub->requests[buffSlot]);
+          TRACE(NCCL_NET, "sendProxy [%lu/%d] request done", sub->done, buffSlot);
 #ifdef ENABLE_PROFILING
           if (args->protocol == NCCL_PROTO_SIMPLE) {
             sub->channel->active_req --;
@@ -485,22 +568,24 @@ ncclResult_t netRecvProxy(struct ncclProxyArgs* args) {
   args->idle = 1;
   if (args->state == ncclProxyOpProgress) {
     int p = args->protocol;
+    NCCLCHECK(netTestRequests(args, true)); // [RCCL]
     for (int s=0; s<args->nsubs; s++) {
       struct ncclProxySubArgs* sub = args->subs+s;
       if (sub->done == sub->nsteps) continue;
       struct netRecvResources* resources = (struct netRecvResources*) (sub->connector->transportResources);
       void* mhandle = *(resources->mhandlesProto[p]);
       int stepSize = sub->connector->comm->buffSizes[p] / NCCL_STEPS;
+      int nSteps = netSteps(args, sub); // [RCCL]
       char* localBuff = sub->connector->conn.buffs[p];
       int buffSize = stepSize*args->sliceSteps;
       if (resources->shared) buffSize /= SENDRECV_SLICEFACTOR;
       if (sub->recvbytes < buffSize) buffSize = sub->recvbytes;
 
-      if ((sub->posted < sub->done + NCCL_STEPS) && (sub->posted < sub->nsteps)) {
-        int buffSlot = (sub->base+sub->posted)%NCCL_STEPS;
+      if ((sub->posted < sub->done + nSteps) && (sub->posted < sub->nsteps)) {
+        int buffSlot = (sub->base+sub->posted)%nSteps;
         char* ptr;
         if (resources->shared) {
-          int sharedBuffSlot = sub->posted%NCCL_STEPS;
+          int sharedBuffSlot = sub->posted%nSteps;
           NCCLCHECK(ncclProxySharedBuffersGetP2p(sub->connector->comm, resources->useGdr, 1, sub->channel->id, sharedBuffSlot, s, &ptr));
           volatile void** ptrsFifo = (volatile void**)resources->recvMem->ptrsFifo;
           ptrsFifo[buffSlot] = ptr;
@@ -525,9 +610,10 @@ ncclResult_t netRecvProxy(struct ncclProxyArgs* args) {
         }
       }
       if (sub->posted > sub->received) {
-        int buffSlot = (sub->base+sub->received)%NCCL_STEPS;
-        int done, size;
-        NCCLCHECK(ncclNetTest(sub->requests[buffSlot], &done, &size));
+        int buffSlot = (sub->base+sub->received)%nSteps;
+        // [RCCL] Tested by netTestRequests
+        int done = sub->requests[buffSlot] == NULL;
+        int size = sub->sizes[buffSlot];
         if (done) {
           sub->received += args->sliceSteps;
 #ifdef ENABLE_PROFILING
@@ -577,9 +663,8 @@ ncclResult_t netRecvProxy(struct ncclProxyArgs* args) {
       }
       if (sub->received > sub->transmitted) {
         // Progress flush operations
-        int buffSlot = (sub->base+sub->transmitted)%NCCL_STEPS;
-        int done = 1;
-        if (sub->requests[buffSlot]) NCCLCHECK(ncclNetTest(sub->requests[buffSlot], &done, NULL));
+        int buffSlot = (sub->base+sub->transmitted)%nSteps;
+        int done = sub->requests[buffSlot] == NULL; // [RCCL] Tested by netTestRequests
         if (done) {
           sub->transmitted += args->sliceSteps;
           __sync_synchronize();
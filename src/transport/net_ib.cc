@@ -260,7 +260,7 @@ ncclResult_t ncclIbGetProperties(int dev, ncclNetProperties_t* props) {
   return ncclSuccess;
 }
 
-#define MAX_REQUESTS NCCL_NET_MAX_REQUESTS
+#define MAX_REQUESTS NCCL_MAX_STEPS // [RCCL] See ncclNetMaxRequests
 
 #define NCCL_IB_MAX_QPS 128
 
@@ -867,6 +867,37 @@ ncclResult_t ncclIbIflush(void* recvComm, void* data, int size, void* mhandle, v
   return ncclSuccess;
 }
 
+// [RCCL] Polls up to n completions from the CQ of r, and accounts them to their requests.
+// Returns the number of completions polled in wrDone.
+static ncclResult_t ncclIbPollCq(struct ncclIbRequest* r, int n, int* wrDone) {
+  struct ibv_wc wcs[16];
+  NCCLCHECK(wrap_ibv_poll_cq(r->verbs->cq, std::min(n, 16), wcs, wrDone));
+
+  for (int w=0; w<*wrDone; w++) {
+    struct ibv_wc *wc = wcs+w;
+    if (wc->status != IBV_WC_SUCCESS) {
+      char line[SOCKET_NAME_MAXLEN+1];
+      WARN("NET/IB : Got completion from peer %s with error %d, opcode %d, len %d, vendor err %d",
+           socketToString(r->addr, line), wc->status, wc->opcode, wc->byte_len, wc->vendor_err);
+      return ncclSystemError;
+    }
+
+    struct ncclIbRequest* doneReq = (struct ncclIbRequest*)wc->wr_id;
+    if (doneReq) {
+      if (wc->opcode == IBV_WC_RECV) {
+        doneReq->size = wc->byte_len;
+#if USE_RDMA_WRITE
+      } else if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+        doneReq->size = wc->imm_data;
+#endif
+      }
+      doneReq->events--;
+    }
+  }
+  return ncclSuccess;
+}
+// [/RCCL]
+
 ncclResult_t ncclIbTest(void* request, int* done, int* size) {
   struct ncclIbRequest *r = (struct ncclIbRequest*)request;
   *done = 0;
@@ -880,33 +911,38 @@ ncclResult_t ncclIbTest(void* request, int* done, int* size) {
     }
 
     int wrDone = 0;
-    struct ibv_wc wcs[4];
-    NCCLCHECK(wrap_ibv_poll_cq(r->verbs->cq, 4, wcs, &wrDone));
+    NCCLCHECK(ncclIbPollCq(r, 4, &wrDone));
     if (wrDone == 0) return ncclSuccess;
+  }
+}
 
-    for (int w=0; w<wrDone; w++) {
-      struct ibv_wc *wc = wcs+w;
-      if (wc->status != IBV_WC_SUCCESS) {
-        char line[SOCKET_NAME_MAXLEN+1];
-        WARN("NET/IB : Got completion from peer %s with error %d, opcode %d, len %d, vendor err %d",
-             socketToString(r->addr, line), wc->status, wc->opcode, wc->byte_len, wc->vendor_err);
-        return ncclSystemError;
-      }
-
-      struct ncclIbRequest* doneReq = (struct ncclIbRequest*)wc->wr_id;
-      if (doneReq) {
-        if (wc->opcode == IBV_WC_RECV) {
-          doneReq->size = wc->byte_len;
-#if USE_RDMA_WRITE
-        } else if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
-          doneReq->size = wc->imm_data;
-#endif
-        }
-        doneReq->events--;
-      }
-    }
+// [RCCL] Drains the CQ of each comm once, then checks all requests, rather than polling the CQ
+// for every request. Requests of a comm are usually next to each other.
+ncclResult_t ncclIbTestMany(void** requests, int n, int* done, int* sizes) {
+  struct ibv_cq* polled[4] = { NULL, NULL, NULL, NULL };
+  for (int i=0; i<n; i++) {
+    struct ncclIbRequest *r = (struct ncclIbRequest*)requests[i];
+    if (r->events == 0) continue;
+    struct ibv_cq* cq = r->verbs->cq;
+    int p = 0;
+    while (p < 4 && polled[p] && polled[p] != cq) p++;
+    if (p < 4 && polled[p] == cq) continue;
+    if (p < 4) polled[p] = cq;
+    int wrDone;
+    do {
+      NCCLCHECK(ncclIbPollCq(r, 16, &wrDone));
+    } while (wrDone == 16);
   }
+  for (int i=0; i<n; i++) {
+    struct ncclIbRequest *r = (struct ncclIbRequest*)requests[i];
+    done[i] = r->events == 0;
+    if (done[i] == 0) continue;
+    if (sizes) sizes[i] = r->size;
+    NCCLCHECK(ncclIbFreeRequest(r));
+  }
+  return ncclSuccess;
 }
+// [/RCCL]
 
 ncclResult_t ncclIbCloseSend(void* sendComm) {
   struct ncclIbSendComm* comm = (struct ncclIbSendComm*)sendComm;
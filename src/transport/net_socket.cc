@@ -15,6 +15,31 @@
 #include <poll.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/errqueue.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define RCCL_IO_URING 1
+#endif
+#endif
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
 /* Init functions */
 static int ncclNetIfs = -1;
@@ -25,6 +50,18 @@ struct ncclSocketDev {
 };
 static struct ncclSocketDev ncclSocketDevs[MAX_IFS];
 
+// [RCCL] Multi-rail : with RCCL_SOCKET_MULTIRAIL, a single device bonds the first
+// MAX_RAILS interfaces. The sockets of a comm are spread over them, and the payload
+// is split in proportion to the speed of each interface. Extra rails must be IPv4, as
+// their addresses travel compactly in the connection handle.
+#define MAX_RAILS 4
+RCCL_PARAM(SocketMultiRail, "SOCKET_MULTIRAIL", 0);
+static int ncclSocketNRails = 0;
+static int ncclSocketRailSpeeds[MAX_RAILS]; // Mbps
+static char ncclSocketMultiRailName[MAX_RAILS*MAX_IF_NAME_SIZE];
+static ncclResult_t ncclSocketGetSpeed(char* devName, int* speed);
+// [/RCCL]
+
 pthread_mutex_t ncclSocketLock = PTHREAD_MUTEX_INITIALIZER;
 
 static ncclResult_t ncclSocketGetPciPath(char* devName, char** pciPath) {
@@ -35,6 +72,26 @@ static ncclResult_t ncclSocketGetPciPath(char* devName, char** pciPath) {
   return ncclSuccess;
 }
 
+// [RCCL] Picks the rails of the multi-rail device, among the interfaces found
+static ncclResult_t ncclSocketMultiRailInit() {
+  ncclSocketNRails = 0;
+  ncclSocketMultiRailName[0] = '\0';
+  for (int i=0; i<ncclNetIfs && ncclSocketNRails<MAX_RAILS; i++) {
+    if (i > 0 && (ncclSocketDevs[0].addr.sa.sa_family != AF_INET || ncclSocketDevs[i].addr.sa.sa_family != AF_INET)) {
+      INFO(NCCL_INIT|NCCL_NET, "NET/Socket : %s is not IPv4, not using it as a rail", ncclSocketDevs[i].devName);
+      continue;
+    }
+    int rail = ncclSocketNRails++;
+    if (i != rail) std::swap(ncclSocketDevs[i], ncclSocketDevs[rail]);
+    NCCLCHECK(ncclSocketGetSpeed(ncclSocketDevs[rail].devName, ncclSocketRailSpeeds+rail));
+    snprintf(ncclSocketMultiRailName+strlen(ncclSocketMultiRailName), sizeof(ncclSocketMultiRailName)-strlen(ncclSocketMultiRailName),
+        "%s%s", rail ? "+" : "", ncclSocketDevs[rail].devName);
+  }
+  if (ncclSocketNRails > 1) INFO(NCCL_INIT|NCCL_NET, "NET/Socket : Multi-rail device %s", ncclSocketMultiRailName);
+  return ncclSuccess;
+}
+// [/RCCL]
+
 ncclResult_t ncclSocketInit(ncclDebugLogger_t logFunction) {
   if (ncclNetIfs == -1) {
     pthread_mutex_lock(&ncclSocketLock);
@@ -60,6 +117,7 @@ ncclResult_t ncclSocketInit(ncclDebugLogger_t logFunction) {
         }
         line[MAX_LINE_LEN] = '\0';
         INFO(NCCL_INIT|NCCL_NET,"NET/Socket : Using%s", line);
+        if (rcclParamSocketMultiRail()) NCCLCHECK(ncclSocketMultiRailInit()); // [RCCL]
       }
     }
     pthread_mutex_unlock(&ncclSocketLock);
@@ -68,7 +126,7 @@ ncclResult_t ncclSocketInit(ncclDebugLogger_t logFunction) {
 }
 
 ncclResult_t ncclSocketDevices(int* ndev) {
-  *ndev = ncclNetIfs;
+  *ndev = ncclSocketNRails > 1 ? 1 : ncclNetIfs; // [RCCL] The multi-rail device replaces the interfaces
   return ncclSuccess;
 }
 
@@ -97,6 +155,10 @@ ncclResult_t ncclSocketGetProperties(int dev, ncclNetProperties_t* props) {
   props->guid = dev;
   props->ptrSupport = NCCL_PTR_HOST;
   NCCLCHECK(ncclSocketGetSpeed(props->name, &props->speed));
+  if (ncclSocketNRails > 1) { // [RCCL] Placed like its first rail, with the bandwidth of all
+    props->name = ncclSocketMultiRailName;
+    for (int r=1; r<ncclSocketNRails; r++) props->speed += ncclSocketRailSpeeds[r];
+  }
   props->port = 0;
   props->maxComms = 65536;
   return ncclSuccess;
@@ -112,16 +174,59 @@ ncclResult_t GetSocketAddr(int dev, union socketAddress* addr) {
 
 #define MAX_SOCKETS 64
 #define MAX_THREADS 16
-#define MAX_REQUESTS NCCL_NET_MAX_REQUESTS
+#define MAX_REQUESTS NCCL_MAX_STEPS // [RCCL] See ncclNetMaxRequests
 #define MIN_CHUNKSIZE (64*1024)
 
 NCCL_PARAM(SocketNsocksPerThread, "NSOCKS_PERTHREAD", -2);
 NCCL_PARAM(SocketNthreads, "SOCKET_NTHREADS", -2);
+// [RCCL] Send with MSG_ZEROCOPY above the threshold, and coalesce the size
+// header with the payload when it goes over the control socket
+RCCL_PARAM(SocketZeroCopy, "SOCKET_ZEROCOPY", 0);
+RCCL_PARAM(SocketZeroCopyThreshold, "SOCKET_ZEROCOPY_THRESHOLD", 65536);
+// [RCCL] Messages up to this size are framed with their size header over the control
+// socket, instead of exchanging the size first. Chosen by the receiver. 0 disables.
+RCCL_PARAM(SocketInlineThreshold, "SOCKET_INLINE_THRESHOLD", 0);
+// [RCCL] Tune the number of sockets a message is striped across, and the chunk size,
+// from the throughput of the first large transfers. Chosen by the receiver.
+RCCL_PARAM(SocketAdaptive, "SOCKET_ADAPTIVE", 0);
+// [/RCCL]
+
+// [RCCL] Adaptive striping. The sender tries stripe counts nSocks, nSocks/2, ..., 1 in
+// turn on messages large enough to use all sockets, keeps the fastest (fewer stripes
+// unless more is 5% faster), and derives the minimum chunk size from the per-socket
+// throughput so that a chunk keeps a socket busy for ADAPTIVE_TASK_US at least.
+// The chunk size of each message travels in its header.
+#define ADAPTIVE_MAX_CANDIDATES 7 // log2(MAX_SOCKETS)+1
+#define ADAPTIVE_SAMPLES 4
+#define ADAPTIVE_TASK_US 50
+#define ADAPTIVE_MIN_CHUNKSIZE (16*1024)
+#define ADAPTIVE_MAX_CHUNKSIZE (4*1024*1024)
+
+struct ncclSocketAdaptive {
+  int enabled;
+  int calibrated;
+  int stripes;
+  int minChunk;
+  double socketBw; // bytes/us
+  int nCandidates;
+  int nextCandidate;
+  int samples[ADAPTIVE_MAX_CANDIDATES];
+  double bw[ADAPTIVE_MAX_CANDIDATES]; // Sum of the message throughputs, bytes/us
+};
+// [/RCCL]
 
 struct ncclSocketHandle {
   union socketAddress connectAddr;
-  int nSocks;
-  int nThreads;
+  uint8_t nSocks;
+  uint8_t nThreads;
+  uint8_t adaptive;
+  uint8_t nRails; // [RCCL] Multi-rail : connectAddr is the first rail
+  int inlineSize;
+  // [RCCL] Multi-rail : speed of each rail relative to the fastest, and listen address of the other rails
+  uint8_t railWeights[MAX_RAILS];
+  uint32_t railIps[MAX_RAILS-1];
+  uint16_t railPorts[MAX_RAILS-1];
+  // [/RCCL]
 };
 
 struct ncclSocketTask {
@@ -129,10 +234,17 @@ struct ncclSocketTask {
   void* data;
   int size;
   int fd;
+  int fdIdx; // Index of the socket among those of the helper thread
   union socketAddress *addr;
-  int offset;
+  int offset; // Set to size once the task completed
+  int sent;   // Bytes handed to the kernel so far
+  uint32_t zcLast; // Last zero-copy send of the task
   int used;
   ncclResult_t result;
+  // [RCCL] io_uring engine
+  int bufIndex; // Registered buffer holding data, or -1
+  struct ncclSocketRequest* req; // Request whose size header this task receives
+  // [/RCCL]
 };
 
 struct ncclSocketRequest {
@@ -146,28 +258,61 @@ struct ncclSocketRequest {
   struct ncclSocketComm* comm;
   struct ncclSocketTask* tasks[MAX_SOCKETS];
   int nSubs;
+  uint32_t zcLast;
+  int hdr[2];    // Size, and chunk size in adaptive mode
+  int candidate; // Adaptive calibration : stripe candidate measured by this message
+  double startUs;
+  int bufIndex; // [RCCL] io_uring registered buffer holding data, or -1
 };
 
 struct ncclSocketTaskQueue {
   int next;
   int len;
+  uint64_t posted; // Number of tasks posted so far
   struct ncclSocketTask* tasks;
 };
 
+// Tasks of a socket, in posting order. A request has at most one task per socket.
+struct ncclSocketFdState {
+  int fd;
+  int ready; // Cleared when the socket would block, set again by epoll
+  int head;
+  int count;
+  struct ncclSocketTask* tasks[MAX_REQUESTS];
+  // Zero-copy sends : tasks fully sent, waiting for the kernel to release their buffer
+  uint32_t zcSent;
+  uint32_t zcCompleted;
+  int zcCheck; // The error queue may hold completions
+  int zcHead;
+  int zcCount;
+  struct ncclSocketTask* zcTasks[MAX_REQUESTS];
+};
+
 enum threadState {start, stop};
 
 struct ncclSocketThreadResources {
   struct ncclSocketTaskQueue threadTaskQueue;
   enum threadState state;
   struct ncclSocketComm* comm;
-  pthread_mutex_t threadLock;
-  pthread_cond_t  threadCond;
+  int epollFd;
+  int eventFd;  // Wakes up the thread on new tasks or stop
+  int sleeping; // Set while the thread waits with no socket ready to progress
+  int nFds;
+  struct ncclSocketFdState* fdStates;
+  struct ncclSocketStats stats;
 };
 
 struct ncclSocketListenComm {
   int fd;
   int nSocks;
   int nThreads;
+  int inlineSize;
+  int adaptive;
+  // [RCCL] Multi-rail
+  int nRails;
+  int railFds[MAX_RAILS]; // railFds[0] is fd
+  int railWeights[MAX_RAILS];
+  // [/RCCL]
 };
 
 struct ncclSocketComm {
@@ -177,47 +322,287 @@ struct ncclSocketComm {
   int nSocks;
   int nThreads;
   int nextFd;
+  int zeroCopy;
+  int zcThreshold;
+  uint32_t ctrlZcSent;
+  uint32_t ctrlZcCompleted;
+  int inlineSize;
+  // Receive stash of the control socket, used when framing (inlineSize > 0)
+  char* rxBuf;
+  int rxSize;
+  int rxStart;
+  int rxEnd;
+  int hdrSize;
+  struct ncclSocketAdaptive adaptive;
+  // [RCCL] Multi-rail : share of the payload of each socket, out of totalWeight. 0 splits evenly.
+  int nRails;
+  int totalWeight;
+  int weights[MAX_SOCKETS];
+  // [/RCCL]
+  struct ncclSocketStats stats; // Main thread
+  struct ncclSocketUring* uring; // [RCCL] io_uring engine, NULL with helper threads
+  struct ncclProxyWakeup* proxyWakeup; // [RCCL] Signaled by helper threads when a task completes
   struct ncclSocketRequest requests[MAX_REQUESTS];
   pthread_t helperThread[MAX_THREADS];
   struct ncclSocketThreadResources threadResources[MAX_THREADS];
 };
 
+/* Same as socketProgress, over up to two buffers and with a single sendmsg/recvmsg
+ * per call. With zcSent set, sends use MSG_ZEROCOPY and count the calls issued :
+ * the kernel reports their completion in order on the socket error queue.
+ */
+static ncclResult_t ncclSocketProgressIov(int op, int fd, union socketAddress* addr, struct iovec* iov, int iovcnt,
+    int* offset, uint32_t* zcSent, struct ncclSocketStats* stats) {
+  char line[SOCKET_NAME_MAXLEN+1];
+  int total = 0;
+  for (int i=0; i<iovcnt; i++) total += iov[i].iov_len;
+  while (*offset < total) {
+    // Skip what was already transferred
+    struct iovec vec[2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    for (int i=0, skip=*offset; i<iovcnt; i++) {
+      if (skip >= (int)iov[i].iov_len) {
+        skip -= iov[i].iov_len;
+        continue;
+      }
+      vec[msg.msg_iovlen].iov_base = (char*)iov[i].iov_base+skip;
+      vec[msg.msg_iovlen].iov_len = iov[i].iov_len-skip;
+      msg.msg_iovlen++;
+      skip = 0;
+    }
+    ssize_t bytes;
+    if (op == NCCL_SOCKET_RECV) {
+      bytes = recvmsg(fd, &msg, MSG_DONTWAIT);
+      stats->recvCalls++;
+      if (bytes == 0) {
+        WARN("Net : Connection closed by remote peer %s", socketToString(addr, line));
+        return ncclSystemError;
+      }
+    } else {
+      bytes = sendmsg(fd, &msg, MSG_DONTWAIT | (zcSent ? MSG_ZEROCOPY : 0));
+      stats->sendCalls++;
+    }
+    if (bytes == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EWOULDBLOCK || errno == EAGAIN) break;
+      if (errno == ENOBUFS && zcSent) { // Out of memory to pin pages, copy instead
+        zcSent = NULL;
+        continue;
+      }
+      WARN("Net : Call to %s %s failed : %s", op == NCCL_SOCKET_RECV ? "recvmsg from" : "sendmsg to", socketToString(addr, line), strerror(errno));
+      return ncclSystemError;
+    }
+    if (zcSent) {
+      (*zcSent)++;
+      stats->zcCalls++;
+      stats->zcBytes += bytes;
+    }
+    *offset += bytes;
+  }
+  return ncclSuccess;
+}
+
+// Sends or receives a buffer through socketProgress as usual, or through sendmsg/recvmsg when the
+// zero-copy mode is enabled
+static ncclResult_t ncclSocketProgressBuf(int zeroCopy, int op, int fd, union socketAddress* addr, void* data, int size,
+    int* offset, uint32_t* zcSent, struct ncclSocketStats* stats) {
+  if (zeroCopy == 0) {
+    return socketProgressOpt(op, fd, addr, data, size, offset, 0, op == NCCL_SOCKET_RECV ? &stats->recvCalls : &stats->sendCalls);
+  }
+  struct iovec iov = { data, (size_t)size };
+  return ncclSocketProgressIov(op, fd, addr, &iov, 1, offset, zcSent, stats);
+}
+
+// Reads zero-copy completions from the socket error queue
+static ncclResult_t ncclSocketZeroCopyPoll(int fd, union socketAddress* addr, uint32_t zcSent, uint32_t* zcCompleted, struct ncclSocketStats* stats) {
+  char line[SOCKET_NAME_MAXLEN+1];
+  while (*zcCompleted != zcSent) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    stats->errqueueCalls++;
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) == -1) {
+      if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) return ncclSuccess;
+      WARN("Net : Reading error queue of %s failed : %s", socketToString(addr, line), strerror(errno));
+      return ncclSystemError;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) &&
+          (cmsg->cmsg_level != SOL_IPV6 || cmsg->cmsg_type != IPV6_RECVERR)) continue;
+      struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        WARN("Net : Unexpected error on %s : %s", socketToString(addr, line), strerror(err->ee_errno));
+        return ncclSystemError;
+      }
+      // Completions of sends [ee_info, ee_data]
+      uint32_t count = err->ee_data - err->ee_info + 1;
+      *zcCompleted += count;
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) stats->zcCopied += count;
+    }
+  }
+  return ncclSuccess;
+}
+
+// Whether the zero-copy send number last has completed
+static bool ncclSocketZeroCopyDone(uint32_t completed, uint32_t last) {
+  return (int32_t)(completed - last) > 0;
+}
+
+/* Helper thread driving the sockets fds[tid], fds[tid+nThreads], ... of a comm.
+ * Sockets are registered edge-triggered with epoll : a socket is progressed until
+ * it would block, then left alone until epoll reports it ready again. Each pass
+ * progresses at most one task per socket so that all sockets are served fairly.
+ */
 void* persistentSocketThread(void *args_) {
   struct ncclSocketThreadResources* resource = (struct ncclSocketThreadResources*)args_;
   struct ncclSocketComm* comm = resource->comm;
   volatile enum threadState* state = &resource->state;
   struct ncclSocketTaskQueue* myQueue = &resource->threadTaskQueue;
-  int nSocksPerThread = comm->nSocks / comm->nThreads;
-  while (1) {
-    int idle = 1;
-    int mark = myQueue->next; // mark newest task seen
-    for (int i=0; i<myQueue->len; i+=nSocksPerThread) {
-      int repeat;
-      do {
-        repeat = 0;
-        for (int j=0; j<nSocksPerThread; j++) {
-          struct ncclSocketTask* r = myQueue->tasks+i+j;
-          if (r != NULL && r->used == 1 && r->offset < r->size) {
-            r->result = socketProgress(r->op, r->fd, r->addr, r->data, r->size, &r->offset);
-            if (r->result != ncclSuccess) {
-              WARN("NET/Socket : socket progress error");
-              return NULL;
-            }
-            idle = 0;
-            if (r->offset < r->size) repeat = 1;
+  struct ncclSocketFdState* fdStates = resource->fdStates;
+  int nFds = resource->nFds;
+  struct epoll_event events[MAX_SOCKETS+1];
+  uint64_t seen = 0;
+  int slot = 0;
+  while (*state != stop) {
+    // Pick up new tasks
+    uint64_t posted = __atomic_load_n(&myQueue->posted, __ATOMIC_ACQUIRE);
+    for (; seen < posted; seen++, slot = (slot+1)%myQueue->len) {
+      struct ncclSocketTask* r = myQueue->tasks+slot;
+      struct ncclSocketFdState* s = fdStates+r->fdIdx;
+      s->tasks[(s->head+s->count)%MAX_REQUESTS] = r;
+      s->count++;
+    }
+
+    int active = 0, waiting = 0, zcWaiting = 0;
+    for (int i=0; i<nFds; i++) {
+      struct ncclSocketFdState* s = fdStates+i;
+      if (s->zcCount && s->zcCheck) {
+        s->zcCheck = 0;
+        ncclResult_t res = ncclSocketZeroCopyPoll(s->fd, s->zcTasks[s->zcHead]->addr, s->zcSent, &s->zcCompleted, &resource->stats);
+        if (res != ncclSuccess) {
+          s->zcTasks[s->zcHead]->result = res;
+          return NULL;
+        }
+        while (s->zcCount && ncclSocketZeroCopyDone(s->zcCompleted, s->zcTasks[s->zcHead]->zcLast)) {
+          struct ncclSocketTask* r = s->zcTasks[s->zcHead];
+          __atomic_store_n(&r->offset, r->size, __ATOMIC_RELEASE);
+          s->zcHead = (s->zcHead+1)%MAX_REQUESTS;
+          s->zcCount--;
+          ncclProxyWakeupSignal(__atomic_load_n(&comm->proxyWakeup, __ATOMIC_RELAXED));
+        }
+      }
+      if (s->zcCount) zcWaiting = 1;
+      if (s->count == 0) continue;
+      if (s->ready) {
+        struct ncclSocketTask* r = s->tasks[s->head];
+        int zc = comm->zeroCopy && r->op == NCCL_SOCKET_SEND && r->size >= comm->zcThreshold;
+        ncclResult_t res = ncclSocketProgressBuf(comm->zeroCopy, r->op, s->fd, r->addr, r->data, r->size, &r->sent, zc ? &s->zcSent : NULL, &resource->stats);
+        if (res != ncclSuccess) {
+          r->result = res;
+          WARN("NET/Socket : socket progress error");
+          return NULL;
+        }
+        if (r->sent < r->size) {
+          s->ready = 0;
+        } else {
+          s->head = (s->head+1)%MAX_REQUESTS;
+          s->count--;
+          if (zc) { // The buffer stays in use until the kernel releases it
+            r->zcLast = s->zcSent-1;
+            s->zcTasks[(s->zcHead+s->zcCount)%MAX_REQUESTS] = r;
+            s->zcCount++;
+            zcWaiting = 1;
+          } else {
+            __atomic_store_n(&r->offset, r->size, __ATOMIC_RELEASE);
+            ncclProxyWakeupSignal(__atomic_load_n(&comm->proxyWakeup, __ATOMIC_RELAXED));
           }
         }
-      } while (repeat);
+      }
+      if (s->count == 0) continue;
+      if (s->ready) active = 1;
+      else waiting = 1;
+    }
+
+    int timeout = 0;
+    if (active == 0) {
+      // Nothing to progress : sleep until a socket becomes ready or a task is posted
+      __atomic_store_n(&resource->sleeping, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&myQueue->posted, __ATOMIC_SEQ_CST) != seen || *state == stop) {
+        __atomic_store_n(&resource->sleeping, 0, __ATOMIC_SEQ_CST);
+        continue;
+      }
+      // Completions are signaled with EPOLLERR, but check the error queue once in a while anyway
+      timeout = zcWaiting ? 1 : -1;
+    } else if (waiting == 0 && zcWaiting == 0) {
+      continue;
+    }
+    int nEvents = epoll_wait(resource->epollFd, events, nFds+1, timeout);
+    if (timeout != 0) __atomic_store_n(&resource->sleeping, 0, __ATOMIC_SEQ_CST);
+    if (nEvents == 0 && zcWaiting) {
+      for (int i=0; i<nFds; i++) fdStates[i].zcCheck = 1;
     }
-    if (idle) {
-      pthread_mutex_lock(&resource->threadLock);
-      while (mark == myQueue->next && *state != stop) { // no new tasks, wait
-        pthread_cond_wait(&resource->threadCond, &resource->threadLock);
+    if (nEvents == -1 && errno != EINTR) {
+      WARN("NET/Socket : epoll_wait failed : %s", strerror(errno));
+      return NULL;
+    }
+    for (int e=0; e<nEvents; e++) {
+      int idx = events[e].data.u32;
+      if (idx == nFds) {
+        uint64_t count;
+        if (read(resource->eventFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+          WARN("NET/Socket : eventfd read failed : %s", strerror(errno));
+          return NULL;
+        }
+      } else {
+        // Errors and hangups also mark the socket ready, so that progress reports them
+        fdStates[idx].ready = 1;
+        if (events[e].events & EPOLLERR) fdStates[idx].zcCheck = 1;
       }
-      pthread_mutex_unlock(&resource->threadLock);
     }
-    if (*state == stop) return NULL;
   }
+  return NULL;
+}
+
+static ncclResult_t ncclSocketWakeThread(struct ncclSocketThreadResources* res) {
+  uint64_t one = 1;
+  SYSCHECK(write(res->eventFd, &one, sizeof(one)), "write");
+  return ncclSuccess;
+}
+
+// Creates the helper thread tid, watching the sockets it progresses with epoll
+static ncclResult_t ncclSocketCreateThread(struct ncclSocketComm* comm, int tid) {
+  struct ncclSocketThreadResources* resource = comm->threadResources+tid;
+  struct ncclSocketTaskQueue* queue = &resource->threadTaskQueue;
+  // each request can be divided up to nSocks tasks, and
+  // these tasks are distributed to nThreads threads,
+  // we need to make sure each thread queue has enough slots for MAX_REQUESTS
+  queue->len = MAX_REQUESTS * DIVUP(comm->nSocks, comm->nThreads);
+  NCCLCHECK(ncclCalloc(&queue->tasks, queue->len));
+  queue->next = 0;
+  queue->posted = 0;
+  resource->comm = comm;
+  resource->state = start;
+  resource->nFds = DIVUP(comm->nSocks-tid, comm->nThreads);
+  NCCLCHECK(ncclCalloc(&resource->fdStates, resource->nFds));
+  SYSCHECKVAL(epoll_create1(EPOLL_CLOEXEC), "epoll_create1", resource->epollFd);
+  SYSCHECKVAL(eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC), "eventfd", resource->eventFd);
+  struct epoll_event ev;
+  for (int i=0; i<resource->nFds; i++) {
+    resource->fdStates[i].fd = comm->fds[tid+i*comm->nThreads];
+    resource->fdStates[i].ready = 1;
+    ev.events = EPOLLIN|EPOLLOUT|EPOLLET;
+    ev.data.u32 = i;
+    SYSCHECK(epoll_ctl(resource->epollFd, EPOLL_CTL_ADD, resource->fdStates[i].fd, &ev), "epoll_ctl");
+  }
+  ev.events = EPOLLIN;
+  ev.data.u32 = resource->nFds;
+  SYSCHECK(epoll_ctl(resource->epollFd, EPOLL_CTL_ADD, resource->eventFd, &ev), "epoll_ctl");
+  pthread_create(comm->helperThread+tid, NULL, persistentSocketThread, resource);
+  return ncclSuccess;
 }
 
 ncclResult_t ncclSocketGetNsockNthread(int dev, int* ns, int* nt) {
@@ -254,6 +639,10 @@ ncclResult_t ncclSocketGetNsockNthread(int dev, int* ns, int* nt) {
       autoNs = 1;
     }
 end:
+    if (rcclParamSocketAdaptive() && autoNt == 0) { // [RCCL] Give adaptive striping sockets to choose from
+      autoNt = 4;
+      autoNs = 2;
+    }
     if (nThreads == -2) nThreads = autoNt;
     if (nSocksPerThread == -2) nSocksPerThread = autoNs;
   }
@@ -269,9 +658,103 @@ end:
   return ncclSuccess;
 }
 
+// [RCCL]
+static double ncclSocketTimeUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e6 + ts.tv_nsec*1e-3;
+}
+
+static ncclResult_t ncclSocketAdaptiveInit(struct ncclSocketComm* comm, int adaptive) {
+  struct ncclSocketAdaptive* a = &comm->adaptive;
+  a->enabled = adaptive;
+  a->stripes = comm->nSocks;
+  a->minChunk = MIN_CHUNKSIZE;
+  a->nCandidates = comm->nSocks ? std::min((int)log2i(comm->nSocks)+1, ADAPTIVE_MAX_CANDIDATES) : 0;
+  comm->hdrSize = adaptive ? 2*sizeof(int) : sizeof(int);
+  return ncclSuccess;
+}
+
+// Chunk size of a message about to be sent, and the calibration candidate it measures
+static int ncclSocketChunkSize(struct ncclSocketComm* comm, int size, int* candidate) {
+  struct ncclSocketAdaptive* a = &comm->adaptive;
+  *candidate = -1;
+  if (a->enabled == 0) return 0;
+  if (a->calibrated == 0 && size >= comm->nSocks*MIN_CHUNKSIZE) {
+    *candidate = a->nextCandidate;
+    a->nextCandidate = (a->nextCandidate+1) % a->nCandidates;
+    return DIVUP(size, std::max(1, comm->nSocks >> *candidate));
+  }
+  return std::max(a->minChunk, DIVUP(size, a->stripes));
+}
+
+static void ncclSocketAdaptiveUpdate(struct ncclSocketComm* comm, struct ncclSocketRequest* r) {
+  struct ncclSocketAdaptive* a = &comm->adaptive;
+  if (r->candidate == -1 || a->calibrated) return;
+  // The first sample of each candidate also pays for connection and thread warm up
+  if (a->samples[r->candidate]++ > 0) a->bw[r->candidate] += r->size / (ncclSocketTimeUs() - r->startUs);
+  for (int c=0; c<a->nCandidates; c++) if (a->samples[c] <= ADAPTIVE_SAMPLES) return;
+
+  int best = a->nCandidates-1;
+  for (int c=a->nCandidates-2; c>=0; c--) {
+    if (a->bw[c] > a->bw[best]*1.05) best = c;
+  }
+  a->stripes = std::max(1, comm->nSocks >> best);
+  a->socketBw = a->bw[best] / ADAPTIVE_SAMPLES / a->stripes;
+  int minChunk = ADAPTIVE_MIN_CHUNKSIZE;
+  while (minChunk < ADAPTIVE_MAX_CHUNKSIZE && minChunk < a->socketBw*ADAPTIVE_TASK_US) minChunk *= 2;
+  a->minChunk = minChunk;
+  a->calibrated = 1;
+  char line[SOCKET_NAME_MAXLEN+1];
+  INFO(NCCL_NET, "NET/Socket : %s : striping over %d/%d sockets, min chunk size %d (%.2f GB/s per socket)",
+      socketToString(&comm->addr, line), a->stripes, comm->nSocks, a->minChunk, a->socketBw/1e3);
+}
+
+ncclResult_t ncclSocketGetTuning(void* opaqueComm, struct ncclSocketTuning* tuning) {
+  struct ncclSocketComm* comm = (struct ncclSocketComm*)opaqueComm;
+  struct ncclSocketAdaptive* a = &comm->adaptive;
+  tuning->nSocks = comm->nSocks;
+  tuning->nThreads = comm->nThreads;
+  tuning->nRails = comm->nRails;
+  tuning->adaptive = a->enabled;
+  tuning->calibrated = a->calibrated;
+  tuning->stripes = a->stripes;
+  tuning->minChunkSize = a->minChunk;
+  tuning->socketBw = a->socketBw*1e6;
+  return ncclSuccess;
+}
+// [/RCCL]
+
+// [RCCL] Multi-rail. Socket i goes over rail i%nRails, the control socket over the first rail.
+static int ncclSocketRail(struct ncclSocketComm* comm, int i) {
+  return i == comm->nSocks ? 0 : i % comm->nRails;
+}
+
+static void ncclSocketSetWeights(struct ncclSocketComm* comm, int nRails, int* railWeights) {
+  comm->nRails = nRails;
+  comm->totalWeight = 0;
+  if (nRails <= 1) return;
+  // Rails get a share of the payload proportional to their speed, whatever their number of sockets
+  int railSocks[MAX_RAILS] = { 0 };
+  for (int i=0; i<comm->nSocks; i++) railSocks[ncclSocketRail(comm, i)]++;
+  for (int i=0; i<comm->nSocks; i++) {
+    int rail = ncclSocketRail(comm, i);
+    comm->weights[i] = railWeights[rail]*MAX_SOCKETS/railSocks[rail];
+    comm->totalWeight += comm->weights[i];
+  }
+}
+
+// Size of the next chunk of a message, which goes on socket nextFd
+static int ncclSocketTaskSize(struct ncclSocketComm* comm, int size, int taskSize) {
+  if (comm->totalWeight == 0) return taskSize;
+  return std::max((int64_t)MIN_CHUNKSIZE, DIVUP((int64_t)size*comm->weights[comm->nextFd], comm->totalWeight));
+}
+// [/RCCL]
+
 ncclResult_t ncclSocketNewListenComm(struct ncclSocketListenComm** comm) {
   NCCLCHECK(ncclCalloc(comm, 1));
   (*comm)->fd = -1;
+  for (int r=0; r<MAX_RAILS; r++) (*comm)->railFds[r] = -1; // [RCCL]
   return ncclSuccess;
 }
 
@@ -296,8 +779,29 @@ ncclResult_t ncclSocketListen(int dev, void* opaqueHandle, void** listenComm) {
   NCCLCHECK(GetSocketAddr(dev, &handle->connectAddr));
   NCCLCHECK(createListenSocket(&comm->fd, &handle->connectAddr));
   NCCLCHECK(ncclSocketGetNsockNthread(dev, &comm->nSocks, &comm->nThreads));
+  // [RCCL] Multi-rail : listen on every rail, with at least one socket per rail
+  comm->nRails = std::max(1, ncclSocketNRails);
+  comm->railFds[0] = comm->fd;
+  if (comm->nRails > 1 && comm->nSocks < comm->nRails) {
+    comm->nSocks = comm->nThreads = comm->nRails;
+    INFO(NCCL_INIT|NCCL_NET, "NET/Socket : Using %d threads and 1 socket per thread for %d rails", comm->nThreads, comm->nRails);
+  }
+  int maxSpeed = 0;
+  for (int r=0; r<comm->nRails; r++) maxSpeed = std::max(maxSpeed, ncclSocketRailSpeeds[r]);
+  for (int r=0; r<comm->nRails; r++) {
+    comm->railWeights[r] = handle->railWeights[r] = comm->nRails > 1 ? std::max(1, ncclSocketRailSpeeds[r]*255/maxSpeed) : 1;
+    if (r == 0) continue;
+    union socketAddress addr = ncclSocketDevs[r].addr;
+    NCCLCHECK(createListenSocket(comm->railFds+r, &addr));
+    handle->railIps[r-1] = addr.sin.sin_addr.s_addr;
+    handle->railPorts[r-1] = addr.sin.sin_port;
+  }
+  handle->nRails = comm->nRails;
+  // [/RCCL]
   handle->nSocks = comm->nSocks;
   handle->nThreads = comm->nThreads;
+  handle->inlineSize = comm->inlineSize = std::max(0, (int)rcclParamSocketInlineThreshold()); // [RCCL]
+  handle->adaptive = comm->adaptive = rcclParamSocketAdaptive() && comm->nSocks > 0 && comm->nRails == 1; // [RCCL]
   *listenComm = comm;
   return ncclSuccess;
 }
@@ -311,15 +815,40 @@ ncclResult_t ncclSocketConnect(int dev, void* opaqueHandle, void** sendComm) {
   struct ncclSocketHandle* handle = (struct ncclSocketHandle*) opaqueHandle;
   comm->nSocks = handle->nSocks;
   comm->nThreads = handle->nThreads;
+  comm->inlineSize = handle->inlineSize;
+  NCCLCHECK(ncclSocketAdaptiveInit(comm, handle->adaptive));
+  int railWeights[MAX_RAILS]; // [RCCL]
+  for (int r=0; r<handle->nRails; r++) railWeights[r] = handle->railWeights[r];
+  ncclSocketSetWeights(comm, handle->nRails, railWeights);
   for (int i=0; i<comm->nSocks+1; i++) {
     int tmpFd, offset=0;
-    NCCLCHECK(connectAddress(&tmpFd, &handle->connectAddr));
-    NCCLCHECK(socketWait(NCCL_SOCKET_SEND, tmpFd, &handle->connectAddr, &i, sizeof(int), &offset));
+    union socketAddress addr = handle->connectAddr;
+    int rail = ncclSocketRail(comm, i);
+    if (rail > 0) { // [RCCL] Routed through the local interface of the rail subnet
+      addr.sin.sin_addr.s_addr = handle->railIps[rail-1];
+      addr.sin.sin_port = handle->railPorts[rail-1];
+    }
+    NCCLCHECK(connectAddress(&tmpFd, &addr));
+    NCCLCHECK(socketWait(NCCL_SOCKET_SEND, tmpFd, &addr, &i, sizeof(int), &offset));
     if (i == comm->nSocks) comm->ctrlFd = tmpFd;
     else comm->fds[i] = tmpFd;
   }
   *sendComm = comm;
   comm->addr = handle->connectAddr;
+  // [RCCL]
+  if (rcclParamSocketZeroCopy()) {
+    int one = 1;
+    comm->zeroCopy = 1;
+    comm->zcThreshold = rcclParamSocketZeroCopyThreshold();
+    for (int i=0; i<comm->nSocks+1 && comm->zeroCopy; i++) {
+      int fd = i == comm->nSocks ? comm->ctrlFd : comm->fds[i];
+      if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        INFO(NCCL_NET, "NET/Socket : SO_ZEROCOPY not supported (%s), using regular sends", strerror(errno));
+        comm->zeroCopy = 0;
+      }
+    }
+  }
+  // [/RCCL]
   return ncclSuccess;
 }
 
@@ -329,10 +858,18 @@ ncclResult_t ncclSocketAccept(void* listenComm, void** recvComm) {
   NCCLCHECK(ncclSocketNewComm(&rComm));
   rComm->nSocks = lComm->nSocks;
   rComm->nThreads = lComm->nThreads;
+  rComm->inlineSize = lComm->inlineSize;
+  NCCLCHECK(ncclSocketAdaptiveInit(rComm, lComm->adaptive));
+  if (rComm->inlineSize > 0) { // [RCCL] Room for two inline messages
+    rComm->rxSize = 2*(rComm->inlineSize+rComm->hdrSize);
+    NCCLCHECK(ncclCalloc(&rComm->rxBuf, rComm->rxSize));
+  }
+  ncclSocketSetWeights(rComm, lComm->nRails, lComm->railWeights); // [RCCL]
   for (int i=0; i<rComm->nSocks+1; i++) {
     int tmpFd, sendSockIdx, offset=0;
     socklen_t socklen = sizeof(union socketAddress);
-    SYSCHECKVAL(accept(lComm->fd, &rComm->addr.sa, &socklen), "accept", tmpFd);
+    // [RCCL] Connections come in order, so socket i is waiting on the listen socket of its rail
+    SYSCHECKVAL(accept(lComm->railFds[ncclSocketRail(rComm, i)], &rComm->addr.sa, &socklen), "accept", tmpFd);
     NCCLCHECK(socketWait(NCCL_SOCKET_RECV, tmpFd, &rComm->addr, &sendSockIdx, sizeof(int), &offset));
     if (sendSockIdx == rComm->nSocks) rComm->ctrlFd = tmpFd;
     else rComm->fds[sendSockIdx] = tmpFd;
@@ -353,6 +890,9 @@ ncclResult_t ncclSocketGetRequest(struct ncclSocketComm* comm, int op, void* dat
       r->used = 1;
       r->comm = comm;
       r->nSubs = 0;
+      r->offset = 0;
+      r->hdr[0] = size;
+      r->hdr[1] = op == NCCL_SOCKET_SEND ? ncclSocketChunkSize(comm, size, &r->candidate) : 0;
       *req = r;
       return ncclSuccess;
     }
@@ -366,41 +906,80 @@ ncclResult_t ncclSocketGetTask(struct ncclSocketComm* comm, int op, void* data,
   struct ncclSocketThreadResources* res = comm->threadResources+tid;
   struct ncclSocketTaskQueue* queue = &res->threadTaskQueue;
   // create helper threads and prepare per-thread task queue
-  if (queue->tasks == NULL) {
-    // each request can be divided up to nSocks tasks, and
-    // these tasks are distributed to nThreads threads,
-    // we need to make sure each thread queue has enough slots for MAX_REQUESTS
-    queue->len = MAX_REQUESTS * DIVUP(comm->nSocks, comm->nThreads);
-    NCCLCHECK(ncclCalloc(&queue->tasks, queue->len));
-    queue->next = 0;
-    res->comm = comm;
-    pthread_mutex_init(&res->threadLock, NULL);
-    pthread_cond_init(&res->threadCond, NULL);
-    pthread_create(comm->helperThread+tid, NULL, persistentSocketThread, res);
-  }
+  if (queue->tasks == NULL) NCCLCHECK(ncclSocketCreateThread(comm, tid));
   struct ncclSocketTask* r = queue->tasks+queue->next;
   if (r->used == 0) {
     r->op = op;
     r->data = data;
     r->size = size;
     r->fd = comm->fds[comm->nextFd];
+    r->fdIdx = comm->nextFd / comm->nThreads;
     r->addr = &comm->addr;
     r->offset = 0;
+    r->sent = 0;
     r->result = ncclSuccess;
     comm->nextFd = (comm->nextFd + 1) % comm->nSocks;
     r->used = 1;
     *req = r;
-    pthread_mutex_lock(&res->threadLock);
     queue->next = (queue->next+1)%queue->len;
-    res->state = start;
-    pthread_cond_signal(&res->threadCond);
-    pthread_mutex_unlock(&res->threadLock);
+    __atomic_store_n(&queue->posted, queue->posted+1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&res->sleeping, __ATOMIC_SEQ_CST)) NCCLCHECK(ncclSocketWakeThread(comm->threadResources+tid));
     return ncclSuccess;
   }
   WARN("NET/Socket : unable to allocate subtasks");
   return ncclInternalError;
 }
 
+// [RCCL] Reads whatever the control socket has into the stash, with a single recv
+static ncclResult_t ncclSocketFillStash(struct ncclSocketComm* comm) {
+  char line[SOCKET_NAME_MAXLEN+1];
+  if (comm->rxStart > 0) {
+    memmove(comm->rxBuf, comm->rxBuf+comm->rxStart, comm->rxEnd-comm->rxStart);
+    comm->rxEnd -= comm->rxStart;
+    comm->rxStart = 0;
+  }
+  if (comm->rxEnd == comm->rxSize) return ncclSuccess;
+  ssize_t bytes = recv(comm->ctrlFd, comm->rxBuf+comm->rxEnd, comm->rxSize-comm->rxEnd, MSG_DONTWAIT);
+  comm->stats.recvCalls++;
+  if (bytes == 0) {
+    WARN("Net : Connection closed by remote peer %s", socketToString(&comm->addr, line));
+    return ncclSystemError;
+  }
+  if (bytes == -1) {
+    if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) return ncclSuccess;
+    WARN("Net : Call to recv from %s failed : %s", socketToString(&comm->addr, line), strerror(errno));
+    return ncclSystemError;
+  }
+  comm->rxEnd += bytes;
+  return ncclSuccess;
+}
+
+// Gets the size header of a framed message from the stash. Inline messages are copied
+// out right away and *inlined is set. *data is -1 if the message is not there yet.
+static ncclResult_t ncclSocketRecvFramed(struct ncclSocketComm* comm, struct ncclSocketRequest* r, int* hdr, int* inlined) {
+  hdr[0] = -1;
+  *inlined = 0;
+  if (comm->rxEnd-comm->rxStart < comm->hdrSize) NCCLCHECK(ncclSocketFillStash(comm));
+  if (comm->rxEnd-comm->rxStart < comm->hdrSize) return ncclSuccess;
+  int msgSize;
+  memcpy(&msgSize, comm->rxBuf+comm->rxStart, sizeof(int));
+  if (msgSize > r->size) {
+    char line[SOCKET_NAME_MAXLEN+1];
+    WARN("NET/Socket : peer %s message truncated : receiving %d bytes instead of %d", socketToString(r->addr, line), msgSize, r->size);
+    return ncclInternalError;
+  }
+  if (msgSize <= comm->inlineSize) {
+    if (comm->rxEnd-comm->rxStart < comm->hdrSize+msgSize) NCCLCHECK(ncclSocketFillStash(comm));
+    if (comm->rxEnd-comm->rxStart < comm->hdrSize+msgSize) return ncclSuccess;
+    memcpy(r->data, comm->rxBuf+comm->rxStart+comm->hdrSize, msgSize);
+    *inlined = 1;
+  }
+  memcpy(hdr, comm->rxBuf+comm->rxStart, comm->hdrSize);
+  comm->rxStart += comm->hdrSize + (*inlined ? msgSize : 0);
+  return ncclSuccess;
+}
+// [/RCCL]
+
 ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
   *done = 0;
   struct ncclSocketRequest *r = (struct ncclSocketRequest*)request;
@@ -408,15 +987,54 @@ ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
     WARN("NET/Socket : test called with NULL request");
     return ncclInternalError;
   }
+  struct ncclSocketComm* comm = r->comm;
+  if (r->used == 1 && r->op == NCCL_SOCKET_SEND &&
+      ((comm->inlineSize && r->size <= comm->inlineSize) || (comm->zeroCopy && comm->nSocks == 0))) { // [RCCL]
+    // Size and payload go together over the control socket
+    struct iovec iov[2] = { { r->hdr, (size_t)comm->hdrSize }, { r->data, (size_t)r->size } };
+    int zc = comm->zeroCopy && r->size >= comm->zcThreshold;
+    NCCLCHECK(ncclSocketProgressIov(r->op, r->ctrlFd, r->addr, iov, 2, &r->offset, zc ? &comm->ctrlZcSent : NULL, &comm->stats));
+    if (r->offset < comm->hdrSize+r->size) return ncclSuccess;
+    if (zc == 0) {
+      if (size) *size = r->size;
+      *done = 1;
+      r->used = 0;
+      return ncclSuccess;
+    }
+    r->zcLast = comm->ctrlZcSent-1;
+    r->used = 3; // wait for the kernel to release the buffer
+  }
+  if (r->used == 3) {
+    NCCLCHECK(ncclSocketZeroCopyPoll(r->ctrlFd, r->addr, comm->ctrlZcSent, &comm->ctrlZcCompleted, &comm->stats));
+    if (ncclSocketZeroCopyDone(comm->ctrlZcCompleted, r->zcLast)) {
+      if (size) *size = r->size;
+      *done = 1;
+      r->used = 0;
+    }
+    return ncclSuccess;
+  } // [/RCCL]
   if (r->used == 1) { /* try to send/recv size */
-    int data = r->size;
-    int offset = 0;
-    NCCLCHECK(socketProgress(r->op, r->ctrlFd, r->addr, &data, sizeof(int), &offset));
+    int* hdr = r->hdr; // [RCCL] size, and chunk size in adaptive mode
+    int& data = hdr[0];
+    if (r->op == NCCL_SOCKET_RECV && comm->rxBuf) { // [RCCL]
+      int inlined;
+      NCCLCHECK(ncclSocketRecvFramed(comm, r, hdr, &inlined));
+      if (data == -1) return ncclSuccess; /* Not ready -- retry later */
+      if (inlined) {
+        if (size) *size = data;
+        *done = 1;
+        r->used = 0;
+        return ncclSuccess;
+      }
+    } else { // [/RCCL]
+      int offset = 0;
+      NCCLCHECK(ncclSocketProgressBuf(comm->zeroCopy, r->op, r->ctrlFd, r->addr, hdr, comm->hdrSize, &offset, NULL, &comm->stats));
 
-    if (offset == 0) return ncclSuccess; /* Not ready -- retry later */
+      if (offset == 0) return ncclSuccess; /* Not ready -- retry later */
 
-    // Not sure we could ever receive less than 4 bytes, but just in case ...
-    if (offset < sizeof(int)) NCCLCHECK(socketWait(r->op, r->ctrlFd, r->addr, &data, sizeof(int), &offset));
+      // Not sure we could ever receive less than 4 bytes, but just in case ...
+      if (offset < comm->hdrSize) NCCLCHECK(socketWait(r->op, r->ctrlFd, r->addr, hdr, comm->hdrSize, &offset));
+    }
 
     // Check size is less or equal to the size provided by the user
     if (r->op == NCCL_SOCKET_RECV && data > r->size) {
@@ -432,8 +1050,16 @@ ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
     if (r->comm->nSocks > 0) {
       // each request can be divided up to nSocks tasks
       int taskSize = std::max(MIN_CHUNKSIZE, DIVUP(r->size, r->comm->nSocks));
+      if (comm->adaptive.enabled) { // [RCCL] chunk size chosen by the sender
+        taskSize = hdr[1];
+        if (taskSize < DIVUP(r->size, comm->nSocks)) {
+          WARN("NET/Socket : invalid chunk size %d for a message of %d bytes over %d sockets", taskSize, r->size, comm->nSocks);
+          return ncclInternalError;
+        }
+        if (r->candidate != -1) r->startUs = ncclSocketTimeUs();
+      }
       while (chunkOffset < r->size) {
-        int chunkSize = std::min(taskSize, r->size-chunkOffset);
+        int chunkSize = std::min(ncclSocketTaskSize(comm, r->size, taskSize), r->size-chunkOffset);
         NCCLCHECK(ncclSocketGetTask(r->comm, r->op, (char*)(r->data)+chunkOffset, chunkSize, r->tasks+i++));
         chunkOffset += chunkSize;
       }
@@ -449,6 +1075,7 @@ ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
         if (sub->offset == sub->size) nCompleted++;
       }
       if (nCompleted == r->nSubs) {
+        if (r->op == NCCL_SOCKET_SEND) ncclSocketAdaptiveUpdate(comm, r); // [RCCL]
         if (size) *size = r->size;
         *done = 1;
         r->used = 0;
@@ -458,8 +1085,14 @@ ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
         }
       }
     } else { // progress request using main thread
+      if (r->offset < r->size && comm->rxEnd > comm->rxStart) { // [RCCL] Payload read along with the header
+        int bytes = std::min(r->size-r->offset, comm->rxEnd-comm->rxStart);
+        memcpy((char*)r->data+r->offset, comm->rxBuf+comm->rxStart, bytes);
+        comm->rxStart += bytes;
+        r->offset += bytes;
+      }
       if (r->offset < r->size) {
-        NCCLCHECK(socketProgress(r->op, r->ctrlFd, r->addr, r->data, r->size, &r->offset));
+        NCCLCHECK(ncclSocketProgressBuf(comm->zeroCopy, r->op, r->ctrlFd, r->addr, r->data, r->size, &r->offset, NULL, &comm->stats));
       }
       if (r->offset == r->size) {
         if (size) *size = r->size;
@@ -471,6 +1104,31 @@ ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
   return ncclSuccess;
 }
 
+// [RCCL] No batching here, unlike IB which drains each CQ once : helper threads complete each task
+// on its own and the control socket is progressed per request, so there is no per-comm completion
+// state to poll once. This only saves going through the ncclNet_t table for each request, see
+// ncclSocketUringTestMany for the io_uring engine, which does progress each comm once.
+ncclResult_t ncclSocketTestMany(void** requests, int n, int* done, int* sizes) {
+  for (int i=0; i<n; i++) NCCLCHECK(ncclSocketTest(requests[i], done+i, sizes ? sizes+i : NULL));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketGetStats(void* opaqueComm, struct ncclSocketStats* stats) {
+  struct ncclSocketComm* comm = (struct ncclSocketComm*)opaqueComm;
+  *stats = comm->stats;
+  for (int i=0; i<comm->nThreads; i++) {
+    struct ncclSocketStats* t = &comm->threadResources[i].stats;
+    stats->sendCalls += t->sendCalls;
+    stats->recvCalls += t->recvCalls;
+    stats->zcCalls += t->zcCalls;
+    stats->zcBytes += t->zcBytes;
+    stats->zcCopied += t->zcCopied;
+    stats->errqueueCalls += t->errqueueCalls;
+  }
+  return ncclSuccess;
+}
+// [/RCCL]
+
 ncclResult_t ncclSocketRegMr(void* comm, void* data, int size, int type, void** mhandle) {
   return (type != NCCL_PTR_HOST) ? ncclInternalError : ncclSuccess;
 }
@@ -478,12 +1136,14 @@ ncclResult_t ncclSocketDeregMr(void* comm, void* mhandle) { return ncclSuccess;
 
 ncclResult_t ncclSocketIsend(void* sendComm, void* data, int size, void* mhandle, void** request) {
   struct ncclSocketComm* comm = (struct ncclSocketComm*)sendComm;
+  __atomic_store_n(&comm->proxyWakeup, ncclProxyCurrentWakeup, __ATOMIC_RELAXED); // [RCCL]
   NCCLCHECK(ncclSocketGetRequest(comm, NCCL_SOCKET_SEND, data, size, (struct ncclSocketRequest**)request));
   return ncclSuccess;
 }
 
 ncclResult_t ncclSocketIrecv(void* recvComm, void* data, int size, void* mhandle, void** request) {
   struct ncclSocketComm* comm = (struct ncclSocketComm*)recvComm;
+  __atomic_store_n(&comm->proxyWakeup, ncclProxyCurrentWakeup, __ATOMIC_RELAXED); // [RCCL]
   NCCLCHECK(ncclSocketGetRequest(comm, NCCL_SOCKET_RECV, data, size, (struct ncclSocketRequest**)request));
   return ncclSuccess;
 }
@@ -497,6 +1157,7 @@ ncclResult_t ncclSocketCloseListen(void* opaqueComm) {
   struct ncclSocketListenComm* comm = (struct ncclSocketListenComm*)opaqueComm;
   if (comm) {
     if (comm->fd != -1) close(comm->fd);
+    for (int r=1; r<MAX_RAILS; r++) if (comm->railFds[r] != -1) close(comm->railFds[r]); // [RCCL]
     free(comm);
   }
   return ncclSuccess;
@@ -508,18 +1169,20 @@ ncclResult_t ncclSocketClose(void* opaqueComm) {
     for (int i=0; i<comm->nThreads; i++) {
       struct ncclSocketThreadResources* res = comm->threadResources+i;
       if (comm->helperThread[i]) {
-        pthread_mutex_lock(&res->threadLock);
         res->state = stop;
-        pthread_cond_signal(&res->threadCond);
-        pthread_mutex_unlock(&res->threadLock);
+        NCCLCHECK(ncclSocketWakeThread(comm->threadResources+i));
         pthread_join(comm->helperThread[i], NULL);
+        close(res->epollFd);
+        close(res->eventFd);
       }
       free(res->threadTaskQueue.tasks);
+      free(res->fdStates);
     }
     if (comm->ctrlFd != -1) close(comm->ctrlFd);
     for (int i=0; i<comm->nSocks; i++) {
       if (comm->fds[i] != -1) close(comm->fds[i]);
     }
+    free(comm->rxBuf);
     free(comm);
   }
   return ncclSuccess;
@@ -543,3 +1206,512 @@ ncclNet_t ncclNetSocket = {
   ncclSocketClose,
   ncclSocketCloseListen
 };
+
+// [RCCL] io_uring engine. Instead of helper threads calling send/recv on each socket,
+// tasks are queued per socket and handed to an io_uring : every test call submits, with
+// a single io_uring_enter, the tasks posted since the previous one, and reaps whatever
+// completed. Sockets are registered files and buffers registered through regMr are used
+// as fixed buffers. The bytes on the wire are the same as with helper threads (size
+// header, then the payload striped over the sockets) ; inline framing and adaptive
+// striping are not supported, so that either side can fall back to the other engine.
+#ifdef RCCL_IO_URING
+#define URING_QUEUE_LEN (2*MAX_REQUESTS) // Size header and payload of each request
+#define URING_MAX_BUFFERS 64
+
+struct ncclUringRing {
+  int fd;
+  void* rings;
+  size_t ringsSize;
+  struct io_uring_sqe* sqes;
+  size_t sqesSize;
+  unsigned* sqTail;
+  unsigned* sqArray;
+  unsigned sqMask;
+  unsigned toSubmit;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe* cqes;
+};
+
+// Tasks of a socket, in posting order. Only the first one is in the ring, which keeps
+// the byte stream in order.
+struct ncclUringSocket {
+  int inflight;
+  int head;
+  int count;
+  struct ncclSocketTask* tasks[URING_QUEUE_LEN];
+};
+
+struct ncclSocketUring {
+  struct ncclUringRing ring;
+  int nSockets; // Data sockets, then the control socket
+  struct ncclUringSocket sockets[MAX_SOCKETS+1];
+  int tasksPerRequest; // Size header, then payload chunks
+  struct ncclSocketTask* tasks;
+  int fixedBuffers; // buffers are registered with the ring
+  struct iovec buffers[URING_MAX_BUFFERS];
+};
+
+static void ncclUringDestroy(struct ncclUringRing* ring) {
+  if (ring->sqes) munmap(ring->sqes, ring->sqesSize);
+  if (ring->rings) munmap(ring->rings, ring->ringsSize);
+  if (ring->fd != -1) close(ring->fd);
+  ring->sqes = NULL;
+  ring->rings = NULL;
+  ring->fd = -1;
+}
+
+static ncclResult_t ncclUringSetup(struct ncclUringRing* ring, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd == -1) {
+    INFO(NCCL_INIT|NCCL_NET, "NET/Socket : io_uring_setup failed : %s", strerror(errno));
+    return ncclSystemError;
+  }
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+    INFO(NCCL_INIT|NCCL_NET, "NET/Socket : io_uring is too old");
+    ncclUringDestroy(ring);
+    return ncclSystemError;
+  }
+  ring->ringsSize = std::max(p.sq_off.array + p.sq_entries*sizeof(unsigned), p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe));
+  ring->sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+  void* rings = mmap(NULL, ring->ringsSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  void* sqes = mmap(NULL, ring->sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  ring->rings = rings == MAP_FAILED ? NULL : rings;
+  ring->sqes = sqes == MAP_FAILED ? NULL : (struct io_uring_sqe*)sqes;
+  if (ring->rings == NULL || ring->sqes == NULL) {
+    WARN("NET/Socket : mapping io_uring queues failed : %s", strerror(errno));
+    ncclUringDestroy(ring);
+    return ncclSystemError;
+  }
+  char* base = (char*)ring->rings;
+  ring->sqTail = (unsigned*)(base+p.sq_off.tail);
+  ring->sqArray = (unsigned*)(base+p.sq_off.array);
+  ring->sqMask = *(unsigned*)(base+p.sq_off.ring_mask);
+  ring->cqHead = (unsigned*)(base+p.cq_off.head);
+  ring->cqTail = (unsigned*)(base+p.cq_off.tail);
+  ring->cqMask = *(unsigned*)(base+p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(base+p.cq_off.cqes);
+  return ncclSuccess;
+}
+
+// Checks that the kernel has io_uring and the operations we use
+static ncclResult_t ncclUringProbe() {
+  struct ncclUringRing ring;
+  NCCLCHECK(ncclUringSetup(&ring, 4));
+  alignas(struct io_uring_probe) char buf[sizeof(struct io_uring_probe)+256*sizeof(struct io_uring_probe_op)];
+  memset(buf, 0, sizeof(buf));
+  struct io_uring_probe* probe = (struct io_uring_probe*)buf;
+  ncclResult_t ret = ncclSuccess;
+  if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+    INFO(NCCL_INIT|NCCL_NET, "NET/Socket : io_uring probe failed : %s", strerror(errno));
+    ret = ncclSystemError;
+  } else {
+    int ops[] = { IORING_OP_SEND, IORING_OP_RECV, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED };
+    for (int i=0; i<4; i++) {
+      if (ops[i] > probe->last_op || (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0) {
+        INFO(NCCL_INIT|NCCL_NET, "NET/Socket : io_uring does not support operation %d", ops[i]);
+        ret = ncclSystemError;
+      }
+    }
+  }
+  ncclUringDestroy(&ring);
+  return ret;
+}
+
+// Submits all queued entries. Completions are posted by the kernel without entering the ring.
+static ncclResult_t ncclUringSubmit(struct ncclUringRing* ring, struct ncclSocketStats* stats) {
+  while (ring->toSubmit) {
+    int ret = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+    stats->enterCalls++;
+    if (ret == -1) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) return ncclSuccess; // Retried on the next call
+      WARN("NET/Socket : io_uring_enter failed : %s", strerror(errno));
+      return ncclSystemError;
+    }
+    ring->toSubmit -= ret;
+  }
+  return ncclSuccess;
+}
+
+// Queues what is left of task t on the registered socket idx. There is always room :
+// the ring has an entry per socket and a socket has at most one task in the ring.
+static void ncclUringQueue(struct ncclUringRing* ring, int idx, struct ncclSocketTask* t) {
+  unsigned tail = *ring->sqTail;
+  struct io_uring_sqe* sqe = ring->sqes+(tail & ring->sqMask);
+  memset(sqe, 0, sizeof(*sqe));
+  int send = t->op == NCCL_SOCKET_SEND;
+  if (t->bufIndex >= 0) {
+    sqe->opcode = send ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = t->bufIndex;
+  } else {
+    sqe->opcode = send ? IORING_OP_SEND : IORING_OP_RECV;
+    sqe->msg_flags = send ? MSG_NOSIGNAL : 0;
+  }
+  sqe->fd = idx;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t)(uintptr_t)((char*)t->data+t->sent);
+  sqe->len = t->size-t->sent;
+  sqe->user_data = idx;
+  ring->sqArray[tail & ring->sqMask] = tail & ring->sqMask;
+  __atomic_store_n(ring->sqTail, tail+1, __ATOMIC_RELEASE);
+  ring->toSubmit++;
+}
+
+static void ncclUringPost(struct ncclSocketUring* uring, int idx, struct ncclSocketTask* t, int front) {
+  struct ncclUringSocket* s = uring->sockets+idx;
+  if (front) {
+    s->head = (s->head+URING_QUEUE_LEN-1)%URING_QUEUE_LEN;
+    s->tasks[s->head] = t;
+  } else {
+    s->tasks[(s->head+s->count)%URING_QUEUE_LEN] = t;
+  }
+  s->count++;
+}
+
+static struct ncclSocketTask* ncclUringNewTask(struct ncclSocketComm* comm, struct ncclSocketRequest* r, int i, void* data, int size, int bufIndex) {
+  struct ncclSocketUring* uring = comm->uring;
+  struct ncclSocketTask* t = uring->tasks + (r-comm->requests)*uring->tasksPerRequest + i;
+  t->op = r->op;
+  t->data = data;
+  t->size = size;
+  t->addr = &comm->addr;
+  t->offset = 0;
+  t->sent = 0;
+  t->bufIndex = bufIndex;
+  t->req = NULL;
+  t->result = ncclSuccess;
+  t->used = 1;
+  return t;
+}
+
+// Queues the payload of r, split the same way as with helper threads. Without data
+// sockets, a received payload goes in front of the size headers posted after r.
+static void ncclUringPostPayload(struct ncclSocketComm* comm, struct ncclSocketRequest* r) {
+  int i = 0;
+  if (comm->nSocks == 0) {
+    if (r->size > 0) {
+      r->tasks[i] = ncclUringNewTask(comm, r, i+1, r->data, r->size, r->bufIndex);
+      ncclUringPost(comm->uring, comm->nSocks, r->tasks[i++], r->op == NCCL_SOCKET_RECV);
+    }
+  } else {
+    int taskSize = std::max(MIN_CHUNKSIZE, DIVUP(r->size, comm->nSocks));
+    for (int chunkOffset=0; chunkOffset<r->size; i++) {
+      int chunkSize = std::min(ncclSocketTaskSize(comm, r->size, taskSize), r->size-chunkOffset);
+      r->tasks[i] = ncclUringNewTask(comm, r, i+1, (char*)r->data+chunkOffset, chunkSize, r->bufIndex);
+      ncclUringPost(comm->uring, comm->nextFd, r->tasks[i], 0);
+      comm->nextFd = (comm->nextFd+1) % comm->nSocks;
+      chunkOffset += chunkSize;
+    }
+  }
+  r->nSubs = i;
+}
+
+// Handles the completion of the task at the head of socket idx
+static ncclResult_t ncclUringComplete(struct ncclSocketComm* comm, int idx, int bytes) {
+  struct ncclUringSocket* s = comm->uring->sockets+idx;
+  struct ncclSocketTask* t = s->tasks[s->head];
+  char line[SOCKET_NAME_MAXLEN+1];
+  s->inflight = 0;
+  if (bytes == -EINTR || bytes == -EAGAIN) return ncclSuccess; // Queued again on the next call
+  if (bytes < 0) {
+    WARN("Net : io_uring %s %s failed : %s", t->op == NCCL_SOCKET_RECV ? "recv from" : "send to", socketToString(t->addr, line), strerror(-bytes));
+    t->result = ncclSystemError;
+    return ncclSystemError;
+  }
+  if (bytes == 0 && t->op == NCCL_SOCKET_RECV) {
+    WARN("Net : Connection closed by remote peer %s", socketToString(t->addr, line));
+    t->result = ncclSystemError;
+    return ncclSystemError;
+  }
+  t->sent += bytes;
+  if (t->sent < t->size) return ncclSuccess; // The rest is queued on the next call
+  s->head = (s->head+1)%URING_QUEUE_LEN;
+  s->count--;
+  t->offset = t->size;
+  if (t->req) { // Size header received, the payload can follow
+    struct ncclSocketRequest* r = t->req;
+    if (r->hdr[0] > r->size) {
+      WARN("NET/Socket : peer %s message truncated : receiving %d bytes instead of %d", socketToString(r->addr, line), r->hdr[0], r->size);
+      t->result = ncclInternalError;
+      return ncclInternalError;
+    }
+    r->size = r->hdr[0];
+    ncclUringPostPayload(comm, r);
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclUringProgress(struct ncclSocketComm* comm) {
+  struct ncclSocketUring* uring = comm->uring;
+  struct ncclUringRing* ring = &uring->ring;
+  for (int i=0; i<uring->nSockets; i++) {
+    struct ncclUringSocket* s = uring->sockets+i;
+    if (s->count == 0 || s->inflight) continue;
+    ncclUringQueue(ring, i, s->tasks[s->head]);
+    s->inflight = 1;
+  }
+  NCCLCHECK(ncclUringSubmit(ring, &comm->stats));
+  unsigned head = *ring->cqHead;
+  unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe* cqe = ring->cqes+(head & ring->cqMask);
+    ncclResult_t res = ncclUringComplete(comm, cqe->user_data, cqe->res);
+    __atomic_store_n(ring->cqHead, head+1, __ATOMIC_RELEASE);
+    if (res != ncclSuccess) return res;
+  }
+  return ncclSuccess;
+}
+
+// (Re)registers the buffers of the comm. Freed slots stay as holes, which needs Linux 5.13.
+static ncclResult_t ncclUringRegisterBuffers(struct ncclSocketUring* uring) {
+  if (uring->fixedBuffers) {
+    syscall(__NR_io_uring_register, uring->ring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    uring->fixedBuffers = 0;
+  }
+  int nBuffers = 0;
+  for (int i=0; i<URING_MAX_BUFFERS; i++) if (uring->buffers[i].iov_base) nBuffers = i+1;
+  if (nBuffers == 0) return ncclSuccess;
+  if (syscall(__NR_io_uring_register, uring->ring.fd, IORING_REGISTER_BUFFERS, uring->buffers, nBuffers) == -1) {
+    INFO(NCCL_NET, "NET/Socket : io_uring buffer registration failed (%s), using regular sends and receives", strerror(errno));
+    return ncclSystemError;
+  }
+  uring->fixedBuffers = 1;
+  return ncclSuccess;
+}
+
+static int ncclUringBufIndex(struct ncclSocketUring* uring, void* mhandle, void* data, int size) {
+  int idx = (int)(uintptr_t)mhandle - 1;
+  if (idx < 0 || uring->fixedBuffers == 0) return -1;
+  char* base = (char*)uring->buffers[idx].iov_base;
+  if ((char*)data < base || (char*)data+size > base+uring->buffers[idx].iov_len) return -1;
+  return idx;
+}
+
+static ncclResult_t ncclUringCommInit(struct ncclSocketComm* comm) {
+  struct ncclSocketUring* uring;
+  NCCLCHECK(ncclCalloc(&uring, 1));
+  comm->uring = uring;
+  uring->ring.fd = -1;
+  uring->nSockets = comm->nSocks+1;
+  uring->tasksPerRequest = std::max(comm->nSocks, 1)+1;
+  NCCLCHECK(ncclCalloc(&uring->tasks, MAX_REQUESTS*uring->tasksPerRequest));
+  NCCLCHECK(ncclUringSetup(&uring->ring, uring->nSockets));
+  int fds[MAX_SOCKETS+1];
+  for (int i=0; i<comm->nSocks; i++) fds[i] = comm->fds[i];
+  fds[comm->nSocks] = comm->ctrlFd;
+  SYSCHECK(syscall(__NR_io_uring_register, uring->ring.fd, IORING_REGISTER_FILES, fds, uring->nSockets), "io_uring_register");
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketUringInit(ncclDebugLogger_t logFunction) {
+  NCCLCHECK(ncclUringProbe());
+  NCCLCHECK(ncclSocketInit(logFunction));
+  INFO(NCCL_INIT|NCCL_NET, "NET/Socket : Using io_uring");
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketUringListen(int dev, void* opaqueHandle, void** listenComm) {
+  NCCLCHECK(ncclSocketListen(dev, opaqueHandle, listenComm));
+  struct ncclSocketHandle* handle = (struct ncclSocketHandle*) opaqueHandle;
+  struct ncclSocketListenComm* comm = (struct ncclSocketListenComm*)*listenComm;
+  handle->inlineSize = comm->inlineSize = 0;
+  handle->adaptive = comm->adaptive = 0;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketUringClose(void* opaqueComm) {
+  struct ncclSocketComm* comm = (struct ncclSocketComm*)opaqueComm;
+  if (comm && comm->uring) {
+    ncclUringDestroy(&comm->uring->ring);
+    free(comm->uring->tasks);
+    free(comm->uring);
+    comm->uring = NULL;
+  }
+  return ncclSocketClose(comm);
+}
+
+ncclResult_t ncclSocketUringConnect(int dev, void* opaqueHandle, void** sendComm) {
+  struct ncclSocketHandle* handle = (struct ncclSocketHandle*) opaqueHandle;
+  if (handle->inlineSize || handle->adaptive) {
+    WARN("NET/Socket : peer uses RCCL_SOCKET_INLINE_THRESHOLD or RCCL_SOCKET_ADAPTIVE, which io_uring does not support");
+    return ncclInvalidUsage;
+  }
+  NCCLCHECK(ncclSocketConnect(dev, opaqueHandle, sendComm));
+  struct ncclSocketComm* comm = (struct ncclSocketComm*)*sendComm;
+  comm->zeroCopy = 0;
+  ncclResult_t res = ncclUringCommInit(comm);
+  if (res != ncclSuccess) {
+    ncclSocketUringClose(comm);
+    *sendComm = NULL;
+  }
+  return res;
+}
+
+ncclResult_t ncclSocketUringAccept(void* listenComm, void** recvComm) {
+  NCCLCHECK(ncclSocketAccept(listenComm, recvComm));
+  ncclResult_t res = ncclUringCommInit((struct ncclSocketComm*)*recvComm);
+  if (res != ncclSuccess) {
+    ncclSocketUringClose(*recvComm);
+    *recvComm = NULL;
+  }
+  return res;
+}
+
+// Registered buffers are used as fixed buffers. mhandle is the buffer index plus one,
+// or NULL when the buffer could not be registered.
+ncclResult_t ncclSocketUringRegMr(void* opaqueComm, void* data, int size, int type, void** mhandle) {
+  if (type != NCCL_PTR_HOST) return ncclInternalError;
+  struct ncclSocketUring* uring = ((struct ncclSocketComm*)opaqueComm)->uring;
+  *mhandle = NULL;
+  int idx = 0;
+  while (idx < URING_MAX_BUFFERS && uring->buffers[idx].iov_base) idx++;
+  if (idx == URING_MAX_BUFFERS) return ncclSuccess;
+  uring->buffers[idx].iov_base = data;
+  uring->buffers[idx].iov_len = size;
+  if (ncclUringRegisterBuffers(uring) == ncclSuccess) {
+    *mhandle = (void*)(uintptr_t)(idx+1);
+  } else {
+    uring->buffers[idx].iov_base = NULL;
+    uring->buffers[idx].iov_len = 0;
+    ncclUringRegisterBuffers(uring);
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketUringDeregMr(void* opaqueComm, void* mhandle) {
+  struct ncclSocketUring* uring = ((struct ncclSocketComm*)opaqueComm)->uring;
+  int idx = (int)(uintptr_t)mhandle - 1;
+  if (idx < 0) return ncclSuccess;
+  uring->buffers[idx].iov_base = NULL;
+  uring->buffers[idx].iov_len = 0;
+  ncclUringRegisterBuffers(uring);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketUringIsend(void* sendComm, void* data, int size, void* mhandle, void** request) {
+  struct ncclSocketComm* comm = (struct ncclSocketComm*)sendComm;
+  struct ncclSocketRequest* r;
+  NCCLCHECK(ncclSocketGetRequest(comm, NCCL_SOCKET_SEND, data, size, &r));
+  r->bufIndex = ncclUringBufIndex(comm->uring, mhandle, data, size);
+  ncclUringPost(comm->uring, comm->nSocks, ncclUringNewTask(comm, r, 0, r->hdr, comm->hdrSize, -1), 0);
+  ncclUringPostPayload(comm, r);
+  r->used = 2;
+  *request = r;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketUringIrecv(void* recvComm, void* data, int size, void* mhandle, void** request) {
+  struct ncclSocketComm* comm = (struct ncclSocketComm*)recvComm;
+  struct ncclSocketRequest* r;
+  NCCLCHECK(ncclSocketGetRequest(comm, NCCL_SOCKET_RECV, data, size, &r));
+  r->bufIndex = ncclUringBufIndex(comm->uring, mhandle, data, size);
+  struct ncclSocketTask* hdr = ncclUringNewTask(comm, r, 0, r->hdr, comm->hdrSize, -1);
+  hdr->req = r;
+  ncclUringPost(comm->uring, comm->nSocks, hdr, 0);
+  r->used = 2;
+  *request = r;
+  return ncclSuccess;
+}
+
+// Whether a request completed, once its comm has progressed
+static ncclResult_t ncclUringRequestDone(struct ncclSocketRequest* r, int* done, int* size) {
+  *done = 0;
+  struct ncclSocketComm* comm = r->comm;
+  struct ncclSocketTask* hdr = comm->uring->tasks + (r-comm->requests)*comm->uring->tasksPerRequest;
+  if (hdr->result != ncclSuccess) return hdr->result;
+  if (hdr->offset < hdr->size) return ncclSuccess;
+  for (int i=0; i<r->nSubs; i++) {
+    struct ncclSocketTask* sub = r->tasks[i];
+    if (sub->result != ncclSuccess) return sub->result;
+    if (sub->offset < sub->size) return ncclSuccess;
+  }
+  if (size) *size = r->size;
+  *done = 1;
+  r->used = 0;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketUringTest(void* request, int* done, int* size) {
+  *done = 0;
+  struct ncclSocketRequest *r = (struct ncclSocketRequest*)request;
+  if (r == NULL) {
+    WARN("NET/Socket : test called with NULL request");
+    return ncclInternalError;
+  }
+  NCCLCHECK(ncclUringProgress(r->comm));
+  return ncclUringRequestDone(r, done, size);
+}
+
+// Progresses each comm once, with a single io_uring_enter, rather than once per request.
+// Requests of a comm are usually next to each other.
+ncclResult_t ncclSocketUringTestMany(void** requests, int n, int* done, int* sizes) {
+  struct ncclSocketComm* progressed[4] = { NULL, NULL, NULL, NULL };
+  for (int i=0; i<n; i++) {
+    struct ncclSocketRequest *r = (struct ncclSocketRequest*)requests[i];
+    if (r == NULL) {
+      WARN("NET/Socket : test called with NULL request");
+      return ncclInternalError;
+    }
+    int p = 0;
+    while (p < 4 && progressed[p] && progressed[p] != r->comm) p++;
+    if (p == 4 || progressed[p] == NULL) {
+      NCCLCHECK(ncclUringProgress(r->comm));
+      if (p < 4) progressed[p] = r->comm;
+    }
+    NCCLCHECK(ncclUringRequestDone(r, done+i, sizes ? sizes+i : NULL));
+  }
+  return ncclSuccess;
+}
+
+ncclNet_t ncclNetSocketUring = {
+  "Socket",
+  ncclSocketUringInit,
+  ncclSocketDevices,
+  ncclSocketGetProperties,
+  ncclSocketUringListen,
+  ncclSocketUringConnect,
+  ncclSocketUringAccept,
+  ncclSocketUringRegMr,
+  ncclSocketUringDeregMr,
+  ncclSocketUringIsend,
+  ncclSocketUringIrecv,
+  ncclSocketIflush,
+  ncclSocketUringTest,
+  ncclSocketUringClose,
+  ncclSocketUringClose,
+  ncclSocketCloseListen
+};
+#else
+ncclResult_t ncclSocketUringInit(ncclDebugLogger_t logFunction) {
+  INFO(NCCL_INIT|NCCL_NET, "NET/Socket : built without io_uring support");
+  return ncclInternalError;
+}
+
+ncclResult_t ncclSocketUringTestMany(void** requests, int n, int* done, int* sizes) {
+  return ncclSocketTestMany(requests, n, done, sizes);
+}
+
+ncclNet_t ncclNetSocketUring = {
+  "Socket",
+  ncclSocketUringInit,
+  ncclSocketDevices,
+  ncclSocketGetProperties,
+  ncclSocketListen,
+  ncclSocketConnect,
+  ncclSocketAccept,
+  ncclSocketRegMr,
+  ncclSocketDeregMr,
+  ncclSocketIsend,
+  ncclSocketIrecv,
+  ncclSocketIflush,
+  ncclSocketTest,
+  ncclSocketClose,
+  ncclSocketClose,
+  ncclSocketCloseListen
+};
+#endif
+// [/RCCL]
@@ -0,0 +1,181 @@
+/*************************************************************************
+ * Copyright (c) 2021 Advanced Micro Devices, Inc. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+// CPU-only benchmark of the bootstrap network.
+// Forks nranks processes on the loopback interface, runs bootstrapInit then
+// a series of bootstrapAllGather, bootstrapIntraNodeAllGather and bootstrapBarrier,
+// and reports the time taken by the slowest rank. All ranks are on the same host, so
+// RCCL_BOOTSTRAP_SHM=1 compares the shared memory path with the socket one, and
+// RCCL_BOOTSTRAP_INTRA_BRUCK=0 the Bruck intra-node AllGather with the linear one.
+
+#include "core.h"
+#include "bootstrap.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct rankResult {
+  double initUs;
+  double allGatherUs;
+  double intraAllGatherUs;
+  double barrierUs;
+  int status;
+};
+
+struct benchOptions {
+  int size;      // AllGather bytes per rank
+  int agIters;   // AllGather and barrier iterations per run
+};
+
+static double timeUs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec*1e6 + tv.tv_usec;
+}
+
+static void runRank(ncclUniqueId* id, int rank, int nranks, struct benchOptions* opts, struct rankResult* result) {
+  void* state;
+  int rootPid;
+  double start = timeUs();
+  if (bootstrapInit(id, rank, nranks, &state, &rootPid) != ncclSuccess) {
+    result->status = 1;
+    return;
+  }
+  result->initUs = timeUs() - start;
+
+  char* data = (char*)malloc((size_t)nranks*opts->size);
+  // Warm up (connection setup) then measure
+  for (int i=-1; i<opts->agIters; i++) {
+    if (i == 0) start = timeUs();
+    memset(data+(size_t)rank*opts->size, rank+i, opts->size);
+    if (bootstrapAllGather(state, data, opts->size) != ncclSuccess) {
+      result->status = 1;
+      break;
+    }
+    for (int r=0; r<nranks; r++) {
+      if (data[(size_t)r*opts->size] != (char)(r+i) || data[(size_t)(r+1)*opts->size-1] != (char)(r+i)) {
+        printf("Rank %d : wrong AllGather data from rank %d\n", rank, r);
+        result->status = 1;
+      }
+    }
+  }
+  result->allGatherUs = (timeUs() - start) / opts->agIters;
+
+  int* ranks = (int*)malloc(nranks*sizeof(int));
+  for (int r=0; r<nranks; r++) ranks[r] = r;
+  for (int i=-1; i<opts->agIters; i++) {
+    if (i == 0) start = timeUs();
+    memset(data+(size_t)rank*opts->size, rank-i, opts->size);
+    if (bootstrapIntraNodeAllGather(state, ranks, rank, nranks, data, opts->size) != ncclSuccess) {
+      result->status = 1;
+      break;
+    }
+    for (int r=0; r<nranks; r++) {
+      if (data[(size_t)r*opts->size] != (char)(r-i) || data[(size_t)(r+1)*opts->size-1] != (char)(r-i)) {
+        printf("Rank %d : wrong intra-node AllGather data from rank %d\n", rank, r);
+        result->status = 1;
+      }
+    }
+  }
+  result->intraAllGatherUs = (timeUs() - start) / opts->agIters;
+  free(data);
+
+  for (int i=-1; i<opts->agIters; i++) {
+    if (i == 0) start = timeUs();
+    if (bootstrapBarrier(state, ranks, rank, nranks, 0x1234) != ncclSuccess) {
+      result->status = 1;
+      break;
+    }
+  }
+  result->barrierUs = (timeUs() - start) / opts->agIters;
+  free(ranks);
+  if (bootstrapClose(state) != ncclSuccess) result->status = 1;
+}
+
+static int runTest(int nranks, struct benchOptions* opts, struct rankResult* results) {
+  ncclUniqueId id;
+  if (bootstrapGetUniqueId(&id) != ncclSuccess) return 1;
+
+  memset(results, 0, nranks*sizeof(struct rankResult));
+  fflush(stdout);
+  pid_t* pids = (pid_t*)malloc(nranks*sizeof(pid_t));
+  for (int r=0; r<nranks; r++) {
+    pids[r] = fork();
+    if (pids[r] == 0) {
+      runRank(&id, r, nranks, opts, results+r);
+      _exit(results[r].status);
+    }
+  }
+  int errors = 0;
+  for (int r=0; r<nranks; r++) {
+    int status;
+    waitpid(pids[r], &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) errors++;
+  }
+  free(pids);
+  return errors;
+}
+
+static void usage(const char* exe) {
+  printf("Usage: %s [-n minRanks] [-N maxRanks] [-i iterations] [-s allGatherBytes] [-a collectiveIterations]\n", exe);
+  printf("  Environment variables of the bootstrap (e.g. RCCL_BOOTSTRAP_TREE, RCCL_BOOTSTRAP_BRUCK_THRESHOLD, RCCL_BOOTSTRAP_SHM, RCCL_BOOTSTRAP_INTRA_BRUCK) apply to all ranks.\n");
+}
+
+int main(int argc, char* argv[]) {
+  int minRanks = 2, maxRanks = 64, iters = 3;
+  struct benchOptions opts = { 64, 20 };
+  int opt;
+  while ((opt = getopt(argc, argv, "n:N:i:s:a:h")) != -1) {
+    switch (opt) {
+      case 'n': minRanks = atoi(optarg); break;
+      case 'N': maxRanks = atoi(optarg); break;
+      case 'i': iters = atoi(optarg); break;
+      case 's': opts.size = atoi(optarg); break;
+      case 'a': opts.agIters = atoi(optarg); break;
+      default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (minRanks < 1 || maxRanks < minRanks || iters < 1 || opts.size < 1 || opts.agIters < 1) { usage(argv[0]); return 1; }
+
+  // Everything runs on this host
+  setenv("NCCL_SOCKET_IFNAME", "lo", 0);
+  if (bootstrapNetInit() != ncclSuccess) return 1;
+
+  struct rankResult* results = (struct rankResult*)mmap(NULL, maxRanks*sizeof(struct rankResult),
+      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) { perror("mmap"); return 1; }
+
+  printf("# AllGather size %d bytes per rank\n", opts.size);
+  printf("# %8s %14s %14s %16s %16s %14s\n", "nranks", "init max(us)", "init avg(us)", "allgather(us)", "intra ag(us)", "barrier(us)");
+  for (int nranks=minRanks; nranks<=maxRanks; nranks*=2) {
+    double initMax = 0, initSum = 0, agSum = 0, intraSum = 0, barSum = 0;
+    for (int i=0; i<iters; i++) {
+      if (runTest(nranks, &opts, results)) {
+        printf("Bootstrap failed with %d ranks\n", nranks);
+        return 1;
+      }
+      double iterMax = 0, agMax = 0, intraMax = 0, barMax = 0;
+      for (int r=0; r<nranks; r++) {
+        iterMax = std::max(iterMax, results[r].initUs);
+        agMax = std::max(agMax, results[r].allGatherUs);
+        intraMax = std::max(intraMax, results[r].intraAllGatherUs);
+        barMax = std::max(barMax, results[r].barrierUs);
+      }
+      initMax = std::max(initMax, iterMax);
+      initSum += iterMax;
+      agSum += agMax;
+      intraSum += intraMax;
+      barSum += barMax;
+    }
+    printf("  %8d %14.0f %14.0f %16.1f %16.1f %14.1f\n", nranks, initMax, initSum/iters, agSum/iters, intraSum/iters, barSum/iters);
+  }
+  munmap(results, maxRanks*sizeof(struct rankResult));
+  return 0;
+}
@@ -0,0 +1,29 @@
+/*************************************************************************
+ * Copyright (c) 2021 Advanced Micro Devices, Inc. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "core.h"
+#include "clique/CliqueManager.h"
+
+#ifdef ENABLE_TRACE
+std::chrono::high_resolution_clock::time_point ncclEpoch;
+#endif
+
+struct allocationTracker allocTracker[MAX_ALLOC_TRACK_NGPU] = {};
+
+// Ranks of the bootstrap benchmark are processes without a GPU
+hipError_t hipSetDevice(int deviceId) {
+  return hipSuccess;
+}
+
+hipError_t hipGetDevice(int* deviceId) {
+  *deviceId = 0;
+  return hipSuccess;
+}
+
+// Clique kernels are not used by the bootstrap benchmark
+ncclResult_t CliqueManager::BootstrapRootInit(int pid, unsigned long hash) {
+  return ncclSuccess;
+}
@@ -0,0 +1,327 @@
+/*************************************************************************
+ * Copyright (c) 2021 Advanced Micro Devices, Inc. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+// CPU-only stress benchmark of the proxy thread.
+// Posts collectives on a fake communicator whose network transport completes each
+// operation after a given number of steps, and reports how many proxy
+// operations per second go from the enqueue thread through the proxy thread and back
+// to the pool, with the CPU time of both threads. With -t, collectives follow the ring,
+// tree (up then down, with two children) or p2p (send to and receive from the 3 other ranks,
+// on shared connectors which group the operations of a channel) pattern.
+// The cost of the proxy thread is broken down into passes over its operations : time per pass,
+// share of it spent in the transport, the rest being proxy bookkeeping, and time taken by the
+// enqueue thread to hand collectives over (ncclProxyStart). With -l, each progress call waits as if
+// the GPU was producing data, which exercises the idle policy of the proxy thread
+// (RCCL_PROXY_SPIN_US and RCCL_PROXY_SLEEP_US). With -n, every collective is posted on several
+// communicators, which get a proxy thread each or share them with RCCL_PROXY_SHARED.
+// RCCL_PROXY_PROFILE and RCCL_PROXY_TRACE_FILE profile the operations of the fake transport.
+// Each peer is reached through a NIC of its own : with RCCL_PROXY_NIC_THREADS, their connectors
+// are progressed by threads of their own, and the proxy columns only cover the thread of the
+// communicator.
+// With -p, a high priority collective of one step is posted after each collective, on other
+// connectors, and waited for : its latency shows how priority scheduling (RCCL_PROXY_PRIORITY_RATIO)
+// isolates small collectives from large ones.
+
+#include "comm.h"
+#include "info.h"
+#include <sys/resource.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum benchPattern { benchRing, benchTree, benchP2p };
+static const char* benchPatternNames[] = { "ring", "tree", "p2p" };
+// Send and recv operations per channel, before p2p ones get grouped
+static const int benchPatternOps[] = { 2, 6, 6 };
+#define BENCH_NRANKS 4
+
+struct benchOptions {
+  int maxChannels; // Collectives use 1, 2, 4 ... maxChannels channels
+  int iters;       // Collectives per channel count
+  int depth;       // Collectives in flight
+  int steps;       // Steps of each operation
+  int stepUs;      // Time before each step can progress
+  int nComms;      // Communicators each collective is posted on
+  int priority;    // Post a high priority collective after each one
+  int pattern;
+};
+
+// Operations are counted by sub, p2p operations grouping several
+static uint64_t completedOps = 0;
+static uint64_t completedHighOps = 0;
+static uint64_t stepNs = 0;
+static uint64_t* transportNs; // Time spent in fakeProxy, per communicator
+
+// Transport proxy function : like the network transport, each step of a send is posted to the
+// GPU, transmitted then done, and each step of a receive is posted, received, transmitted then
+// done. Every call moves each step to its next stage, stepNs after the previous call which did.
+static ncclResult_t fakeProxy(struct ncclProxyArgs* args) {
+  uint64_t start = ncclTimeNs();
+  uint64_t now = stepNs ? start : 0;
+  if (args->state == ncclProxyOpReady) {
+    for (int s=0; s<args->nsubs; s++) {
+      struct ncclProxySubArgs* sub = args->subs+s;
+      sub->posted = sub->received = sub->transmitted = sub->done = 0;
+      sub->end = now+stepNs;
+    }
+    args->state = ncclProxyOpProgress;
+  }
+  args->idle = 1;
+  int done = 1;
+  for (int s=0; s<args->nsubs; s++) {
+    struct ncclProxySubArgs* sub = args->subs+s;
+    if (sub->done < (uint64_t)sub->nsteps && now >= sub->end) {
+      if (sub->done < sub->transmitted) sub->done++;
+      if (sub->transmitted < (sub->send ? sub->posted : sub->received)) sub->transmitted++;
+      if (!sub->send && sub->received < sub->posted) sub->received++;
+      if (sub->posted < (uint64_t)sub->nsteps && sub->posted < sub->done + NCCL_STEPS) sub->posted++;
+      sub->end = now+stepNs;
+      args->idle = 0;
+    }
+    if (sub->done < (uint64_t)sub->nsteps) done = 0;
+  }
+  if (done) {
+    args->state = ncclProxyOpNone;
+    __atomic_fetch_add(args->priority ? &completedHighOps : &completedOps, args->nsubs, __ATOMIC_RELEASE);
+  }
+  // Several threads progress the communicator with RCCL_PROXY_NIC_THREADS
+  __atomic_fetch_add(transportNs+args->subs[0].connector->comm->rank, ncclTimeNs()-start, __ATOMIC_RELAXED);
+  return ncclSuccess;
+}
+
+static struct ncclTransportComm fakeTransportComm = { NULL, NULL, NULL, fakeProxy };
+static uint32_t abortFlag = 0;
+
+static ncclResult_t fakeCommInit(struct ncclComm** commPtr, struct ncclPeer** peersPtr, int rank, int nChannels, int pattern) {
+  struct ncclComm* comm;
+  struct ncclPeer* peers;
+  NCCLCHECK(ncclCalloc(&comm, 1));
+  NCCLCHECK(ncclCalloc(&peers, BENCH_NRANKS*nChannels));
+  comm->rank = rank;
+  comm->nRanks = BENCH_NRANKS;
+  comm->abortFlag = &abortFlag;
+  cpu_set_t netAffinity;
+  CPU_ZERO(&netAffinity);
+  // Each channel sends to and receives from every rank through the fake transport, on connectors
+  // 0 and 1 (high priority collectives). Rings go through rank 1, trees have rank 1 as parent
+  // and ranks 2 and 3 as children, p2p operations go to the ranks after this one.
+  for (int c=0; c<nChannels; c++) {
+    struct ncclChannel* channel = comm->channels+c;
+    channel->id = c;
+    channel->peers = peers+BENCH_NRANKS*c;
+    channel->ring.prev = channel->ring.next = 1;
+    channel->tree.up = 1;
+    channel->tree.down[0] = 2;
+    channel->tree.down[1] = 3;
+    channel->tree.down[2] = -1;
+    for (int peer=0; peer<BENCH_NRANKS; peer++) {
+      for (int i=0; i<4; i++) {
+        int send = i%2 == 0;
+        struct ncclConnector* connector = (send ? channel->peers[peer].send : channel->peers[peer].recv) + i/2;
+        connector->transportComm = &fakeTransportComm;
+        connector->comm = comm;
+        connector->conn.simpleSteps = NCCL_STEPS;
+        connector->proxyAppendPtr = &connector->proxyAppend;
+        if (pattern == benchP2p && i/2 == 0) {
+          // Like network connectors with shared buffers, the sends, and the recvs, of a channel are grouped
+          connector->conn.shared = 1;
+          connector->proxyAppendPtr = comm->proxyState.sharedBuffs.proxyAppend+2*c+send;
+        }
+        NCCLCHECK(ncclProxyNetShard(comm, peer, &netAffinity, connector));
+      }
+    }
+  }
+  *commPtr = comm;
+  *peersPtr = peers;
+  return ncclSuccess;
+}
+
+static double timeUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e6 + ts.tv_nsec*1e-3;
+}
+
+static double cpuUs(int who) {
+  struct rusage ru;
+  getrusage(who, &ru);
+  return ru.ru_utime.tv_sec*1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_sec*1e6 + ru.ru_stime.tv_usec;
+}
+
+// Waits until at most maxInFlight operations are still in progress
+static void waitOps(uint64_t posted, uint64_t maxInFlight) {
+  while (posted - __atomic_load_n(&completedOps, __ATOMIC_ACQUIRE) > maxInFlight) {
+    // Leave the CPU to the proxy thread when operations take time
+    if (stepNs) usleep(1);
+    else sched_yield();
+  }
+}
+
+// Posts a collective over nChannels, adding the time taken to hand it over to postNs
+static ncclResult_t postColl(struct ncclComm* comm, int nChannels, int steps, int pattern, int priority, uint64_t* postNs) {
+  struct ncclProxyArgs args;
+  for (int c=0; c<nChannels; c++) {
+    memset(&args, 0, sizeof(args));
+    args.subs[0].channel = comm->channels+c;
+    args.nsubs = 1;
+    args.protocol = NCCL_PROTO_SIMPLE;
+    if (pattern == benchP2p) {
+      // One step per byte, operations of the same collective share its work FIFO slot
+      struct ncclProxySubArgs* sub = args.subs;
+      sub->sendbytes = sub->recvbytes = steps;
+      sub->sendChunkSize = sub->recvChunkSize = 1;
+      args.sliceSteps = args.chunkSteps = 1;
+      comm->channels[c].workFifoTail++;
+      for (int delta=1; delta<BENCH_NRANKS; delta++) {
+        sub->delta = delta;
+        NCCLCHECK(ncclProxySaveP2p(comm, &args));
+      }
+      continue;
+    }
+    args.subs[0].nsteps = steps;
+    args.pattern = pattern == benchTree ? ncclPatternTreeUpDown : ncclPatternRing;
+    args.opCount = comm->opCount;
+    args.commOpCount = comm->opCount;
+    args.connIndex = priority;
+    args.priority = priority;
+    NCCLCHECK(ncclProxySaveColl(&args, comm->nRanks));
+  }
+  uint64_t start = ncclTimeNs();
+  NCCLCHECK(ncclProxyStart(comm));
+  *postNs += ncclTimeNs()-start;
+  return ncclSuccess;
+}
+
+// Posts iters collectives over nChannels on each communicator, with up to depth of them in
+// flight. Returns the total latency of high priority collectives in highUs, and the total
+// time taken to hand collectives over in postNs.
+static ncclResult_t runChannels(struct ncclComm** comms, int nChannels, int iters, struct benchOptions* opts, double* highUs, uint64_t* postNs) {
+  uint64_t posted = __atomic_load_n(&completedOps, __ATOMIC_ACQUIRE);
+  uint64_t highPosted = __atomic_load_n(&completedHighOps, __ATOMIC_ACQUIRE);
+  int opsPerColl = benchPatternOps[opts->pattern]*nChannels*opts->nComms;
+  uint64_t highPostNs = 0;
+  *highUs = 0;
+  *postNs = 0;
+  for (int i=0; i<iters; i++) {
+    waitOps(posted, (uint64_t)(opts->depth-1)*opsPerColl);
+    for (int n=0; n<opts->nComms; n++) NCCLCHECK(postColl(comms[n], nChannels, opts->steps, opts->pattern, 0, postNs));
+    posted += opsPerColl;
+    if (opts->priority) {
+      double start = timeUs();
+      NCCLCHECK(postColl(comms[0], nChannels, 1, benchRing, 1, &highPostNs));
+      highPosted += 2*nChannels;
+      while (__atomic_load_n(&completedHighOps, __ATOMIC_ACQUIRE) < highPosted) {
+        if (stepNs) usleep(1);
+        else sched_yield();
+      }
+      *highUs += timeUs() - start;
+    }
+  }
+  waitOps(posted, 0);
+  return ncclSuccess;
+}
+
+static void usage(const char* exe) {
+  printf("Usage: %s [-c maxChannels] [-i iterations] [-d depth] [-s steps] [-l stepUs] [-n comms] [-t ring|tree|p2p] [-p]\n", exe);
+  printf("  -d : collectives in flight (default 8)\n");
+  printf("  -s : steps of each operation, going through 3 (send) or 4 (recv) stages (default 1)\n");
+  printf("  -l : microseconds between progress calls which progress (default 0)\n");
+  printf("  -n : communicators each collective is posted on (default 1)\n");
+  printf("  -t : pattern of the collectives (default ring)\n");
+  printf("  -p : post and wait for a high priority ring collective of one step after each collective\n");
+}
+
+int main(int argc, char* argv[]) {
+  struct benchOptions opts = { 16, 100000, 8, 1, 0, 1, 0, benchRing };
+  int opt;
+  while ((opt = getopt(argc, argv, "c:i:d:s:l:n:t:ph")) != -1) {
+    switch (opt) {
+      case 'c': opts.maxChannels = atoi(optarg); break;
+      case 'i': opts.iters = atoi(optarg); break;
+      case 'd': opts.depth = atoi(optarg); break;
+      case 's': opts.steps = atoi(optarg); break;
+      case 'l': opts.stepUs = atoi(optarg); break;
+      case 'n': opts.nComms = atoi(optarg); break;
+      case 't':
+        opts.pattern = -1;
+        for (int p=benchRing; p<=benchP2p; p++) if (strcmp(optarg, benchPatternNames[p]) == 0) opts.pattern = p;
+        break;
+      case 'p': opts.priority = 1; break;
+      default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (opts.maxChannels < 1 || opts.maxChannels > MAXCHANNELS || opts.iters < 1 || opts.depth < 1 || opts.steps < 1 || opts.stepUs < 0 || opts.nComms < 1 || opts.pattern < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  stepNs = opts.stepUs*1000ULL;
+
+  struct ncclComm** comms = (struct ncclComm**)calloc(opts.nComms, sizeof(struct ncclComm*));
+  struct ncclPeer** peers = (struct ncclPeer**)calloc(opts.nComms, sizeof(struct ncclPeer*));
+  transportNs = (uint64_t*)calloc(opts.nComms, sizeof(uint64_t));
+  for (int n=0; n<opts.nComms; n++) {
+    // Ranks tell communicators apart in logs and profiles, and index transportNs
+    if (fakeCommInit(comms+n, peers+n, n, opts.maxChannels, opts.pattern) != ncclSuccess) return 1;
+    if (ncclProxyCreate(comms[n]) != ncclSuccess) return 1;
+  }
+
+  printf("# %d %s collectives per size on %d communicators, %d in flight, %d steps per operation, %d us between progress calls\n",
+      opts.iters, benchPatternNames[opts.pattern], opts.nComms, opts.depth, opts.steps, opts.stepUs);
+  printf("# %10s %12s %14s %14s %14s %14s %14s %10s %14s %10s %10s %12s %14s\n", "channels", "ops/coll", "Mops/s", "us/coll", "main cpu(s)", "proxy cpu(s)",
+      "proxy busy(%)", "ns/pass", "transport(%)", "post(ns)", "sleeps", "wakeup(us)", "high prio(us)");
+  // Counters of the first communicator
+  struct ncclProxyIdleStats* stats = &comms[0]->proxyState.stats;
+  for (int nChannels=1; nChannels<=opts.maxChannels; nChannels*=2) {
+    // Warm up, which also fills the pool
+    double highUs;
+    uint64_t postNs;
+    if (runChannels(comms, nChannels, opts.depth, &opts, &highUs, &postNs) != ncclSuccess) return 1;
+    // The proxy thread updates its counters, they are only indicative until it stops
+    struct ncclProxyIdleStats statsStart = *stats;
+    uint64_t transportStart = __atomic_load_n(transportNs, __ATOMIC_RELAXED);
+    double start = timeUs(), cpuStart = cpuUs(RUSAGE_SELF), mainStart = cpuUs(RUSAGE_THREAD);
+    if (runChannels(comms, nChannels, opts.iters, &opts, &highUs, &postNs) != ncclSuccess) return 1;
+    double us = timeUs() - start;
+    double mainCpu = cpuUs(RUSAGE_THREAD) - mainStart;
+    double proxyCpu = cpuUs(RUSAGE_SELF) - cpuStart - mainCpu;
+    int opsPerColl = benchPatternOps[opts.pattern]*nChannels*opts.nComms;
+    double ops = (double)opsPerColl*opts.iters;
+    double busyNs = stats->busyNs-statsStart.busyNs;
+    // Passes over operations, progressing or polling them
+    double runNs = busyNs + stats->spinNs-statsStart.spinNs;
+    double totalNs = runNs + stats->sleepNs-statsStart.sleepNs;
+    double fakeNs = __atomic_load_n(transportNs, __ATOMIC_RELAXED)-transportStart;
+    uint64_t passes = stats->passes-statsStart.passes;
+    uint64_t wakeups = stats->wakeups-statsStart.wakeups;
+    printf("  %10d %12d %14.3f %14.3f %14.3f %14.3f %14.1f %10.1f %14.1f %10.1f %10lu %12.1f %14.3f\n", nChannels, opsPerColl, ops/us, us/opts.iters, mainCpu/1e6, proxyCpu/1e6,
+        totalNs ? 100*busyNs/totalNs : 0, passes ? runNs/passes : 0, runNs ? 100*fakeNs/runNs : 0, (double)postNs/opts.iters/opts.nComms,
+        stats->sleeps-statsStart.sleeps, wakeups ? (stats->wakeupNs-statsStart.wakeupNs)/1e3/wakeups : 0,
+        highUs/opts.iters);
+    fflush(stdout);
+  }
+
+  printf("# Proxy operations of the first communicator : %zu KB on NUMA node %d\n", comms[0]->proxyState.poolSize/1024, comms[0]->proxyState.numaNode);
+  for (int n=0; n<opts.nComms; n++) {
+    if (comms[n]->fatalError != ncclSuccess) {
+      printf("Proxy thread of communicator %d failed : %d\n", n, comms[n]->fatalError);
+      return 1;
+    }
+  }
+  // Freeing the (unallocated) shared buffers may fail without a GPU runtime, the proxy thread is stopped already
+  for (int n=0; n<opts.nComms; n++) {
+    ncclProxyDestroy(comms[n]);
+    ncclProxyFree(comms[n]);
+    free(peers[n]);
+    free(comms[n]);
+  }
+  free(comms);
+  free(peers);
+  free(transportNs);
+  return 0;
+}
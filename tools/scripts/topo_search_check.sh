@@ -0,0 +1,101 @@
+#!/bin/bash
+# Copyright (c) 2021 Advanced Micro Devices, Inc. All rights reserved.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+
+# Compares the graphs found by topo_expl with and without pruning the topology search
+# (RCCL_TOPO_SEARCH_PRUNE), and the time taken. Fails if any graph gets less bandwidth
+# (channels x speed) with pruning, if topo_expl fails, or if both runs do not find the same
+# (non zero) number of graphs.
+#
+# Usage: topo_search_check.sh [model_id ...]   (all models by default)
+
+DIR="$(cd -P "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+TOPO_EXPL=${TOPO_EXPL:-$DIR/../topo_expl/topo_expl}
+
+if [[ ! -x $TOPO_EXPL ]]
+then
+	echo "Build $TOPO_EXPL first"
+	exit 1
+fi
+
+MODELS="$@"
+if [[ -z $MODELS ]]
+then
+	MODELS=$(seq 0 68)
+fi
+
+# Runs topo_expl on model $1 with RCCL_TOPO_SEARCH_PRUNE=$2, prints the time in ms and the
+# exit status of topo_expl, then "nChannels speed" of each graph
+run_model() {
+	local envs="RCCL_TOPO_SEARCH_PRUNE=$2 RCCL_GRAPH_CACHE_DIR="
+	if [[ $1 -eq 50 ]] || [[ $1 -eq 51 ]]
+	then
+		envs="$envs NCCL_COLLNET_ENABLE=1"
+	elif [[ $1 -eq 54 ]]
+	then
+		envs="$envs RCCL_ENABLE_MULTIPLE_SAT=1 NCCL_COLLNET_ENABLE=1"
+	fi
+	local start=$(date +%s%N)
+	local out
+	out=$(env $envs $TOPO_EXPL -m $1 2>&1)
+	local rc=$?
+	local end=$(date +%s%N)
+	echo $(( (end-start)/1000000 )) $rc
+	echo "$out" | sed -n 's/.*Pattern [0-9]*, crossNic [0-9]*, nChannels \([0-9]*\), speed \([0-9.]*\)\/.*/\1 \2/p'
+}
+
+fail=0
+total_off=0
+total_on=0
+printf "%6s %10s %10s %10s %10s %s\n" model "ms(off)" "ms(on)" "bw(off)" "bw(on)" ""
+for m in $MODELS
+do
+	off=$(run_model $m 0)
+	on=$(run_model $m 1)
+	read ms_off rc_off <<< "$(echo "$off" | head -1)"
+	read ms_on rc_on <<< "$(echo "$on" | head -1)"
+	total_off=$((total_off+ms_off))
+	total_on=$((total_on+ms_on))
+	graphs_off=$(echo "$off" | tail -n +2 | grep -c .)
+	graphs_on=$(echo "$on" | tail -n +2 | grep -c .)
+	if [[ $rc_off -ne 0 ]] || [[ $rc_on -ne 0 ]]
+	then
+		printf "%6s %10s %10s %s\n" $m $ms_off $ms_on "FAILED (topo_expl exit status $rc_off off, $rc_on on)"
+		fail=1
+		continue
+	fi
+	if [[ $graphs_off -eq 0 ]] || [[ $graphs_off -ne $graphs_on ]]
+	then
+		printf "%6s %10s %10s %s\n" $m $ms_off $ms_on "FAILED ($graphs_off graphs off, $graphs_on on)"
+		fail=1
+		continue
+	fi
+	# Compare graphs one by one
+	result=$(paste <(echo "$off" | tail -n +2) <(echo "$on" | tail -n +2) | awk '
+		{ off += $1*$2; on += $3*$4; if ($3*$4 < $1*$2) worse++; else if ($3*$4 > $1*$2) better++ }
+		END { printf "%g %g %s\n", off, on, worse ? "REGRESSION" : better ? "better" : "" }')
+	printf "%6s %10s %10s %10s %10s %s\n" $m $ms_off $ms_on $result
+	if [[ $result == *REGRESSION* ]]
+	then
+		fail=1
+	fi
+done
+printf "%6s %10s %10s\n" total $total_off $total_on
+exit $fail
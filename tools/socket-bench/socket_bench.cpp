@@ -0,0 +1,380 @@
+/*************************************************************************
+ * Copyright (c) 2021 Advanced Micro Devices, Inc. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+// CPU-only benchmark of the socket network transport.
+// Runs a sender and a receiver process over the loopback interface and reports,
+// for each message size, the bandwidth and the CPU time used by the transport,
+// including its helper threads (NCCL_SOCKET_NTHREADS, NCCL_NSOCKS_PERTHREAD), and
+// the number of syscalls per message. RCCL_SOCKET_ZEROCOPY=1 enables zero-copy sends;
+// on loopback the kernel still copies, which shows in the "copied" column.
+// With -l, runs a ping-pong instead and reports the p50/p99 one-way latency, e.g.
+// to evaluate RCCL_SOCKET_INLINE_THRESHOLD on small messages. With RCCL_SOCKET_ADAPTIVE=1,
+// the stripe count and minimum chunk size picked by the sender are reported as they settle.
+// With -u, both sides use the io_uring engine instead of helper threads, with the
+// buffers registered ; io_uring_enter calls count as send or recv calls.
+// RCCL_SOCKET_MULTIRAIL=1 spreads the sockets over all interfaces matching
+// NCCL_SOCKET_IFNAME, e.g. loopback aliases (ip addr add 127.0.0.2/8 dev lo label lo:1).
+// With -m, all requests in flight are tested at once with the batched test of the engine,
+// like the network proxy does, instead of testing the oldest one.
+
+#include "core.h"
+#include "net.h"
+#include "devcomm.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+extern ncclNet_t ncclNetSocket;
+extern ncclNet_t ncclNetSocketUring;
+static ncclNet_t* net = &ncclNetSocket;
+static ncclNetTestMany_t testMany = ncclSocketTestMany;
+
+struct sideResult {
+  double us;
+  double cpuUs;       // Process CPU time, all threads
+  double helperCpuUs; // CPU time of the helper threads only
+  struct ncclSocketStats stats;
+  struct ncclSocketTuning tuning;
+  int measured; // Set by the sender once its CPU times are valid
+  int status;
+};
+
+struct benchOptions {
+  size_t minBytes;
+  size_t maxBytes;
+  int iters;
+  int depth; // Outstanding requests
+  int latency;
+  int uring;
+  int testMany;
+};
+
+static double timeUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e6 + ts.tv_nsec*1e-3;
+}
+
+static double cpuUs(int who) {
+  struct rusage ru;
+  getrusage(who, &ru);
+  return ru.ru_utime.tv_sec*1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_sec*1e6 + ru.ru_stime.tv_usec;
+}
+
+// Moves iters messages of size bytes, keeping up to depth requests in flight.
+// Requests complete in order, like in the proxy.
+static ncclResult_t runSide(void* comm, void* mhandle, int send, char* buff, int size, struct benchOptions* opts) {
+  void* requests[NCCL_MAX_STEPS];
+  int sizes[NCCL_MAX_STEPS];
+  int posted = 0, done = 0;
+  while (done < opts->iters) {
+    while (posted < opts->iters && posted-done < opts->depth) {
+      char* data = buff + (size_t)(posted%opts->depth)*size;
+      if (send) {
+        // Tag both ends of the message so that the receiver can check them
+        if (size >= (int)sizeof(int)) {
+          memcpy(data, &posted, sizeof(int));
+          memcpy(data+size-sizeof(int), &posted, sizeof(int));
+        }
+        NCCLCHECK(net->isend(comm, data, size, mhandle, requests+posted%opts->depth));
+      } else {
+        NCCLCHECK(net->irecv(comm, data, size, mhandle, requests+posted%opts->depth));
+      }
+      posted++;
+    }
+    int isDone = 0, recvSize;
+    if (opts->testMany) {
+      // Test every request in flight, completed ones are NULL until their turn
+      void* inFlight[NCCL_MAX_STEPS];
+      int slots[NCCL_MAX_STEPS], dones[NCCL_MAX_STEPS], doneSizes[NCCL_MAX_STEPS], n = 0;
+      for (int i=done; i<posted; i++) {
+        if (requests[i%opts->depth] == NULL) continue;
+        inFlight[n] = requests[i%opts->depth];
+        slots[n++] = i%opts->depth;
+      }
+      NCCLCHECK(testMany(inFlight, n, dones, doneSizes));
+      for (int i=0; i<n; i++) {
+        if (dones[i] == 0) continue;
+        requests[slots[i]] = NULL;
+        sizes[slots[i]] = doneSizes[i];
+      }
+      isDone = requests[done%opts->depth] == NULL;
+      recvSize = sizes[done%opts->depth];
+    } else {
+      NCCLCHECK(net->test(requests[done%opts->depth], &isDone, &recvSize));
+    }
+    if (isDone) {
+      if (!send && recvSize != size) {
+        WARN("Received %d bytes instead of %d", recvSize, size);
+        return ncclInternalError;
+      }
+      char* data = buff + (size_t)(done%opts->depth)*size;
+      int head = done, tail = done;
+      if (!send && size >= (int)sizeof(int)) {
+        memcpy(&head, data, sizeof(int));
+        memcpy(&tail, data+size-sizeof(int), sizeof(int));
+      }
+      if (head != done || tail != done) {
+        WARN("Message %d received with tags %d/%d", done, head, tail);
+        return ncclInternalError;
+      }
+      done++;
+    } else {
+      sched_yield(); // Like the proxy thread when no request progressed
+    }
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t runSize(void* comm, void* mhandle, int send, char* buff, int size, struct benchOptions* opts, struct sideResult* result) {
+  // Warm up, which also starts the helper threads
+  int iters = opts->iters;
+  opts->iters = opts->depth;
+  NCCLCHECK(runSide(comm, mhandle, send, buff, size, opts));
+  opts->iters = iters;
+
+  struct ncclSocketStats before, after;
+  NCCLCHECK(ncclSocketGetStats(comm, &before));
+  double start = timeUs(), cpuStart = cpuUs(RUSAGE_SELF), mainStart = cpuUs(RUSAGE_THREAD);
+  NCCLCHECK(runSide(comm, mhandle, send, buff, size, opts));
+  result->us = timeUs() - start;
+  NCCLCHECK(ncclSocketGetStats(comm, &after));
+  result->stats.sendCalls = after.sendCalls - before.sendCalls;
+  result->stats.recvCalls = after.recvCalls - before.recvCalls;
+  result->stats.zcCalls = after.zcCalls - before.zcCalls;
+  result->stats.zcBytes = after.zcBytes - before.zcBytes;
+  result->stats.zcCopied = after.zcCopied - before.zcCopied;
+  result->stats.errqueueCalls = after.errqueueCalls - before.errqueueCalls;
+  result->stats.enterCalls = after.enterCalls - before.enterCalls;
+  NCCLCHECK(ncclSocketGetTuning(comm, &result->tuning));
+  result->cpuUs = cpuUs(RUSAGE_SELF) - cpuStart;
+  result->helperCpuUs = result->cpuUs - (cpuUs(RUSAGE_THREAD) - mainStart);
+  return ncclSuccess;
+}
+
+static ncclResult_t waitRequest(void* request, int* size) {
+  int done = 0;
+  while (1) {
+    NCCLCHECK(net->test(request, &done, size));
+    if (done) return ncclSuccess;
+    sched_yield();
+  }
+}
+
+// Ping-pong side : the first side sends then receives, the other one the opposite
+static ncclResult_t pingPong(void* sendComm, void* recvComm, void** mhandles, int first, char* buff, int size, int iters, double* halfRtts) {
+  void* request;
+  int recvSize;
+  for (int i=-1; i<iters; i++) {
+    double start = timeUs();
+    for (int step=0; step<2; step++) {
+      if ((step == 0) == (first == 1)) {
+        NCCLCHECK(net->isend(sendComm, buff, size, mhandles[0], &request));
+        NCCLCHECK(waitRequest(request, NULL));
+      } else {
+        NCCLCHECK(net->irecv(recvComm, buff, size, mhandles[1], &request));
+        NCCLCHECK(waitRequest(request, &recvSize));
+        if (recvSize != size) {
+          WARN("Received %d bytes instead of %d", recvSize, size);
+          return ncclInternalError;
+        }
+      }
+    }
+    if (i >= 0 && halfRtts) halfRtts[i] = (timeUs() - start)/2;
+  }
+  return ncclSuccess;
+}
+
+static int runLatency(struct benchOptions* opts) {
+  // One listen comm per direction. Connections complete in the listen backlog, so
+  // each side can connect before accepting.
+  char handles[2][NCCL_NET_HANDLE_MAXSIZE];
+  void* listenComms[2];
+  for (int d=0; d<2; d++) {
+    if (net->listen(0, handles[d], listenComms+d) != ncclSuccess) return 1;
+  }
+  char* buff = (char*)calloc(opts->maxBytes, 1);
+  pid_t pid = fork();
+  int me = pid == 0 ? 1 : 0;
+  void* sendComm, *recvComm;
+  if (net->connect(0, handles[1-me], &sendComm) != ncclSuccess) return 1;
+  if (net->accept(listenComms[me], &recvComm) != ncclSuccess) return 1;
+  void* mhandles[2];
+  if (net->regMr(sendComm, buff, opts->maxBytes, NCCL_PTR_HOST, mhandles) != ncclSuccess) return 1;
+  if (net->regMr(recvComm, buff, opts->maxBytes, NCCL_PTR_HOST, mhandles+1) != ncclSuccess) return 1;
+
+  if (me == 0) {
+    printf("# Ping-pong latency, %d iterations\n", opts->iters);
+    printf("# %12s %12s %12s %12s %12s %12s\n", "size(B)", "p50(us)", "p99(us)", "max(us)", "send calls", "recv calls");
+  }
+  std::vector<double> halfRtts(opts->iters);
+  int errors = 0;
+  for (size_t size=opts->minBytes; size<=opts->maxBytes; size*=2) {
+    struct ncclSocketStats sendBefore, sendAfter, recvBefore, recvAfter;
+    ncclSocketGetStats(sendComm, &sendBefore);
+    ncclSocketGetStats(recvComm, &recvBefore);
+    if (pingPong(sendComm, recvComm, mhandles, me == 0, buff, size, opts->iters, halfRtts.data()) != ncclSuccess) {
+      errors++;
+      break;
+    }
+    ncclSocketGetStats(sendComm, &sendAfter);
+    ncclSocketGetStats(recvComm, &recvAfter);
+    if (me == 1) continue;
+    std::sort(halfRtts.begin(), halfRtts.end());
+    // Syscalls per message, warm up included
+    printf("  %12zu %12.1f %12.1f %12.1f %12.1f %12.1f\n", size, halfRtts[opts->iters/2], halfRtts[(opts->iters*99)/100],
+        halfRtts[opts->iters-1], (double)(sendAfter.sendCalls+sendAfter.enterCalls-sendBefore.sendCalls-sendBefore.enterCalls)/(opts->iters+1),
+        (double)(recvAfter.recvCalls+recvAfter.enterCalls-recvBefore.recvCalls-recvBefore.enterCalls)/(opts->iters+1));
+    fflush(stdout);
+  }
+  net->deregMr(sendComm, mhandles[0]);
+  net->deregMr(recvComm, mhandles[1]);
+  net->closeSend(sendComm);
+  net->closeRecv(recvComm);
+  for (int d=0; d<2; d++) net->closeListen(listenComms[d]);
+  free(buff);
+  if (me == 1) _exit(errors ? 1 : 0);
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) errors++;
+  return errors ? 1 : 0;
+}
+
+static void usage(const char* exe) {
+  printf("Usage: %s [-b minBytes] [-e maxBytes] [-i iterations] [-d depth] [-l] [-u] [-m]\n", exe);
+  printf("  -l : ping-pong latency, from 8B to 64KB by default\n");
+  printf("  -u : io_uring engine (RCCL_SOCKET_IO_URING) instead of helper threads\n");
+  printf("  -m : test all requests in flight at once\n");
+  printf("  NCCL_SOCKET_NTHREADS (default 2), NCCL_NSOCKS_PERTHREAD (default 4), RCCL_SOCKET_ZEROCOPY\n");
+  printf("  RCCL_SOCKET_INLINE_THRESHOLD, RCCL_SOCKET_ADAPTIVE and RCCL_SOCKET_MULTIRAIL apply to both sides.\n");
+}
+
+int main(int argc, char* argv[]) {
+  struct benchOptions opts = { 0, 0, 100, 4, 0, 0, 0 };
+  int opt;
+  while ((opt = getopt(argc, argv, "b:e:i:d:lumh")) != -1) {
+    switch (opt) {
+      case 'b': opts.minBytes = strtoull(optarg, NULL, 0); break;
+      case 'e': opts.maxBytes = strtoull(optarg, NULL, 0); break;
+      case 'i': opts.iters = atoi(optarg); break;
+      case 'd': opts.depth = atoi(optarg); break;
+      case 'l': opts.latency = 1; break;
+      case 'u': opts.uring = 1; break;
+      case 'm': opts.testMany = 1; break;
+      default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (opts.minBytes == 0) opts.minBytes = opts.latency ? 8 : 64*1024;
+  if (opts.maxBytes == 0) opts.maxBytes = std::max(opts.minBytes, opts.latency ? (size_t)64*1024 : (size_t)64*1024*1024);
+  if (opts.minBytes < 1 || opts.maxBytes < opts.minBytes || opts.maxBytes > INT_MAX || opts.iters < 1 ||
+      opts.depth < 1 || opts.depth > NCCL_MAX_STEPS) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // Everything runs on this host. Auto-detection does not spawn helper threads on lo.
+  setenv("NCCL_SOCKET_IFNAME", "lo", 0);
+  setenv("NCCL_SOCKET_NTHREADS", "2", 0);
+  setenv("NCCL_NSOCKS_PERTHREAD", "4", 0);
+  if (opts.uring) {
+    net = &ncclNetSocketUring;
+    testMany = ncclSocketUringTestMany;
+  }
+  if (net->init(ncclDebugLog) != ncclSuccess) return 1;
+  if (opts.latency) return runLatency(&opts);
+
+  char handle[NCCL_NET_HANDLE_MAXSIZE];
+  void* listenComm;
+  if (net->listen(0, handle, &listenComm) != ncclSuccess) return 1;
+
+  struct sideResult* results = (struct sideResult*)mmap(NULL, 2*sizeof(struct sideResult),
+      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) { perror("mmap"); return 1; }
+  int syncPipe[2];
+  if (pipe(syncPipe) != 0) { perror("pipe"); return 1; }
+  char* buff = (char*)malloc(opts.maxBytes*opts.depth);
+  memset(buff, 1, opts.maxBytes*opts.depth);
+
+  const char* zeroCopy = getenv("RCCL_SOCKET_ZEROCOPY");
+  printf("# %s, NCCL_SOCKET_NTHREADS=%s NCCL_NSOCKS_PERTHREAD=%s RCCL_SOCKET_ZEROCOPY=%s, %d iterations, %d requests in flight\n",
+      opts.uring ? "io_uring" : "helper threads", getenv("NCCL_SOCKET_NTHREADS"), getenv("NCCL_NSOCKS_PERTHREAD"),
+      zeroCopy ? zeroCopy : "0", opts.iters, opts.depth);
+  printf("# %12s %10s %14s %14s %14s %14s %12s %12s %10s %10s %8s %10s %6s\n", "size(B)", "GB/s", "send cpu(s)", "recv cpu(s)", "helpers cpu(s)", "GB/cpu-s",
+      "send calls", "recv calls", "zc(%)", "copied(%)", "stripes", "minchunk", "rails");
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Sender
+    void* sendComm;
+    void* mhandle;
+    if (net->connect(0, handle, &sendComm) != ncclSuccess) _exit(1);
+    if (net->regMr(sendComm, buff, opts.maxBytes*opts.depth, NCCL_PTR_HOST, &mhandle) != ncclSuccess) _exit(1);
+    for (size_t size=opts.minBytes; size<=opts.maxBytes; size*=2) {
+      char go;
+      if (read(syncPipe[0], &go, 1) != 1) _exit(1);
+      if (runSize(sendComm, mhandle, 1, buff, size, &opts, results) != ncclSuccess) results[0].status = 1;
+      __atomic_store_n(&results[0].measured, 1, __ATOMIC_SEQ_CST);
+      if (results[0].status) _exit(1);
+    }
+    net->deregMr(sendComm, mhandle);
+    net->closeSend(sendComm);
+    _exit(0);
+  }
+
+  // Receiver
+  void* recvComm;
+  int errors = 0;
+  void* mhandle;
+  if (net->accept(listenComm, &recvComm) != ncclSuccess) return 1;
+  if (net->regMr(recvComm, buff, opts.maxBytes*opts.depth, NCCL_PTR_HOST, &mhandle) != ncclSuccess) return 1;
+  for (size_t size=opts.minBytes; size<=opts.maxBytes; size*=2) {
+    char go = 1;
+    if (write(syncPipe[1], &go, 1) != 1) return 1;
+    if (runSize(recvComm, mhandle, 0, buff, size, &opts, results+1) != ncclSuccess) {
+      errors++;
+      break;
+    }
+    double seconds = results[1].us/1e6;
+    double bytes = (double)size*opts.iters;
+    // The sender measured its CPU time over the same transfers
+    while (__atomic_load_n(&results[0].measured, __ATOMIC_SEQ_CST) == 0) sched_yield();
+    if (results[0].status) {
+      errors++;
+      break;
+    }
+    double cpu = (results[0].cpuUs + results[1].cpuUs)/1e6;
+    // Syscalls per message, share of bytes sent with MSG_ZEROCOPY, and share of those the kernel copied
+    struct ncclSocketStats* ss = &results[0].stats;
+    struct ncclSocketStats* rs = &results[1].stats;
+    struct ncclSocketTuning* tuning = &results[0].tuning;
+    printf("  %12zu %10.2f %14.3f %14.3f %14.3f %14.2f %12.1f %12.1f %10.1f %10.1f %5d/%-2d %10d %6d\n", size, bytes/seconds/1e9,
+        results[0].cpuUs/1e6, results[1].cpuUs/1e6, (results[0].helperCpuUs + results[1].helperCpuUs)/1e6, bytes/cpu/1e9,
+        (double)(ss->sendCalls + ss->errqueueCalls + ss->enterCalls)/opts.iters, (double)(rs->recvCalls + rs->enterCalls)/opts.iters,
+        100.0*ss->zcBytes/bytes, ss->zcCalls ? 100.0*ss->zcCopied/ss->zcCalls : 0.0,
+        tuning->stripes, tuning->nSocks, tuning->minChunkSize, tuning->nRails);
+    fflush(stdout);
+    results[0].measured = 0;
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) errors++;
+  net->deregMr(recvComm, mhandle);
+  net->closeRecv(recvComm);
+  net->closeListen(listenComm);
+  free(buff);
+  munmap(results, 2*sizeof(struct sideResult));
+  return errors ? 1 : 0;
+}
@@ -137,6 +137,7 @@ NodeModelDesc model_descs[] = {
   {4, "topo_16p1h_vm.xml",      "4 nodes 16P1H VM"},
   {1, "topo_8p1h.xml",          "single node 8P1H"},
   {4, "topo_8p1h.xml",          "4 nodes 8P1H"},
+  {4, "topo_8p_rome_2port.xml", "4 nodes 8 gfx908 Rome 4 NICs one with a slower port"},
 };
 
 int main(int argc,char* argv[])
@@ -219,7 +220,7 @@ int main(int argc,char* argv[])
   for (int i = 0; i < nranks; i++) {
     node_model = network.GetNode(i);
     assert(node_model!=0);
-    initTransportsRank_1(&comm[i], allGather1Data, allGather3Data, treeGraph[i], ringGraph[i], collNetGraph[i]);
+    NCCLCHECK(initTransportsRank_1(&comm[i], allGather1Data, allGather3Data, treeGraph[i], ringGraph[i], collNetGraph[i]));
   }
 
   for (int i = 0; i < nranks; i++) {
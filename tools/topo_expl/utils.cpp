@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <dlfcn.h>
+#include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -123,6 +124,7 @@ ncclResult_t ncclTopoGetSystem(const char* xmlTopoFile, struct ncclTopoSystem**
   NCCLCHECK(ncclCalloc(&xml, 1));
   NCCLCHECK(ncclTopoGetXmlFromFile(xmlTopoFile, xml, 0));
   NCCLCHECK(ncclTopoGetSystemFromXml(xml, system));
+  NCCLCHECK(ncclTopoHashXml(xml, &(*system)->xmlHash));
   free(xml);
   return ncclSuccess;
 }
@@ -457,6 +459,58 @@ ncclResult_t ncclTransportCollNetFree(struct ncclComm* comm) {
   return ncclSuccess;
 }
 
+// Appends the type, width and hops of all the paths of the system to paths. Hops are followed
+// from next hop to next hop, giving up after NCCL_TOPO_MAX_HOPS in case they loop.
+static void getAllPaths(struct ncclTopoSystem* system, std::vector<int>& paths) {
+  for (int t1=0; t1<NCCL_TOPO_NODE_TYPES; t1++) {
+    for (int n1=0; n1<system->nodes[t1].count; n1++) {
+      struct ncclTopoNode* node1 = system->nodes[t1].nodes+n1;
+      for (int t2=0; t2<NCCL_TOPO_NODE_TYPES; t2++) {
+        if (node1->paths[t2] == NULL) continue;
+        for (int n2=0; n2<system->nodes[t2].count; n2++) {
+          struct ncclTopoLinkList* path = node1->paths[t2]+n2;
+          int width;
+          memcpy(&width, &path->width, sizeof(width));
+          paths.insert(paths.end(), { t1, n1, t2, n2, path->count, path->type, width });
+          if (path->count == 0) continue;
+          struct ncclTopoNode* node = node1;
+          struct ncclTopoNode* dest = system->nodes[t2].nodes+n2;
+          int type = t2, index = n2;
+          if (path->cpu != -1) {
+            dest = system->nodes[CPU].nodes+path->cpu;
+            type = CPU, index = path->cpu;
+          }
+          for (int h=0; node != dest && h<NCCL_TOPO_MAX_HOPS; h++) {
+            if (node->paths[type] == NULL) break;
+            int l = node->paths[type][index].link;
+            if (l < 0 || l >= node->nlinks) break;
+            node = node->links[l].remNode;
+            paths.push_back(node->type*NCCL_TOPO_MAX_NODES + (node-system->nodes[node->type].nodes));
+            if (node == dest && type != t2) {
+              dest = system->nodes[t2].nodes+n2;
+              type = t2, index = n2;
+            }
+          }
+          paths.push_back(-1);
+        }
+      }
+    }
+  }
+}
+
+// Checks that the paths updated while removing nodes are those computed from scratch
+static ncclResult_t checkTrimmedPaths(struct ncclComm* comm) {
+  std::vector<int> trimmed, computed;
+  getAllPaths(comm->topo, trimmed);
+  NCCLCHECK(ncclTopoComputePaths(comm->topo, comm->peerInfo));
+  getAllPaths(comm->topo, computed);
+  if (trimmed != computed) {
+    WARN("Paths updated while trimming the system differ from the paths computed after trimming");
+    return ncclInternalError;
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t initTransportsRank_1(struct ncclComm* comm, struct allGather1Data_t *allGather1Data, struct allGather3Data_t *allGather3Data,
   struct ncclTopoGraph& treeGraph, struct ncclTopoGraph& ringGraph, struct ncclTopoGraph& collNetGraph) {
   int rank = comm->rank;
@@ -543,8 +597,14 @@ ncclResult_t initTransportsRank_1(struct ncclComm* comm, struct allGather1Data_t
   NCCLCHECK(ncclTopoComputePaths(comm->topo, comm->peerInfo));
   // Remove inaccessible GPUs and unused NICs
   NCCLCHECK(ncclTopoTrimSystem(comm->topo, comm));
-  // Recompute paths after trimming
-  NCCLCHECK(ncclTopoComputePaths(comm->topo, comm->peerInfo));
+  // Recompute paths after trimming, if removing nodes could not update them (see ncclTopoRemoveNode)
+  // [RCCL]
+  if (comm->topo->pathsStale) {
+    NCCLCHECK(ncclTopoComputePaths(comm->topo, comm->peerInfo));
+  } else {
+    NCCLCHECK(checkTrimmedPaths(comm));
+  }
+  // [/RCCL]
   // Init search
   NCCLCHECK(ncclTopoSearchInit(comm->topo));
   // Print final topology